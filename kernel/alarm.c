@@ -54,7 +54,7 @@ sys_sigalarm(void)
 	p->sigalarm_fn = fn_addr;
 	p->ticks_counter = 0;
 	if (!p->alarm_tf) {
-		p->alarm_tf = kalloc();
+		p->alarm_tf = kalloc_flags(0);
 		if (p->alarm_tf == 0)
 			panic("alarm_tf kalloc");
 	}
@@ -22,33 +22,64 @@
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "reclaim.h"
 
+// Buffers are allocated from a slab cache. The cache holds up to
+// NBUF buffers before it starts recycling unused ones, and grows
+// beyond that only while every buffer is in use. bshrink() gives
+// unused buffers back when memory runs short.
 struct {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct kmem_cache *cache;
+  int nbuf;      // buffers on the list
+  int nwait;     // processes waiting in bget() for a buffer
 
   // Linked list of all buffers, through prev/next.
   // head.next is most recently used.
   struct buf head;
 } bcache;
 
+static int bshrink(int);
+
+static struct shrinker bcache_shrinker = {
+  .name = "bcache",
+  .shrink = bshrink,
+  .cost = SHRINK_COST_CACHE,
+};
+
 void
 binit(void)
 {
-  struct buf *b;
-
   initlock(&bcache.lock, "bcache");
+  if(!kmem_cache_create(&bcache.cache, "buf", sizeof(struct buf)))
+    panic("binit");
 
   // Create linked list of buffers
   bcache.head.prev = &bcache.head;
   bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
+
+  shrinker_register(&bcache_shrinker);
+}
+
+// Allocate a new buffer, or return 0 if out of memory.
+static struct buf*
+bnew(void)
+{
+  struct buf *b;
+
+  b = kmem_cache_alloc(bcache.cache, 0);
+  if(b == 0)
+    return 0;
+  initsleeplock(&b->lock, "buffer");
+  b->disk = 0;
+  return b;
+}
+
+static void
+bfree(struct buf *b)
+{
+  freelock(&b->lock.lk);
+  kmem_cache_free(bcache.cache, b);
 }
 
 // Look through buffer cache for block on device dev.
@@ -57,33 +88,75 @@ binit(void)
 static struct buf*
 bget(uint dev, uint blockno)
 {
-  struct buf *b;
+  struct buf *b, *nb;
+  int tried;
 
+  nb = 0;
+  tried = 0;
   acquire(&bcache.lock);
 
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
+  for(;;){
+    // Is the block already cached?
+    for(b = bcache.head.next; b != &bcache.head; b = b->next){
+      if(b->dev == dev && b->blockno == blockno){
+        b->refcnt++;
+        release(&bcache.lock);
+        if(nb)
+          bfree(nb);
+        acquiresleep(&b->lock);
+        return b;
+      }
+    }
+
+    // Not cached; add the new buffer if one was allocated.
+    if(nb){
+      nb->dev = dev;
+      nb->blockno = blockno;
+      nb->valid = 0;
+      nb->refcnt = 1;
+      nb->next = bcache.head.next;
+      nb->prev = &bcache.head;
+      bcache.head.next->prev = nb;
+      bcache.head.next = nb;
+      bcache.nbuf++;
       release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+      acquiresleep(&nb->lock);
+      return nb;
+    }
+
+    // Recycle an unused buffer, once the cache is big enough
+    // or if there is no memory for a new one.
+    if(bcache.nbuf >= NBUF || tried){
+      for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
+        if(b->refcnt == 0) {
+          b->dev = dev;
+          b->blockno = blockno;
+          b->valid = 0;
+          b->refcnt = 1;
+          release(&bcache.lock);
+          acquiresleep(&b->lock);
+          return b;
+        }
+      }
     }
-  }
 
-  // Not cached; recycle an unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
+    if(!tried){
+      // Allocate a new buffer without holding bcache.lock,
+      // since memory reclaim may call bshrink(). Then look
+      // again, in case someone cached the block meanwhile.
       release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+      nb = bnew();
+      acquire(&bcache.lock);
+      tried = 1;
+      continue;
     }
+
+    // Out of memory, and every buffer is in use.
+    bcache.nwait++;
+    sleep(&bcache, &bcache.lock);
+    bcache.nwait--;
+    tried = 0;
   }
-  panic("bget: no buffers");
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -100,6 +173,30 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Like n calls to bread(): return the distinct blocks
+// blocknos[0..n-1] in b[0..n-1], locked and with their
+// contents. Blocks not cached are read with one disk
+// request per run of consecutive block numbers.
+void
+bread_batch(uint dev, uint *blocknos, int n, struct buf **b)
+{
+  int i, j, k;
+
+  for(i = 0; i < n; i++)
+    b[i] = bget(dev, blocknos[i]);
+
+  for(i = 0; i < n; i = j){
+    j = i + 1;
+    if(b[i]->valid)
+      continue;
+    while(j < n && !b[j]->valid && blocknos[j] == blocknos[j-1] + 1)
+      j++;
+    virtio_disk_rw_batch(&b[i], j - i, 0);
+    for(k = i; k < j; k++)
+      b[k]->valid = 1;
+  }
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -129,8 +226,10 @@ brelse(struct buf *b)
     b->prev = &bcache.head;
     bcache.head.next->prev = b;
     bcache.head.next = b;
+    if(bcache.nwait)
+      wakeup(&bcache);
   }
-  
+
   release(&bcache.lock);
 }
 
@@ -145,7 +244,46 @@ void
 bunpin(struct buf *b) {
   acquire(&bcache.lock);
   b->refcnt--;
+  if(b->refcnt == 0 && bcache.nwait)
+    wakeup(&bcache);
   release(&bcache.lock);
 }
 
+// The buffer cache's shrinker: free enough unused buffers, least
+// recently used first, to make up about npages pages. An unused
+// buffer holds no changes that are not on disk: the log pins the
+// buffers it has yet to write. Returns the number of pages freed.
+// Frees nothing if bcache.lock is busy, since the allocation that
+// called reclaim may hold it.
+static int
+bshrink(int npages)
+{
+  struct buf *b, *prev, *victims;
+  int n;
+
+  n = (npages * PGSIZE + sizeof(struct buf) - 1) / sizeof(struct buf);
+  victims = 0;
+  if(!tryacquire(&bcache.lock))
+    return 0;
+  for(b = bcache.head.prev; b != &bcache.head && n > 0; b = prev){
+    prev = b->prev;
+    if(b->refcnt == 0){
+      b->next->prev = b->prev;
+      b->prev->next = b->next;
+      b->next = victims;
+      victims = b;
+      bcache.nbuf--;
+      n--;
+    }
+  }
+  release(&bcache.lock);
+
+  while((b = victims) != 0){
+    victims = b->next;
+    bfree(b);
+  }
+
+  return kmem_cache_shrink(bcache.cache);
+}
+
 
@@ -6,11 +6,21 @@
 #include "defs.h"
 
 // Buddy allocator
+//
+// This is the physical page allocator's backend: it hands out
+// physically contiguous, naturally aligned runs of 2^k pages, and
+// kalloc.c caches small blocks per CPU in front of it.
+//
+// Every operation is O(nsizes) at worst and needs no searching:
+// the size of an allocated block is recorded in a per-leaf order
+// byte, and a bitmask of non-empty free lists finds the smallest
+// usable block with a single count-trailing-zeros.
 
 static int nsizes;     // the number of entries in bd_sizes array
 
-#define LEAF_SIZE     16                         // The smallest block size
+#define LEAF_SIZE     PGSIZE                     // The smallest block size
 #define MAXSIZE       (nsizes-1)                 // Largest index in bd_sizes array
+#define LEAF_SHIFT    PGSHIFT                    // log2(LEAF_SIZE)
 #define BLK_SIZE(k)   ((1L << (k)) * LEAF_SIZE)  // Size of block at size k
 #define HEAP_SIZE     BLK_SIZE(MAXSIZE) 
 #define NBLK(k)       (1 << (MAXSIZE-k))         // Number of block at size k
@@ -19,46 +29,80 @@ static int nsizes;     // the number of entries in bd_sizes array
 typedef struct list Bd_list;
 
 // The allocator has sz_info for each size k. Each sz_info has a free
-// list, an array alloc to keep track which blocks have been
-// allocated, and an split array to to keep track which blocks have
-// been split.  The arrays are of type char (which is 1 byte), but the
-// allocator uses 1 bit per block (thus, one char records the info of
-// 8 blocks).
+// list and an array alloc to keep track which blocks have been
+// allocated or split. The array uses 1 bit per block, packed into
+// 64-bit words.
 struct sz_info {
   Bd_list free;
-  char *alloc;
-  char *split;
+  uint64 *alloc;
 };
 typedef struct sz_info Sz_info;
 
 static Sz_info *bd_sizes; 
+static uchar *bd_order;  // size k of the allocated block starting at each leaf
+static uint64 bd_avail;  // bit k set if bd_sizes[k].free is non-empty
 static void *bd_base;   // start address of memory managed by the buddy allocator
 static struct spinlock lock;
+static uint64 bd_nfree_bytes;  // bytes on the free lists
 
 // Return 1 if bit at position index in array is set to 1
-int bit_isset(char *array, int index) {
-  char b = array[index/8];
-  char m = (1 << (index % 8));
-  return (b & m) == m;
+static inline int
+bit_isset(uint64 *array, int index) {
+  return (array[index/64] >> (index % 64)) & 1;
 }
 
 // Set bit at position index in array to 1
-void bit_set(char *array, int index) {
-  char b = array[index/8];
-  char m = (1 << (index % 8));
-  array[index/8] = (b | m);
+static inline void
+bit_set(uint64 *array, int index) {
+  array[index/64] |= 1UL << (index % 64);
 }
 
 // Clear bit at position index in array
-void bit_clear(char *array, int index) {
-  char b = array[index/8];
-  char m = (1 << (index % 8));
-  array[index/8] = (b & ~m);
+static inline void
+bit_clear(uint64 *array, int index) {
+  array[index/64] &= ~(1UL << (index % 64));
+}
+
+// Index of the lowest set bit of x, which must not be 0. The kernel
+// is not linked against libgcc and the base ISA has no ctz
+// instruction, so use a de Bruijn multiply-and-lookup.
+static int
+ctz64(uint64 x) {
+  static const uchar debruijn[64] = {
+     0,  1,  2, 53,  3,  7, 54, 27,  4, 38, 41,  8, 34, 55, 48, 28,
+    62,  5, 39, 46, 44, 42, 22,  9, 24, 35, 59, 56, 49, 18, 29, 11,
+    63, 52,  6, 26, 37, 40, 33, 47, 61, 45, 43, 21, 23, 58, 17, 10,
+    51, 25, 36, 32, 60, 20, 57, 16, 50, 31, 19, 15, 30, 14, 13, 12,
+  };
+
+  return debruijn[((x & -x) * 0x022fdd63cc95386dUL) >> 58];
+}
+
+// Free list operations that keep bd_avail up to date.
+static void
+bd_push(int k, void *p) {
+  lst_push(&bd_sizes[k].free, p);
+  bd_avail |= 1UL << k;
+}
+
+static void *
+bd_pop(int k) {
+  void *p = lst_pop(&bd_sizes[k].free);
+  if(lst_empty(&bd_sizes[k].free))
+    bd_avail &= ~(1UL << k);
+  return p;
+}
+
+static void
+bd_remove(int k, void *p) {
+  lst_remove(p);
+  if(lst_empty(&bd_sizes[k].free))
+    bd_avail &= ~(1UL << k);
 }
 
 // Print a bit vector as a list of ranges of 1 bits
 void
-bd_print_vector(char *vector, int len) {
+bd_print_vector(uint64 *vector, int len) {
   int last, lb;
   
   last = 1;
@@ -85,10 +129,6 @@ bd_print() {
     lst_print(&bd_sizes[k].free);
     printf("  alloc:");
     bd_print_vector(bd_sizes[k].alloc, NBLK(k));
-    if(k > 0) {
-      printf("  split:");
-      bd_print_vector(bd_sizes[k].split, NBLK(k));
-    }
   }
 }
 
@@ -106,73 +146,95 @@ firstk(uint64 n) {
 }
 
 // Compute the block index for address p at size k
-int
+static inline int
 blk_index(int k, char *p) {
-  int n = p - (char *) bd_base;
-  return n / BLK_SIZE(k);
+  return (p - (char *) bd_base) >> (k + LEAF_SHIFT);
 }
 
 // Convert a block index at size k back into an address
-void *addr(int k, int bi) {
-  int n = bi * BLK_SIZE(k);
-  return (char *) bd_base + n;
+static inline void *
+addr(int k, int bi) {
+  return (char *) bd_base + ((uint64) bi << (k + LEAF_SHIFT));
 }
 
-// allocate nbytes, but malloc won't return anything smaller than LEAF_SIZE
-void *
-bd_malloc(uint64 nbytes)
+// Allocate a block of size fk. The caller must hold lock.
+static void *
+bd_alloc(int fk)
 {
-  int fk, k;
-
-  acquire(&lock);
+  uint64 avail;
+  int k;
 
-  // Find a free block >= nbytes, starting with smallest k possible
-  fk = firstk(nbytes);
-  for (k = fk; k < nsizes; k++) {
-    if(!lst_empty(&bd_sizes[k].free))
-      break;
-  }
-  if(k >= nsizes) { // No free blocks?
-    release(&lock);
+  // Find the smallest non-empty free list of size >= fk.
+  if(fk >= nsizes)
+    return 0;
+  avail = bd_avail & ~((1UL << fk) - 1);
+  if(avail == 0) { // No free blocks?
     return 0;
   }
+  k = ctz64(avail);
 
   // Found a block; pop it and potentially split it.
-  char *p = lst_pop(&bd_sizes[k].free);
+  char *p = bd_pop(k);
   bit_set(bd_sizes[k].alloc, blk_index(k, p));
   for(; k > fk; k--) {
     // split a block at size k and mark one half allocated at size k-1
     // and put the buddy on the free list at size k-1
     char *q = p + BLK_SIZE(k-1);   // p's buddy
-    bit_set(bd_sizes[k].split, blk_index(k, p));
     bit_set(bd_sizes[k-1].alloc, blk_index(k-1, p));
-    lst_push(&bd_sizes[k-1].free, q);
+    bd_push(k-1, q);
   }
+  bd_order[blk_index(0, p)] = fk;
+  bd_nfree_bytes -= BLK_SIZE(fk);
+
+  return p;
+}
+
+// allocate nbytes, but malloc won't return anything smaller than LEAF_SIZE
+void *
+bd_malloc(uint64 nbytes)
+{
+  void *p;
+
+  acquire(&lock);
+  p = bd_alloc(firstk(nbytes));
   release(&lock);
 
   return p;
 }
 
-// Find the size of the block that p points to.
+// Allocate up to n blocks of nbytes each into blocks[], taking the
+// lock only once. Returns the number of blocks allocated.
 int
-size(char *p) {
-  for (int k = 0; k < nsizes; k++) {
-    if(bit_isset(bd_sizes[k+1].split, blk_index(k+1, p))) {
-      return k;
-    }
+bd_malloc_batch(uint64 nbytes, void **blocks, int n)
+{
+  int i, fk;
+
+  fk = firstk(nbytes);
+  acquire(&lock);
+  for (i = 0; i < n; i++) {
+    if((blocks[i] = bd_alloc(fk)) == 0)
+      break;
   }
-  return 0;
+  release(&lock);
+
+  return i;
 }
 
-// Free memory pointed to by p, which was earlier allocated using
-// bd_malloc.
-void
-bd_free(void *p) {
+// Find the size of the allocated block that p points to.
+static inline int
+size(char *p) {
+  return bd_order[blk_index(0, p)];
+}
+
+// Free block p. The caller must hold lock.
+static void
+bd_release(void *p) {
   void *q;
   int k;
 
-  acquire(&lock);
-  for (k = size(p); k < MAXSIZE; k++) {
+  k = size(p);
+  bd_nfree_bytes += BLK_SIZE(k);
+  for (; k < MAXSIZE; k++) {
     int bi = blk_index(k, p);
     int buddy = (bi % 2 == 0) ? bi+1 : bi-1;
     bit_clear(bd_sizes[k].alloc, bi);  // free p at size k
@@ -181,18 +243,56 @@ bd_free(void *p) {
     }
     // budy is free; merge with buddy
     q = addr(k, buddy);
-    lst_remove(q);    // remove buddy from free list
+    bd_remove(k, q);    // remove buddy from free list
     if(buddy % 2 == 0) {
       p = q;
     }
-    // at size k+1, mark that the merged buddy pair isn't split
-    // anymore
-    bit_clear(bd_sizes[k+1].split, blk_index(k+1, p));
   }
-  lst_push(&bd_sizes[k].free, p);
+  bd_push(k, p);
+}
+
+// Free memory pointed to by p, which was earlier allocated using
+// bd_malloc.
+void
+bd_free(void *p) {
+  acquire(&lock);
+  bd_release(p);
+  release(&lock);
+}
+
+// Turn allocated block p into allocated leaf blocks, so that its
+// pages can be freed one at a time.
+void
+bd_split(void *p) {
+  char *q;
+  int j, k;
+
+  acquire(&lock);
+  k = size(p);
+  for (j = 0; j < k; j++) {
+    for (q = p; q < (char *) p + BLK_SIZE(k); q += BLK_SIZE(j))
+      bit_set(bd_sizes[j].alloc, blk_index(j, q));
+  }
+  for (q = p; q < (char *) p + BLK_SIZE(k); q += LEAF_SIZE)
+    bd_order[blk_index(0, q)] = 0;
+  release(&lock);
+}
+
+// Free n blocks, taking the lock only once.
+void
+bd_free_batch(void **blocks, int n) {
+  acquire(&lock);
+  for (int i = 0; i < n; i++)
+    bd_release(blocks[i]);
   release(&lock);
 }
 
+// Number of free pages (leaf blocks) on the free lists.
+uint64
+bd_nfree(void) {
+  return bd_nfree_bytes / LEAF_SIZE;
+}
+
 // Compute the first block at size k that doesn't contain p
 int
 blk_index_next(int k, char *p) {
@@ -225,10 +325,6 @@ bd_mark(void *start, void *stop)
     bi = blk_index(k, start);
     bj = blk_index_next(k, stop);
     for(; bi < bj; bi++) {
-      if(k > 0) {
-        // if a block is allocated at size k, mark it as split too.
-        bit_set(bd_sizes[k].split, bi);
-      }
       bit_set(bd_sizes[k].alloc, bi);
     }
   }
@@ -244,9 +340,9 @@ bd_initfree_pair(int k, int bi) {
     // one of the pair is free
     free = BLK_SIZE(k);
     if(bit_isset(bd_sizes[k].alloc, bi))
-      lst_push(&bd_sizes[k].free, addr(k, buddy));   // put buddy on free list
+      bd_push(k, addr(k, buddy));   // put buddy on free list
     else
-      lst_push(&bd_sizes[k].free, addr(k, bi));      // put bi on free list
+      bd_push(k, addr(k, bi));      // put bi on free list
   }
   return free;
 }
@@ -261,8 +357,12 @@ bd_initfree(void *bd_left, void *bd_right) {
   for (int k = 0; k < MAXSIZE; k++) {   // skip max size
     int left = blk_index_next(k, bd_left);
     int right = blk_index(k, bd_right);
+    if(left >= NBLK(k))
+      continue;
     free += bd_initfree_pair(k, left);
-    if(right <= left)
+    // If memory ends exactly at the end of the heap there is no
+    // block at index right.
+    if(right <= left || right >= NBLK(k))
       continue;
     free += bd_initfree_pair(k, right);
   }
@@ -292,17 +392,21 @@ bd_mark_unavailable(void *end, void *left) {
 }
 
 // Initialize the buddy allocator: it manages memory from [base, end).
+//
+// A block is only aligned to its size in physical memory if bd_base
+// is, so the heap starts at KERNBASE and the kernel image below base
+// is marked allocated along with the allocator's own metadata.
 void
 bd_init(void *base, void *end) {
   char *p = (char *) ROUNDUP((uint64)base, LEAF_SIZE);
   int sz;
 
   initlock(&lock, "buddy");
-  bd_base = (void *) p;
+  bd_base = (void *) KERNBASE;
 
   // compute the number of sizes we need to manage [base, end)
-  nsizes = log2(((char *)end-p)/LEAF_SIZE) + 1;
-  if((char*)end-p > BLK_SIZE(MAXSIZE)) {
+  nsizes = log2(((char *)end-(char *)bd_base)/LEAF_SIZE) + 1;
+  if((char*)end-(char *)bd_base > BLK_SIZE(MAXSIZE)) {
     nsizes++;  // round up to the next power of 2
   }
 
@@ -317,20 +421,16 @@ bd_init(void *base, void *end) {
   // initialize free list and allocate the alloc array for each size k
   for (int k = 0; k < nsizes; k++) {
     lst_init(&bd_sizes[k].free);
-    sz = sizeof(char)* ROUNDUP(NBLK(k), 8)/8;
-    bd_sizes[k].alloc = p;
+    sz = sizeof(uint64) * ROUNDUP(NBLK(k), 64)/64;
+    bd_sizes[k].alloc = (uint64 *) p;
     memset(bd_sizes[k].alloc, 0, sz);
     p += sz;
   }
 
-  // allocate the split array for each size k, except for k = 0, since
-  // we will not split blocks of size k = 0, the smallest size.
-  for (int k = 1; k < nsizes; k++) {
-    sz = sizeof(char)* (ROUNDUP(NBLK(k), 8))/8;
-    bd_sizes[k].split = p;
-    memset(bd_sizes[k].split, 0, sz);
-    p += sz;
-  }
+  // allocate the order byte for each leaf.
+  bd_order = (uchar *) p;
+  memset(bd_order, 0, NBLK(0));
+  p += NBLK(0);
   p = (char *) ROUNDUP((uint64) p, LEAF_SIZE);
 
   // done allocating; mark the memory range [base, p) as allocated, so
@@ -350,5 +450,6 @@ bd_init(void *base, void *end) {
     printf("free %d %d\n", free, BLK_SIZE(MAXSIZE)-meta-unavailable);
     panic("bd_init: free mem");
   }
+  bd_nfree_bytes = free;
 }
 
@@ -65,6 +65,11 @@ consolewrite(struct file *f, int user_src, uint64 src, int n)
 {
   int i;
 
+  // either_copyin() can't read pages in from swap or a file with
+  // cons.lock held.
+  if(user_src)
+    uvm_fault_in(myproc()->pagetable, src, n);
+
   acquire(&cons.lock);
   for(i = 0; i < n; i++){
     char c;
@@ -91,6 +96,10 @@ consoleread(struct file *f, int user_dst, uint64 dst, int n)
   char cbuf;
 
   target = n;
+  // either_copyout() can't read pages in from swap or a file with
+  // cons.lock held.
+  if(user_dst)
+    uvm_fault_in(myproc()->pagetable, dst, n);
   acquire(&cons.lock);
   while(n > 0){
     // wait until interrupt handler has put some
@@ -8,10 +8,14 @@ struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct tlb_batch;
+struct vma;
+struct vmstat;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+void            bread_batch(uint, uint*, int, struct buf**);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
 void            bpin(struct buf*);
@@ -35,6 +39,7 @@ int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
 
 // fs.c
 void            fsinit(int);
@@ -52,6 +57,7 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
+void            readpages(struct inode*, uint, char**, int);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
@@ -63,10 +69,32 @@ void            ramdiskrw(struct buf*);
 
 // kalloc.c
 void*           kalloc(void);
+void*           kalloc_flags(int);
+int             kzero_refill(void);
+void*           kalloc_pages(int);
+void*           kalloc_pages_flags(int, int);
+void            kfree_pages(void *, int);
+void            kalloc_pages_split(void *, int);
+#define KALLOC_ZERO     0x1  // kalloc_flags(), kalloc_pages_flags(): zero-fill
 void            kfree(void *);
 void            kinit(void);
 void		kalloc_refcnt_add(void *);
 void		kalloc_refcnt_dec(void *);
+int		kalloc_refcnt_get(void *);
+int		kalloc_refcnt_release(void *);
+void		kalloc_page_used(void *);
+uint		kalloc_page_idle(void *);
+void		kmem_stats_print(void);
+void		kmem_stats_reset(void);
+uint64		kmem_nfree(void);
+
+// reclaim.c
+struct shrinker;
+void		reclaiminit(void);
+void		shrinker_register(struct shrinker *);
+int		reclaim(int);
+int		reclaim_idle(void);
+void		reclaim_stats_print(void);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -90,7 +118,8 @@ void            printfinit(void);
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
-int             growproc(int);
+int             kthread_create(char *, void (*)(void));
+uint64          growproc(int, int);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
@@ -108,6 +137,11 @@ void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
+void            proc_walk_begin(void);
+void            proc_walk_end(void);
+
+// start.c
+int             timertick(void);
 
 // swtch.S
 void            swtch(struct context*, struct context*);
@@ -116,7 +150,9 @@ void            swtch(struct context*, struct context*);
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
 void            initlock(struct spinlock*, char*);
+void            freelock(struct spinlock*);
 void            release(struct spinlock*);
+int             tryacquire(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
 uint64          sys_ntas(void);
@@ -127,10 +163,15 @@ void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
 
-// string.c
+// mem.c
 int             memcmp(const void*, const void*, uint);
+void*           memcpy(void*, const void*, uint);
 void*           memmove(void*, const void*, uint);
 void*           memset(void*, int, uint);
+void            memzero_page(void*);
+void            memcpy_page(void*, const void*);
+
+// string.c
 char*           safestrcpy(char*, const char*, int);
 int             strlen(const char*);
 int             strncmp(const char*, const char*, uint);
@@ -152,6 +193,41 @@ void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
 
+// tlb.c
+void		tlbinit(void);
+uint64		tlb_activate(struct proc *);
+void		tlb_ipi(void);
+void		tlb_batch_init(struct tlb_batch *, struct proc *);
+void		tlb_batch_add(struct tlb_batch *, uint64, uint64);
+void		tlb_batch_flush(struct tlb_batch *);
+void		tlb_flush_page(struct proc *, uint64);
+void		tlb_flush_all(struct proc *);
+void		tlb_switch_kernel(struct proc *);
+
+// swap.c
+void		swapinit(int, struct superblock *);
+int		swap_write(void *);
+int		swap_read(uint, void *);
+void		swap_dup(uint);
+void		swap_free(uint);
+
+// pcache.c
+void		pcacheinit(void);
+void		*pcache_lookup(struct inode *, uint);
+void		*pcache_get(struct inode *, uint);
+int		pcache_readahead(struct inode *, uint, int);
+void		pcache_update(struct inode *, uint, void *, uint);
+void		pcache_drop(struct inode *);
+
+// ksm.c
+void		ksminit(void);
+void		ksm_stat(struct vmstat *);
+
+// wss.c
+void		wss_scan(struct proc *);
+void		wss_tick(struct proc *);
+int		wss_report(char *, int);
+
 // uart.c
 void            uartinit(void);
 void            uartintr(void);
@@ -162,21 +238,31 @@ int             uartgetc(void);
 void            kvminit(void);
 void            kvminithart(void);
 void            kvmmap(uint64, uint64, uint64, int);
+uint64          kvmunmap(uint64);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
 pagetable_t     uvmcreate(void);
 void            uvminit(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvm_protect(pagetable_t, uint64, uint64, int, int);
+int             uvm_dirty(pagetable_t, uint64);
 void            uvmfree(pagetable_t, uint64);
-void            uvmunmap(pagetable_t, uint64, uint64, int);
+int             uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
 void		 vmprint(pagetable_t);
-int		uvm_handle_page_fault(struct proc *, uint64);
+int		uvm_handle_page_fault(struct proc *, uint64, int);
+int             uvm_populate(struct proc *, uint64, uint64);
+void            uvm_fault_in(pagetable_t, uint64, uint64);
+pte_t*          uvm_merge_pte(struct proc *, uint64);
+pagetable_t     uvm_kview_create(void);
+void            uvm_kview_free(pagetable_t);
+void            uvm_kview_sync(struct proc *);
+uint64          uaccess_fault(uint64, uint64);
 
 // plic.c
 void            plicinit(void);
@@ -187,34 +273,33 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_rw_batch(struct buf **, int, int);
+void            virtio_disk_rw_page(uint, void *, int);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
 
 // slab_alloc.c
-/*
- * To simplify, set the size of one slab to always be one page.
- */
-#define SLAB_LIM 4096
-
-struct kmem_cache {
-	int align;
-	void *slab;
-	uint size;
-	uint len;
-	struct kmem_cache *prev;
-	struct kmem_cache *next;
-};
+struct kmem_cache;
 
-int kmem_cache_create(struct kmem_cache **, int);
+void kmem_cache_init(void);
+int kmem_cache_create(struct kmem_cache **, char *, int);
 void *kmem_cache_alloc(struct kmem_cache *, int);
-void kmem_cache_free(struct kmem_cache **, void *);
+void kmem_cache_free(struct kmem_cache *, void *);
+int kmem_cache_shrink(struct kmem_cache *);
+int kmem_cache_report(char *, int);
+int kmem_put_str(char *, int, int, char *, int);
+int kmem_put_num(char *, int, int, uint64, int);
 
 // buddy.c
 void           bd_init(void*,void*);
 void           bd_free(void*);
 void           *bd_malloc(uint64);
+int            bd_malloc_batch(uint64, void**, int);
+void           bd_free_batch(void**, int);
+void           bd_split(void*);
+uint64         bd_nfree(void);
 
 struct list {
   struct list *next;
@@ -249,6 +334,16 @@ void	dev_uptime_init();
 int	dev_uptime_read(struct file *, int, uint64, int);
 int	dev_uptime_write(struct file *, int, uint64, int);
 
+// dev/dev_slabinfo.c
+void	dev_slabinfo_init();
+int	dev_slabinfo_read(struct file *, int, uint64, int);
+int	dev_slabinfo_write(struct file *, int, uint64, int);
+
+// dev/dev_wss.c
+void	dev_wss_init();
+int	dev_wss_read(struct file *, int, uint64, int);
+int	dev_wss_write(struct file *, int, uint64, int);
+
 // dev/dev_main.c
 void	dev_special_init();
 
@@ -260,5 +355,22 @@ int argfd(int, int *, struct file **);
 int atoi(const char *);
 
 // mmap.c
-struct mmap_info *mmap_info_get(struct proc *, uint64);
-int mmap_pagefault_handle(struct mmap_info *, uint64, void *);
+int mmap_pagefault_handle(struct proc *, struct vma *, uint64);
+void mmap_readahead(struct vma *, uint64);
+int mmap_unmap(struct proc *, uint64, uint64);
+void mmap_exit(struct proc *);
+void mmap_stat(struct vmstat *);
+
+// vma.c
+void vmainit(void);
+struct vma *vma_next(struct proc *, uint64);
+struct vma *vma_find(struct proc *, uint64);
+int vma_perms(struct vma *);
+int vma_add(struct vma **, uint64, uint64, int, int);
+void vma_free(struct vma *);
+int vma_copy(struct proc *, struct proc *);
+int vma_map(struct proc *, uint64, uint64, int, int, int, struct file *, uint64);
+int vma_unmap(struct proc *, uint64, uint64);
+int vma_protect(struct proc *, uint64, uint64, int);
+int vma_brk(struct proc *, uint64);
+uint64 vma_gap(struct proc *, uint64);
@@ -17,6 +17,8 @@ void dev_special_init(void)
 {
 	dev_null_init();	/* /dev/null	*/
 	dev_random_init();	/* /dev/random	*/
+	dev_slabinfo_init();	/* /dev/slabinfo	*/
+	dev_wss_init();		/* /dev/wss	*/
 	dev_uptime_init();	/* /dev/uptime	*/
 	dev_zero_init();	/* /dev/zero	*/
 }
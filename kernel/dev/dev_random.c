@@ -28,7 +28,7 @@ dev_random_read(struct file *f, int user_dst, uint64 dst, int n)
 	if (n > PGSIZE)
 		return -1;
 
-	mem = kalloc();
+	mem = kalloc_flags(0);
 	if (!mem)
 		return -1;
 
@@ -0,0 +1,65 @@
+/*
+ * Read + write functions for /dev/slabinfo device.
+ */
+
+#include "../types.h"
+#include "../riscv.h"
+#include "../spinlock.h"
+#include "../sleeplock.h"
+#include "../fs.h"
+#include "../file.h"
+#include "../defs.h"
+
+/*
+ * The report is built in a block of 2^SLABINFO_ORDER pages.
+ */
+#define SLABINFO_ORDER	2
+
+/*
+ * Read from the slabinfo device. Reads return a table of the kernel's object
+ * caches: object size, objects per slab, slabs, objects allocated from the
+ * slab layer, and the per-CPU magazine hits and misses. The table is rebuilt
+ * on every read, and the file offset is advanced so that reading to the end
+ * gives an end-of-file.
+ */
+int
+dev_slabinfo_read(struct file *f, int user_dst, uint64 dst, int n)
+{
+	char *buf;
+	int len;
+
+	buf = (char *) kalloc_pages(SLABINFO_ORDER);
+	if (!buf)
+		return -1;
+
+	len = kmem_cache_report(buf, PGSIZE << SLABINFO_ORDER);
+	if (f->off >= len) {
+		n = 0;
+	} else {
+		if (n > len - f->off)
+			n = len - f->off;
+		if (either_copyout(user_dst, dst, buf + f->off, n) < 0)
+			n = -1;
+		else
+			f->off += n;
+	}
+
+	kfree_pages(buf, SLABINFO_ORDER);
+
+	return n;
+}
+
+/*
+ * Write to the slabinfo device. Writes to the slabinfo device are discarded.
+ */
+int
+dev_slabinfo_write(struct file *f, int user_dst, uint64 dst, int n)
+{
+	return n;
+}
+
+void dev_slabinfo_init(void)
+{
+	devsw[SPECIAL_SLABINFO].read = dev_slabinfo_read;
+	devsw[SPECIAL_SLABINFO].write = dev_slabinfo_write;
+}
@@ -23,7 +23,7 @@ dev_uptime_read(struct file *f, int user_dst, uint64 dst, int n)
 	char *str_buf;
 	uint64 time;
 
-	str_buf = (char *) kalloc();
+	str_buf = (char *) kalloc_flags(0);
 	if (!str_buf)
 		return -1;
 
@@ -0,0 +1,66 @@
+/*
+ * Read + write functions for /dev/wss device.
+ */
+
+#include "../types.h"
+#include "../riscv.h"
+#include "../spinlock.h"
+#include "../sleeplock.h"
+#include "../fs.h"
+#include "../file.h"
+#include "../defs.h"
+
+
+/*
+ * The report is built in a block of 2^WSS_ORDER pages.
+ */
+#define WSS_ORDER	2
+
+/*
+ * Read from the wss device. Reads return a table of each process's working
+ * set, as last sampled (see wss.c): resident, dirty and recently accessed
+ * pages, the working-set estimate, and the pages in each idle-time range of
+ * struct wss's age[]. The table is rebuilt on every read, and the file offset
+ * is advanced so that reading to the end gives an end-of-file.
+ */
+int
+dev_wss_read(struct file *f, int user_dst, uint64 dst, int n)
+{
+	char *buf;
+	int len;
+
+	buf = (char *) kalloc_pages(WSS_ORDER);
+	if (!buf)
+		return -1;
+
+	len = wss_report(buf, PGSIZE << WSS_ORDER);
+	if (f->off >= len) {
+		n = 0;
+	} else {
+		if (n > len - f->off)
+			n = len - f->off;
+		if (either_copyout(user_dst, dst, buf + f->off, n) < 0)
+			n = -1;
+		else
+			f->off += n;
+	}
+
+	kfree_pages(buf, WSS_ORDER);
+
+	return n;
+}
+
+/*
+ * Write to the wss device. Writes to the wss device are discarded.
+ */
+int
+dev_wss_write(struct file *f, int user_dst, uint64 dst, int n)
+{
+	return n;
+}
+
+void dev_wss_init(void)
+{
+	devsw[SPECIAL_WSS].read = dev_wss_read;
+	devsw[SPECIAL_WSS].write = dev_wss_write;
+}
@@ -18,21 +18,19 @@ int
 dev_zero_read(struct file *f, int user_dst, uint64 dst, int n)
 {
 	int ret;
-	char *c;
 	void *mem;
 
 	if (n > PGSIZE)
 		return -1;
 
+	/*
+	 * kalloc() hands out zero-filled pages, usually from the pre-zeroed
+	 * pool, so there is nothing left to fill in.
+	 */
 	mem = kalloc();
 	if (!mem)
 		return -1;
 
-	c = (char *) mem;
-	for (int i = 0; i < n; c++, i++) {
-		*c = 0;
-	}
-
 	ret = either_copyout(user_dst, dst, mem, n);
 	if (ret < 0)
 		return -1;
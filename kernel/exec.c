@@ -6,6 +6,7 @@
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
+#include "mman.h"
 
 static int loadseg(pde_t *pgdir, uint64 addr, struct inode *ip, uint offset, uint sz);
 
@@ -19,6 +20,7 @@ exec(char *path, char **argv)
   struct inode *ip;
   struct proghdr ph;
   pagetable_t pagetable = 0, oldpagetable;
+  struct vma *vmas = 0, *oldvmas;
   struct proc *p = myproc();
 
   begin_op();
@@ -66,7 +68,16 @@ exec(char *path, char **argv)
 
   // Allocate two pages at the next page boundary.
   // Use the second as the user stack.
+  // The program, the guard page and the stack are the new
+  // image's regions; the heap starts out empty above them.
   sz = PGROUNDUP(sz);
+  if(sz > 0 && vma_add(&vmas, 0, sz, VMA_TEXT,
+                       PROT_READ | PROT_WRITE | PROT_EXEC) < 0)
+    goto bad;
+  if(vma_add(&vmas, sz, sz + PGSIZE, VMA_GUARD, 0) < 0 ||
+     vma_add(&vmas, sz + PGSIZE, sz + 2*PGSIZE, VMA_STACK,
+             PROT_READ | PROT_WRITE | PROT_EXEC) < 0)
+    goto bad;
   uint64 sz1;
   if((sz1 = uvmalloc(pagetable, sz, sz + 2*PGSIZE)) == 0)
     goto bad;
@@ -108,13 +119,28 @@ exec(char *path, char **argv)
       last = s+1;
   safestrcpy(p->name, last, sizeof(p->name));
     
+  // Write back and let go of the old image's mapped files.
+  mmap_exit(p);
+
   // Commit to the user image.
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
+  oldvmas = p->vmas;
+  p->vmas = vmas;
+  p->heap_start = p->brk = sz;
+  p->asid = 0;      // the old one's TLB entries are stale
+  p->fault_next = 0;
+  p->fault_window = 1;
+  p->swap_hand = 0;
+  p->ksm_next = 0;
   p->sz = sz;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
+  vma_free(oldvmas);
+#ifdef UACCESS
+  uvm_kview_sync(p);
+#endif
 
   /*
    * For init process, we'd like to print the initial page table contents.
@@ -128,6 +154,7 @@ exec(char *path, char **argv)
  bad:
   if(pagetable)
     proc_freepagetable(pagetable, sz);
+  vma_free(vmas);
   if(ip){
     iunlockput(ip);
     end_op();
@@ -22,7 +22,8 @@ struct {
 void
 fileinit(void)
 {
-  kmem_cache_create(&ftable.fc, sizeof(struct file));
+  if(!kmem_cache_create(&ftable.fc, "file", sizeof(struct file)))
+    panic("fileinit");
 
   initlock(&ftable.lock, "ftable");
 }
@@ -33,19 +34,14 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-
-  f = (struct file *) kmem_cache_alloc(ftable.fc, 0);
-  if (!f) {
-    release(&ftable.lock);
+  // The file is not visible to anyone else yet, so ftable.lock is not
+  // needed; the cache's per-CPU magazines avoid any shared lock at all.
+  f = (struct file *) kmem_cache_alloc(ftable.fc, KALLOC_ZERO);
+  if (!f)
     return 0;
-  }
 
-  memset((void *) f, 0, sizeof(f));
   f->ref = 1;
 
-  release(&ftable.lock);
-
   return f;
 }
 
@@ -81,10 +77,10 @@ fileclose(struct file *f)
 
   ff = *f;
 
-  kmem_cache_free(&ftable.fc, (void *) f);
-
   release(&ftable.lock);
 
+  kmem_cache_free(ftable.fc, (void *) f);
+
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
   } else if(ff.type == FD_INODE || ff.type == FD_DEVICE) {
@@ -130,6 +126,9 @@ fileread(struct file *f, uint64 addr, int n)
       return -1;
     r = devsw[f->major].read(f, 1, addr, n);
   } else if(f->type == FD_INODE){
+    // readi() can't read pages of mapped files in with the
+    // inode locked.
+    uvm_fault_in(myproc()->pagetable, addr, n);
     ilock(f->ip);
     if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
       f->off += r;
@@ -166,6 +165,8 @@ filewrite(struct file *f, uint64 addr, int n)
     // might be writing a device like the console.
     int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
     int i = 0;
+    // nor can writei() read pages of mapped files in.
+    uvm_fault_in(myproc()->pagetable, addr, n);
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
@@ -19,6 +19,9 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *prev; // icache list
+  struct inode *next;
+  struct pcpage *pages; // cached pages (pcache.c)
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -44,3 +47,5 @@ extern struct devsw devsw[];
 #define SPECIAL_ZERO 	3
 #define SPECIAL_RANDOM	4
 #define SPECIAL_UPTIME	5
+#define SPECIAL_SLABINFO	6
+#define SPECIAL_WSS	7
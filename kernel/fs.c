@@ -20,6 +20,7 @@
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
+#include "reclaim.h"
 
 // there should be one superblock per disk device, but we run with
 // only one device
@@ -43,6 +44,7 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  swapinit(dev, &sb);
 }
 
 // Zero a block.
@@ -162,28 +164,70 @@ bfree(int dev, uint b)
 // multi-step atomic operations.
 //
 // The icache.lock spin-lock protects the allocation of icache
-// entries. Since ip->ref indicates whether an entry is free,
+// entries. Since ip->ref indicates whether an entry is in use,
 // and ip->dev and ip->inum indicate which i-node an entry
 // holds, one must hold icache.lock while using any of those fields.
 //
+// Entries are allocated from a slab cache. An entry whose ref drops
+// to zero stays cached, so that its i-node need not be read from disk
+// again. Up to NINODE entries are kept before unused ones are
+// recycled; beyond that the cache grows only while every entry is in
+// use, and ishrink() frees unused entries when memory runs short.
+//
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct kmem_cache *cache;
+  int ninode;    // entries on the list
+  int nwait;     // processes waiting in iget() for an entry
+
+  // Linked list of all entries, through prev/next.
+  // head.next is the most recently released.
+  struct inode head;
 } icache;
 
+static int ishrink(int);
+
+static struct shrinker icache_shrinker = {
+  .name = "icache",
+  .shrink = ishrink,
+  .cost = SHRINK_COST_CACHE,
+};
+
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&icache.lock, "icache");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&icache.inode[i].lock, "inode");
-  }
+  if(!kmem_cache_create(&icache.cache, "inode", sizeof(struct inode)))
+    panic("iinit");
+  icache.head.prev = &icache.head;
+  icache.head.next = &icache.head;
+
+  shrinker_register(&icache_shrinker);
+}
+
+// Allocate a new icache entry, or return 0 if out of memory.
+static struct inode*
+inew(void)
+{
+  struct inode *ip;
+
+  ip = kmem_cache_alloc(icache.cache, 0);
+  if(ip == 0)
+    return 0;
+  initsleeplock(&ip->lock, "inode");
+  ip->pages = 0;
+  return ip;
+}
+
+static void
+ifree(struct inode *ip)
+{
+  freelock(&ip->lock.lk);
+  kmem_cache_free(icache.cache, ip);
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -241,27 +285,65 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip, *nip;
+  int tried;
 
+  nip = 0;
+  tried = 0;
   acquire(&icache.lock);
 
-  // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+  for(;;){
+    // Is the inode already cached?
+    for(ip = icache.head.next; ip != &icache.head; ip = ip->next){
+      if(ip->dev == dev && ip->inum == inum){
+        ip->ref++;
+        release(&icache.lock);
+        if(nip)
+          ifree(nip);
+        return ip;
+      }
+    }
+
+    // Not cached; add the new entry if one was allocated.
+    if(nip){
+      ip = nip;
+      ip->next = icache.head.next;
+      ip->prev = &icache.head;
+      icache.head.next->prev = ip;
+      icache.head.next = ip;
+      icache.ninode++;
+      break;
+    }
+
+    // Recycle an unused entry, least recently released first,
+    // once the cache is big enough or if there is no memory for
+    // a new one.
+    if(icache.ninode >= NINODE || tried){
+      for(ip = icache.head.prev; ip != &icache.head; ip = ip->prev)
+        if(ip->ref == 0)
+          break;
+      if(ip != &icache.head)
+        break;
+    }
+
+    if(!tried){
+      // Allocate a new entry without holding icache.lock,
+      // since memory reclaim may call ishrink(). Then look
+      // again, in case someone cached the inode meanwhile.
       release(&icache.lock);
-      return ip;
+      nip = inew();
+      acquire(&icache.lock);
+      tried = 1;
+      continue;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
-  }
 
-  // Recycle an inode cache entry.
-  if(empty == 0)
-    panic("iget: no inodes");
+    // Out of memory, and every entry is in use.
+    icache.nwait++;
+    sleep(&icache, &icache.lock);
+    icache.nwait--;
+    tried = 0;
+  }
 
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
@@ -353,7 +435,58 @@ iput(struct inode *ip)
   }
 
   ip->ref--;
+  if(ip->ref == 0){
+    // No file maps it any more.
+    pcache_drop(ip);
+
+    // Keep the entry cached, as the most recently released.
+    ip->next->prev = ip->prev;
+    ip->prev->next = ip->next;
+    ip->next = icache.head.next;
+    ip->prev = &icache.head;
+    icache.head.next->prev = ip;
+    icache.head.next = ip;
+    if(icache.nwait)
+      wakeup(&icache);
+  }
+  release(&icache.lock);
+}
+
+// The inode cache's shrinker: free enough unused entries, least
+// recently released first, to make up about npages pages. An unused
+// entry holds nothing that is not on disk, since the cache is
+// write-through, and no one can have it locked. Returns the number
+// of pages freed; none if icache.lock is busy, since the allocation
+// that called reclaim may hold it.
+static int
+ishrink(int npages)
+{
+  struct inode *ip, *prev, *victims;
+  int n;
+
+  n = (npages * PGSIZE + sizeof(struct inode) - 1) / sizeof(struct inode);
+  victims = 0;
+  if(!tryacquire(&icache.lock))
+    return 0;
+  for(ip = icache.head.prev; ip != &icache.head && n > 0; ip = prev){
+    prev = ip->prev;
+    if(ip->ref == 0){
+      ip->next->prev = ip->prev;
+      ip->prev->next = ip->next;
+      ip->next = victims;
+      victims = ip;
+      icache.ninode--;
+      n--;
+    }
+  }
   release(&icache.lock);
+
+  while((ip = victims) != 0){
+    victims = ip->next;
+    ifree(ip);
+  }
+
+  return kmem_cache_shrink(icache.cache);
 }
 
 // Common idiom: unlock, then put.
@@ -412,6 +545,8 @@ itrunc(struct inode *ip)
   struct buf *bp;
   uint *a;
 
+  pcache_drop(ip);
+
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -456,6 +591,8 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
   uint tot, m;
   struct buf *bp;
+  char *pa;
+  int r;
 
   if(off > ip->size || off + n < off)
     return 0;
@@ -463,18 +600,57 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     n = ip->size - off;
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
-    if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
+    // A page of the page cache may hold writes through a
+    // shared mapping that the disk doesn't have yet.
+    if((pa = pcache_lookup(ip, off)) != 0){
+      r = either_copyout(user_dst, dst, pa + (off % PGSIZE), m);
+      kalloc_refcnt_dec(pa);
+    } else {
+      bp = bread(ip->dev, bmap(ip, off/BSIZE));
+      r = either_copyout(user_dst, dst, bp->data + (off % BSIZE), m);
       brelse(bp);
+    }
+    if(r == -1){
       tot = -1;
       break;
     }
-    brelse(bp);
   }
   return tot;
 }
 
+// Read the n pages of ip's data from off, which must be
+// page-aligned, into pages[0..n-1], as n calls to readi()
+// would, but with bread_batch(), so that the blocks not
+// cached come in together. The part of a page past the end
+// of the file is left alone, as are the page cache's pages.
+// Caller must hold ip->lock.
+void
+readpages(struct inode *ip, uint off, char **pages, int n)
+{
+  uint blocknos[READAHEAD_MAX * (PGSIZE / BSIZE)];
+  struct buf *bufs[READAHEAD_MAX * (PGSIZE / BSIZE)];
+  uint o, end;
+  int i, nb;
+
+  if(n > READAHEAD_MAX || off % PGSIZE)
+    panic("readpages");
+
+  end = off + n * PGSIZE;
+  if(end > ip->size)
+    end = ip->size;
+  nb = 0;
+  for(o = off; o < end; o += BSIZE)
+    blocknos[nb++] = bmap(ip, o / BSIZE);
+
+  bread_batch(ip->dev, blocknos, nb, bufs);
+  for(i = 0, o = off; i < nb; i++, o += BSIZE){
+    memmove(pages[(o - off) / PGSIZE] + o % PGSIZE, bufs[i]->data,
+            min(BSIZE, end - o));
+    brelse(bufs[i]);
+  }
+}
+
 // Write data to inode.
 // Caller must hold ip->lock.
 // If user_src==1, then src is a user virtual address;
@@ -500,6 +676,7 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
       brelse(bp);
       break;
     }
+    pcache_update(ip, off, bp->data + (off % BSIZE), m);
     log_write(bp);
     brelse(bp);
   }
@@ -1,6 +1,10 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// or physically contiguous runs of 2^order pages.
+//
+// The buddy allocator (buddy.c) owns all free memory;
+// single pages are cached per CPU in front of it.
 
 #include "types.h"
 #include "param.h"
@@ -8,11 +12,25 @@
 #include "spinlock.h"
 #include "riscv.h"
 #include "defs.h"
+#include "reclaim.h"
 
-void freerange(void *pa_start, void *pa_end);
-static uint kalloc_refcnt_idx(void *);
+static int kalloc_refcnt_idx(void *);
 static struct kmem_percpu *kmem_get(void);
-static struct run *kmem_steal(void);
+static struct kmem_percpu *kmem_victim(struct kmem_percpu *);
+static void kmem_refill(struct kmem_percpu *);
+static struct run *kmem_pop(struct kmem_percpu *);
+static struct run *kzero_pop(void);
+static void kmem_flush(void);
+static int kmem_reclaim(int);
+static int kzero_shrink(int);
+
+static struct shrinker kzero_shrinker = {
+	.name = "kmem_zero",
+	.shrink = kzero_shrink,
+	.cost = SHRINK_COST_FREE,
+};
+static void *kmem_small_alloc(int);
+static void kmem_small_free(void *, int);
 
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
@@ -37,221 +55,943 @@ struct run {
 };
 
 /*
- * Each CPU can maintain its own freelist and lock, and also must keep track of
- * the number of free pages it has in its freelist.
+ * A chain of free pages in transit between a CPU's freelist and the buddy
+ * allocator (or another CPU's freelist). Moving pages in batches means that the
+ * shared locks are taken once per KMEM_BATCH pages rather than once per page.
+ */
+struct kmem_batch {
+	struct run *head;
+	struct run *tail;
+	int n;
+};
+
+/*
+ * Each CPU keeps a "magazine" of free pages with its own lock. The magazine is
+ * refilled from the buddy allocator when it falls to KMEM_LOW pages and drained
+ * back to it when it grows past KMEM_HIGH pages, so a CPU only touches shared
+ * state once per batch.
  */
 struct kmem_percpu {
 	struct spinlock lock;
 	struct run *freelist;
 	uint64 nfree;
+
+	/*
+	 * Cached free blocks of orders 1 to KMEM_PCP_ORDER (small[0] holds
+	 * order 1), so that small multi-page allocations don't take the buddy
+	 * allocator's lock every time.
+	 */
+	struct {
+		void *blk[KMEM_PCP_NBLK];
+		int n;
+	} small[KMEM_PCP_ORDER];
+
+	uint64 nrefill;		// Batches pulled from the buddy allocator.
+	uint64 nsteal;		// Batches stolen from another CPU.
+	uint64 ndrain;		// Batches pushed back to the buddy allocator.
 };
 
 struct {
   struct kmem_percpu cpus[NCPU];
-  uint refcnt[(PHYSTOP - KERNBASE) / PGSIZE];
+
+  /*
+   * Free pages that are already zero-filled. Idle CPUs keep this pool topped
+   * up to KMEM_ZERO_MAX pages (see kzero_refill()), so that most zeroed
+   * allocations skip the memset.
+   */
+  struct {
+	struct spinlock lock;
+	struct run *freelist;
+	uint64 nfree;
+	uint64 nhit;		// Zeroed allocations served from the pool.
+	uint64 nmiss;		// Zeroed allocations that had to memset.
+  } zero;
+
+  int refcnt[(PHYSTOP - KERNBASE) / PGSIZE];  // References to each page.
+  uint lastuse[(PHYSTOP - KERNBASE) / PGSIZE]; // ticks when last seen in use.
 } kmem;
 
+static void kmem_batch_take(struct run **, uint64 *, struct kmem_batch *, int);
+static void kmem_batch_put(struct run **, uint64 *, struct kmem_batch *);
+static void kmem_batch_alloc(struct kmem_batch *, int);
+static void kmem_batch_free(struct kmem_batch *);
+
 // Paging is not yet turned on. Initialize the physcial page allocator.
+// All free memory starts out in the buddy allocator; the per-CPU
+// magazines fill up on demand.
 void
 kinit()
 {
 	for (int i = 0; i < NCPU; i++)
 		initlock(&kmem.cpus[i].lock, KMEM_CPU_LOCKNAMES[i]);
+	initlock(&kmem.zero.lock, "kmem_zero");
 
-	freerange(end, (void*)PHYSTOP);
-}
+	bd_init(end, (void*)PHYSTOP);
 
-void
-freerange(void *pa_start, void *pa_end)
-{
-  char *p;
-  p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+	shrinker_register(&kzero_shrinker);
 }
 
 // Free the page of physical memory pointed at by v,
 // which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// call to kalloc().
 void
 kfree(void *pa)
 {
   struct run *r;
+  struct kmem_batch b;
   struct kmem_percpu *cpu;
 
-  cpu = kmem_get();
-
+  b.head = b.tail = 0;
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+#ifdef KMEMDEBUG
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
+#endif
+
+  kmem.refcnt[kalloc_refcnt_idx(pa)] = 0;
 
   r = (struct run*)pa;
+  b.n = 0;
+
+  push_off();
+  cpu = kmem_get();
 
   acquire(&cpu->lock);
   r->next = cpu->freelist;
   cpu->freelist = r;
   cpu->nfree++;
+
+  /*
+   * The magazine is over its high watermark. Take a batch off of it while the
+   * lock is held, and hand the batch to the buddy allocator after releasing it.
+   */
+  if(cpu->nfree > KMEM_HIGH){
+    kmem_batch_take(&cpu->freelist, &cpu->nfree, &b, KMEM_BATCH);
+    cpu->ndrain++;
+  }
   release(&cpu->lock);
+
+  if(b.n > 0)
+    kmem_batch_free(&b);
+  pop_off();
 }
 
 /*
  * Allocate one 4096-byte page of physical memory from the current CPU's
  * freelist. Returns a pointer that the kernel can use. Returns 0 if the memory
  * cannot be allocated.
+ *
+ * With KALLOC_ZERO the page is zero-filled, preferably by taking it from the
+ * pre-zeroed pool. Without it the page's contents are undefined; callers that
+ * overwrite the whole page (copy-on-write copies, pipe buffers, kernel stacks)
+ * should ask for that, so that pre-zeroed pages are not spent on them.
  */
 void *
-kalloc(void)
+kalloc_flags(int flags)
 {
   struct run *r;
-  struct kmem_percpu *cpu;
+  int zeroed;
 
-  cpu = kmem_get();
+  r = 0;
+  if(flags & KALLOC_ZERO)
+    r = kzero_pop();
+  zeroed = r != 0;
 
-  acquire(&cpu->lock);
-  r = cpu->freelist;
-  if(r){
-    cpu->freelist = r->next;
-    cpu->nfree--;
-  } else
-	/*
-	 * There was no physical page found in the current CPU's freelist. Steal
-	 * a page from another CPU's freelist.
-	 */
-	r = kmem_steal();
+  if(r == 0){
+    push_off();
+    r = kmem_pop(kmem_get());
+    pop_off();
+  }
 
-  release(&cpu->lock);
+  // Out of ordinary free pages: fall back to the pre-zeroed pool.
+  if(r == 0 && (r = kzero_pop()) != 0)
+    zeroed = 1;
+
+  // Still nothing: take memory back from the kernel's caches.
+  if(r == 0 && kmem_reclaim(KMEM_RECLAIM_BATCH) > 0){
+    push_off();
+    r = kmem_pop(kmem_get());
+    pop_off();
+  }
+
+  if(r == 0)
+    return 0;
 
-  if(r) {
-    memset((char*)r, 0, PGSIZE); // Zero-out the page frame.
-    kalloc_refcnt_add(r);
+  if((flags & KALLOC_ZERO) && !zeroed){
+    memzero_page(r);
+    __sync_fetch_and_add(&kmem.zero.nmiss, 1);
+  } else if(flags & KALLOC_ZERO){
+    __sync_fetch_and_add(&kmem.zero.nhit, 1);
   }
+#ifdef KMEMDEBUG
+  else if(!zeroed)
+    memset((char*)r, 5, PGSIZE); // Fill with junk.
+#endif
+
+  kmem.refcnt[kalloc_refcnt_idx(r)] = 1;
+  kmem.lastuse[kalloc_refcnt_idx(r)] = ticks;
   return (void*)r;
 }
 
-uint64
-sys_nfree(void)
+/*
+ * Allocate one zero-filled page.
+ */
+void *
+kalloc(void)
 {
-  struct kmem_percpu *cpu;
+  return kalloc_flags(KALLOC_ZERO);
+}
 
-  cpu = kmem_get();
+/*
+ * Allocate 2^order physically contiguous pages, aligned to their combined size.
+ * Single pages come from the per-CPU caches as usual. Larger blocks come
+ * straight from the buddy allocator; if it cannot find one, the pages cached by
+ * CPUs and the zero pool are given back to it so that they can coalesce, and
+ * the allocation is retried once.
+ *
+ * As with kalloc_flags(), the pages are zero-filled only with KALLOC_ZERO;
+ * callers that overwrite the whole block should leave it out.
+ */
+void *
+kalloc_pages_flags(int order, int flags)
+{
+	char *pa;
+	int i;
+
+	if (order < 0 || order > KMEM_MAX_ORDER)
+		return 0;
+	if (order == 0)
+		return kalloc_flags(flags);
+
+	if (order <= KMEM_PCP_ORDER)
+		pa = kmem_small_alloc(order);
+	else
+		pa = bd_malloc((uint64) PGSIZE << order);
+	if (pa == 0) {
+		kmem_flush();
+		pa = bd_malloc((uint64) PGSIZE << order);
+	}
+	if (pa == 0 && kmem_reclaim(max(1 << order, KMEM_RECLAIM_BATCH)) > 0)
+		pa = bd_malloc((uint64) PGSIZE << order);
+	if (pa == 0)
+		return 0;
+
+	for (i = 0; i < (1 << order); i++) {
+		if (flags & KALLOC_ZERO)
+			memzero_page(pa + i * PGSIZE);
+#ifdef KMEMDEBUG
+		else
+			memset(pa + i * PGSIZE, 5, PGSIZE);
+#endif
+		kmem.refcnt[kalloc_refcnt_idx(pa + i * PGSIZE)] = 1;
+		kmem.lastuse[kalloc_refcnt_idx(pa + i * PGSIZE)] = ticks;
+	}
 
-  return cpu->nfree;
+	return pa;
 }
 
-static uint
-kalloc_refcnt_idx(void *pa)
+/*
+ * Allocate 2^order zero-filled pages: see kalloc_pages_flags().
+ */
+void *
+kalloc_pages(int order)
 {
-	uint idx;
-	uint64 begin, last;
+	return kalloc_pages_flags(order, KALLOC_ZERO);
+}
 
-	if ((char *) pa < end)
-		return -1;
+/*
+ * Free a block allocated by kalloc_pages() with the same order.
+ */
+void
+kfree_pages(void *pa, int order)
+{
+	int i;
 
-	begin = PGROUNDDOWN((uint64) pa);
-	last = PGROUNDUP((uint64) end);
+	if (order == 0) {
+		kfree(pa);
+		return;
+	}
 
-	idx = (begin - last) / PGSIZE;
+	if (order < 0 || order > KMEM_MAX_ORDER ||
+	    ((uint64) pa % ((uint64) PGSIZE << order)) != 0 ||
+	    (char *) pa < end || (uint64) pa >= PHYSTOP)
+		panic("kfree_pages");
 
-	return idx;
+	for (i = 0; i < (1 << order); i++) {
+#ifdef KMEMDEBUG
+		memset((char *) pa + i * PGSIZE, 1, PGSIZE);
+#endif
+		kmem.refcnt[kalloc_refcnt_idx((char *) pa + i * PGSIZE)] = 0;
+	}
+
+	if (order <= KMEM_PCP_ORDER)
+		kmem_small_free(pa, order);
+	else
+		bd_free(pa);
 }
 
+/*
+ * Let the pages of a block from kalloc_pages() be freed one at a time, with
+ * kfree() or kalloc_refcnt_dec(), rather than together with kfree_pages().
+ */
 void
-kalloc_refcnt_add(void *pa)
+kalloc_pages_split(void *pa, int order)
+{
+	if (order > 0)
+		bd_split(pa);
+}
+
+/*
+ * Take a block of the given small order from the current CPU's cache, refilling
+ * the cache with half its capacity from the buddy allocator if it is empty.
+ */
+static
+void *
+kmem_small_alloc(int order)
 {
-	uint idx;
 	struct kmem_percpu *cpu;
+	void *pa;
+	int n;
 
+	push_off();
 	cpu = kmem_get();
 
-	idx = kalloc_refcnt_idx(pa);
-	if (idx < 0)
-		return;
+	acquire(&cpu->lock);
+	n = cpu->small[order - 1].n;
+	if (n == 0) {
+		/*
+		 * The buddy lock is taken with the CPU's lock held, but never
+		 * the other way around, so this cannot deadlock.
+		 */
+		n = bd_malloc_batch((uint64) PGSIZE << order,
+			cpu->small[order - 1].blk, KMEM_PCP_NBLK / 2);
+	}
+
+	pa = 0;
+	if (n > 0)
+		pa = cpu->small[order - 1].blk[--n];
+	cpu->small[order - 1].n = n;
+	release(&cpu->lock);
+	pop_off();
+
+	return pa;
+}
+
+/*
+ * Cache a free block of the given small order on the current CPU. When the
+ * cache is full, half of it goes back to the buddy allocator first.
+ */
+static
+void
+kmem_small_free(void *pa, int order)
+{
+	struct kmem_percpu *cpu;
+	int n;
+
+	push_off();
+	cpu = kmem_get();
 
 	acquire(&cpu->lock);
-	kmem.refcnt[idx]++;
+	n = cpu->small[order - 1].n;
+	if (n == KMEM_PCP_NBLK) {
+		n -= KMEM_PCP_NBLK / 2;
+		bd_free_batch(&cpu->small[order - 1].blk[n], KMEM_PCP_NBLK / 2);
+	}
+	cpu->small[order - 1].blk[n++] = pa;
+	cpu->small[order - 1].n = n;
 	release(&cpu->lock);
+	pop_off();
 }
 
+/*
+ * Give every page cached by a CPU or by the zero pool back to the buddy
+ * allocator. No kmem lock may be held by the caller.
+ */
+static
 void
-kalloc_refcnt_dec(void *pa)
+kmem_flush(void)
+{
+	struct kmem_batch b;
+	struct kmem_percpu *cpu;
+
+	for (cpu = kmem.cpus; cpu < &kmem.cpus[NCPU]; cpu++) {
+		b.head = b.tail = 0;
+		b.n = 0;
+
+		acquire(&cpu->lock);
+		kmem_batch_take(&cpu->freelist, &cpu->nfree, &b, cpu->nfree);
+		for (int i = 0; i < KMEM_PCP_ORDER; i++) {
+			bd_free_batch(cpu->small[i].blk, cpu->small[i].n);
+			cpu->small[i].n = 0;
+		}
+		release(&cpu->lock);
+
+		kmem_batch_free(&b);
+	}
+
+	b.head = b.tail = 0;
+	b.n = 0;
+	acquire(&kmem.zero.lock);
+	kmem_batch_take(&kmem.zero.freelist, &kmem.zero.nfree, &b,
+		kmem.zero.nfree);
+	release(&kmem.zero.lock);
+
+	kmem_batch_free(&b);
+}
+
+/*
+ * Reclaim about npages pages from the kernel's caches (see reclaim.c), and give
+ * the pages cached by CPUs back to the buddy allocator so that the freed pages
+ * can coalesce. Called when an allocation would fail. Returns the number of
+ * pages freed.
+ */
+static
+int
+kmem_reclaim(int npages)
+{
+	int n;
+
+	n = reclaim(npages);
+	if (n > 0)
+		kmem_flush();
+
+	return n;
+}
+
+/*
+ * The zero pool's shrinker: give up to npages pre-zeroed pages back to the
+ * buddy allocator. They are free pages either way, but in the pool they cannot
+ * coalesce into larger blocks. Gives back none if the pool's lock is busy.
+ */
+static
+int
+kzero_shrink(int npages)
+{
+	struct kmem_batch b;
+	int n;
+
+	b.head = b.tail = 0;
+	b.n = 0;
+
+	if (!tryacquire(&kmem.zero.lock))
+		return 0;
+	kmem_batch_take(&kmem.zero.freelist, &kmem.zero.nfree, &b,
+		min(npages, kmem.zero.nfree));
+	release(&kmem.zero.lock);
+
+	n = b.n;
+	kmem_batch_free(&b);
+
+	return n;
+}
+
+/*
+ * Zero a few free pages and add them to the pre-zeroed pool. Called by idle
+ * CPUs from scheduler() with interrupts off, a few pages at a time so that the
+ * CPU notices newly runnable processes promptly. Returns the number of pages
+ * added; 0 means there is nothing left to do and the CPU may sleep.
+ */
+int
+kzero_refill(void)
 {
-	uint idx;
+	int n;
+	struct run *r;
 	struct kmem_percpu *cpu;
 
+	/*
+	 * Leave the last free pages alone while memory is short: the idle CPU
+	 * should be reclaiming instead (see reclaim_idle()).
+	 */
+	if (kmem_nfree() < KMEM_RECLAIM_LOW)
+		return 0;
+
 	cpu = kmem_get();
+	for (n = 0; n < KMEM_ZERO_REFILL; n++) {
+		if (kmem.zero.nfree >= KMEM_ZERO_MAX)
+			break;
+
+		/*
+		 * Zero pages this CPU has cached or that the buddy allocator
+		 * has free, but never steal from another CPU's magazine.
+		 */
+		if (cpu->nfree <= KMEM_LOW) {
+			if (bd_nfree() == 0)
+				break;
+			kmem_refill(cpu);
+		}
+
+		acquire(&cpu->lock);
+		r = cpu->freelist;
+		if (r) {
+			cpu->freelist = r->next;
+			cpu->nfree--;
+		}
+		release(&cpu->lock);
+
+		if (r == 0)
+			break;
+
+		memzero_page(r);
+
+		acquire(&kmem.zero.lock);
+		r->next = kmem.zero.freelist;
+		kmem.zero.freelist = r;
+		kmem.zero.nfree++;
+		release(&kmem.zero.lock);
+	}
+
+	return n;
+}
+
+/*
+ * Take one page off of a CPU's freelist, refilling the freelist first if it is
+ * running low. Interrupts must be disabled.
+ */
+static
+struct run *
+kmem_pop(struct kmem_percpu *cpu)
+{
+	struct run *r;
+
+	acquire(&cpu->lock);
+	if (cpu->nfree <= KMEM_LOW) {
+		/*
+		 * The magazine is running low. Refill it with a whole batch of
+		 * pages. kmem_refill() takes other locks, so don't hold this
+		 * one meanwhile.
+		 */
+		release(&cpu->lock);
+		kmem_refill(cpu);
+		acquire(&cpu->lock);
+	}
+
+	r = cpu->freelist;
+	if (r) {
+		cpu->freelist = r->next;
+		cpu->nfree--;
+	}
+	release(&cpu->lock);
+
+	return r;
+}
+
+/*
+ * Take one page from the pre-zeroed pool, or return 0 if the pool is empty.
+ * The unlocked check keeps allocations from bouncing the pool's lock between
+ * CPUs when there is nothing in it.
+ */
+static
+struct run *
+kzero_pop(void)
+{
+	struct run *r;
+
+	if (kmem.zero.nfree == 0)
+		return 0;
+
+	acquire(&kmem.zero.lock);
+	r = kmem.zero.freelist;
+	if (r) {
+		kmem.zero.freelist = r->next;
+		kmem.zero.nfree--;
+	}
+	release(&kmem.zero.lock);
+
+	return r;
+}
+
+/*
+ * Return the number of free pages in the system: the pages cached by every CPU
+ * and the zero pool plus those in the buddy allocator.
+ */
+uint64
+sys_nfree(void)
+{
+  return kmem_nfree();
+}
+
+/*
+ * The number of free pages: in the buddy allocator, the zero pool and the
+ * per-CPU caches. Read without locks, so only approximate.
+ */
+uint64
+kmem_nfree(void)
+{
+  uint64 n;
+
+  n = bd_nfree() + kmem.zero.nfree;
+  for(int i = 0; i < NCPU; i++){
+    n += kmem.cpus[i].nfree;
+    for(int k = 0; k < KMEM_PCP_ORDER; k++)
+      n += kmem.cpus[i].small[k].n << (k + 1);
+  }
+
+  return n;
+}
+
+/*
+ * kallocbench(order, n, raw): allocate and free a block of 2^order pages n
+ * times, and return how long that took in time CSR ticks. With raw set, call
+ * the buddy allocator directly, bypassing the per-CPU caches and page zeroing.
+ */
+uint64
+sys_kallocbench(void)
+{
+	int order, n, raw, i;
+	uint64 start;
+	void *pa;
+
+	if (argint(0, &order) < 0 || argint(1, &n) < 0 || argint(2, &raw) < 0)
+		return -1;
+	if (order < 0 || order > KMEM_MAX_ORDER || n < 0)
+		return -1;
+
+	start = r_time();
+	for (i = 0; i < n; i++) {
+		if (raw) {
+			if ((pa = bd_malloc((uint64) PGSIZE << order)) == 0)
+				return -1;
+			bd_free(pa);
+		} else {
+			if ((pa = kalloc_pages(order)) == 0)
+				return -1;
+			kfree_pages(pa, order);
+		}
+	}
+
+	return r_time() - start;
+}
+
+/*
+ * Print how often each CPU had to go to the buddy allocator or to another CPU
+ * for pages, and how often it gave pages back. Used by ntas().
+ */
+void
+kmem_stats_print(void)
+{
+	struct kmem_percpu *cpu;
+
+	for (int i = 0; i < NCPU; i++) {
+		cpu = &kmem.cpus[i];
+		if (cpu->nrefill + cpu->nsteal + cpu->ndrain == 0)
+			continue;
+
+		printf("kmem_%d: nfree %d #refill %d #steal %d #drain %d\n", i,
+			cpu->nfree, cpu->nrefill, cpu->nsteal, cpu->ndrain);
+	}
+
+	printf("kmem_zero: nfree %d #hit %d #miss %d\n", kmem.zero.nfree,
+		kmem.zero.nhit, kmem.zero.nmiss);
+
+	reclaim_stats_print();
+}
+
+void
+kmem_stats_reset(void)
+{
+	for (int i = 0; i < NCPU; i++) {
+		kmem.cpus[i].nrefill = 0;
+		kmem.cpus[i].nsteal = 0;
+		kmem.cpus[i].ndrain = 0;
+	}
+	kmem.zero.nhit = 0;
+	kmem.zero.nmiss = 0;
+}
+
+/*
+ * Index of a physical page in the reference count table, or -1 if the page is
+ * not one that kalloc() hands out.
+ */
+static int
+kalloc_refcnt_idx(void *pa)
+{
+	if ((char *) pa < end || (uint64) pa >= PHYSTOP)
+		return -1;
+
+	return (PGROUNDDOWN((uint64) pa) - KERNBASE) / PGSIZE;
+}
+
+/*
+ * Take another reference to a page. The count is updated with an atomic add
+ * (amoadd.w on RISC-V) so no lock is needed, and concurrent updates from other
+ * harts are never lost.
+ */
+void
+kalloc_refcnt_add(void *pa)
+{
+	int idx;
 
 	idx = kalloc_refcnt_idx(pa);
 	if (idx < 0)
 		return;
 
-	if (kmem.refcnt[idx] == 0)
+	__sync_fetch_and_add(&kmem.refcnt[idx], 1);
+}
+
+/*
+ * Drop a reference to a page, freeing it when the last reference is dropped.
+ * The decrement and the test for zero are a single atomic operation, so exactly
+ * one hart sees the count reach zero and frees the page.
+ */
+void
+kalloc_refcnt_dec(void *pa)
+{
+	int idx, ref;
+
+	idx = kalloc_refcnt_idx(pa);
+	if (idx < 0)
+		return;
+
+	ref = __sync_sub_and_fetch(&kmem.refcnt[idx], 1);
+	if (ref < 0)
 		panic("kalloc_refcnt_dec");
 
-	acquire(&cpu->lock);
-	kmem.refcnt[idx]--;
-	if (kmem.refcnt[idx] == 0) {
-		release(&cpu->lock);
+	if (ref == 0)
 		kfree(pa);
-	} else
-		release(&cpu->lock);
 }
 
 /*
- * Get the current CPU's kmem freelist.
+ * Return the number of references to a page. The answer may be stale by the
+ * time the caller looks at it, unless the caller holds the only reference.
+ */
+int
+kalloc_refcnt_get(void *pa)
+{
+	int idx;
+
+	idx = kalloc_refcnt_idx(pa);
+	if (idx < 0)
+		return 0;
+
+	return __atomic_load_n(&kmem.refcnt[idx], __ATOMIC_RELAXED);
+}
+
+/*
+ * Drop a reference to a page unless it is the last one. Returns 0 if the
+ * reference was dropped, or 1 if the caller holds the last reference. In that
+ * case the count is left at one, so the caller can first release whatever the
+ * page points to (say, the pages mapped by a page-table page) and then free it
+ * with kalloc_refcnt_dec().
+ */
+int
+kalloc_refcnt_release(void *pa)
+{
+	int idx, ref;
+
+	idx = kalloc_refcnt_idx(pa);
+	if (idx < 0)
+		return 0;
+
+	for (;;) {
+		ref = __atomic_load_n(&kmem.refcnt[idx], __ATOMIC_RELAXED);
+		if (ref <= 0)
+			panic("kalloc_refcnt_release");
+		if (ref == 1)
+			return 1;
+		if (__sync_bool_compare_and_swap(&kmem.refcnt[idx], ref,
+		    ref - 1))
+			return 0;
+	}
+}
+
+/*
+ * Note that a page has just been seen in use, by wss_scan(). Pages are also
+ * counted as in use when they are allocated.
+ */
+void
+kalloc_page_used(void *pa)
+{
+	int idx;
+
+	idx = kalloc_refcnt_idx(pa);
+	if (idx >= 0)
+		kmem.lastuse[idx] = ticks;
+}
+
+/*
+ * Return the number of clock ticks since a page was last seen in use.
+ */
+uint
+kalloc_page_idle(void *pa)
+{
+	int idx;
+
+	idx = kalloc_refcnt_idx(pa);
+	if (idx < 0)
+		return 0;
+
+	return ticks - kmem.lastuse[idx];
+}
+
+/*
+ * Get the current CPU's kmem freelist. Interrupts must be disabled, so that the
+ * caller is not moved to another CPU while it uses the freelist.
  */
 static
 struct kmem_percpu *
 kmem_get(void)
 {
-	int id;
+	return &kmem.cpus[cpuid()];
+}
 
-	/*
-	 * Device interrupts must be disabled before cpuid() can be called.
-	 */
-	push_off();
+/*
+ * Refill a CPU's magazine with one batch of pages. The batch comes from the
+ * buddy allocator if it has any pages, otherwise it is stolen from the CPU with
+ * the most free pages. No kmem lock may be held by the caller, since only one kmem
+ * lock is ever held at a time here (this is what avoids two CPUs deadlocking
+ * while stealing from each other).
+ */
+static
+void
+kmem_refill(struct kmem_percpu *cpu)
+{
+	int n, stolen;
+	struct kmem_batch b;
+	struct kmem_percpu *victim;
+
+	b.head = b.tail = 0;
+	b.n = 0;
+	stolen = 0;
+
+	kmem_batch_alloc(&b, KMEM_BATCH);
+
+	if (b.n == 0) {
+		/*
+		 * The buddy allocator is out of pages. Take up to half of the richest CPU's
+		 * pages, so that the victim isn't left to steal straight back.
+		 */
+		victim = kmem_victim(cpu);
+		if (victim) {
+			acquire(&victim->lock);
+			n = min(KMEM_BATCH, (victim->nfree + 1) / 2);
+			kmem_batch_take(&victim->freelist, &victim->nfree, &b,
+				n);
+			release(&victim->lock);
+			stolen = 1;
+		}
+	}
 
-	id = cpuid();
+	if (b.n == 0)
+		return;
 
-	/*
-	 * Turn device interrupts back on.
-	 */
-	pop_off();
+	acquire(&cpu->lock);
+	kmem_batch_put(&cpu->freelist, &cpu->nfree, &b);
+	if (stolen)
+		cpu->nsteal++;
+	else
+		cpu->nrefill++;
+	release(&cpu->lock);
+}
+
+/*
+ * Find the CPU (other than cpu) with the most free pages. The counts are read
+ * without holding the locks, so the answer is only a hint; the caller takes the
+ * victim's lock before touching its freelist.
+ */
+static
+struct kmem_percpu *
+kmem_victim(struct kmem_percpu *cpu)
+{
+	struct kmem_percpu *c, *victim;
+
+	victim = 0;
+	for (c = kmem.cpus; c < &kmem.cpus[NCPU]; c++) {
+		if (c == cpu || c->nfree == 0)
+			continue;
+		if (!victim || c->nfree > victim->nfree)
+			victim = c;
+	}
 
-	return &kmem.cpus[id];
+	return victim;
 }
 
 /*
- * Steal a page from a CPU's kmem freelist.
+ * Detach up to n pages from the front of a freelist and append them to batch
+ * b. The lock protecting the freelist must be held.
  */
 static
-struct run *
-kmem_steal(void)
+void
+kmem_batch_take(struct run **list, uint64 *nfree, struct kmem_batch *b, int n)
 {
 	struct run *r;
-	struct kmem_percpu *cpu;
 
-	r = 0;
+	while (n-- > 0 && *list) {
+		r = *list;
+		*list = r->next;
+		(*nfree)--;
+
+		r->next = 0;
+		if (b->tail)
+			b->tail->next = r;
+		else
+			b->head = r;
+		b->tail = r;
+		b->n++;
+	}
+}
 
-	for (int i = 0; i < NCPU; i++) {
-		cpu = &kmem.cpus[i];
-		if (cpu->freelist) {
-			acquire(&cpu->lock);
-			if (!cpu->freelist) {
-				release(&cpu->lock);
-				continue;
-			}
-
-			r = cpu->freelist;
-			cpu->freelist = r->next;
-			cpu->nfree--;
+/*
+ * Splice all pages of batch b onto the front of a freelist and empty the
+ * batch. The lock protecting the freelist must be held.
+ */
+static
+void
+kmem_batch_put(struct run **list, uint64 *nfree, struct kmem_batch *b)
+{
+	if (b->n == 0)
+		return;
 
-			release(&cpu->lock);
-			break;
-		}
+	b->tail->next = *list;
+	*list = b->head;
+	*nfree += b->n;
+
+	b->head = b->tail = 0;
+	b->n = 0;
+}
+
+/*
+ * Allocate up to n single pages from the buddy allocator into an empty batch.
+ */
+static
+void
+kmem_batch_alloc(struct kmem_batch *b, int n)
+{
+	void *pages[KMEM_BATCH];
+	struct run *r;
+	int i;
+
+	n = bd_malloc_batch(PGSIZE, pages, min(n, KMEM_BATCH));
+	for (i = n - 1; i >= 0; i--) {
+		r = pages[i];
+		r->next = b->head;
+		if (b->tail == 0)
+			b->tail = r;
+		b->head = r;
+		b->n++;
 	}
+}
 
-	return r;
+/*
+ * Give every page of a batch back to the buddy allocator and empty the batch.
+ */
+static
+void
+kmem_batch_free(struct kmem_batch *b)
+{
+	void *pages[KMEM_BATCH];
+	struct run *r;
+	int n;
+
+	while (b->head) {
+		for (n = 0; n < KMEM_BATCH && b->head; n++) {
+			r = b->head;
+			b->head = r->next;
+			pages[n] = r;
+		}
+		bd_free_batch(pages, n);
+	}
+	b->tail = 0;
+	b->n = 0;
 }
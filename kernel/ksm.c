@@ -0,0 +1,347 @@
+/*
+ * ksm.c: Kernel same-page merging
+ *
+ * A kernel thread, ksmd, looks through the memory of the processes that have
+ * opted in with ksm() for pages with the same contents, and merges them into
+ * one physical page that they all map copy-on-write, the way fork() shares
+ * pages. Every KSM_INTERVAL ticks it scans KSM_PAGES pages, picking up where it
+ * left off; a pass is one sweep over all processes.
+ *
+ * Merged pages are kept in the stable table, by a hash of their contents. The
+ * table holds a reference on each, so that a write to one always copies it
+ * rather than taking it over (see uvm_cow_fault()), and its contents never
+ * change. A scanned page that matches a stable page is replaced by it.
+ *
+ * Otherwise the page is looked up in the unstable table, which remembers the
+ * last page seen with each hash during this pass, with no reference and no
+ * write protection. If that page still has the same contents, the scanned page
+ * is write-protected and goes in the stable table, and the other one is merged
+ * into it when ksmd gets to it. Pages that match no other page are left
+ * writable, so that unique pages cost no copy-on-write faults. Stable pages no
+ * page table maps any more are freed at the start of each pass.
+ *
+ * A process changes its own page table without a lock (see uvm_swap_out()).
+ * ksmd changes another process's only while holding its lock, with the process
+ * stopped where it holds on to none of its pages (p->vm_quiet): preempted from
+ * user space by the timer (see usertrap()), or in the sleep() system call. A
+ * process asleep anywhere else, in a read() say, may be in the middle of using
+ * a page, so it is passed over. ksmd leaves alone pages of mapped files,
+ * megapages, pages shared with a forked process and leaf page-table pages
+ * shared with one.
+ */
+
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "vmstat.h"
+#include "defs.h"
+
+#define KSM_NHASH	256	// stable table buckets
+#define KSM_NUNSTABLE	1024	// unstable table slots
+
+extern struct proc *proc_list;
+
+/*
+ * A merged page.
+ */
+struct ksm_page {
+	struct ksm_page *next;	// next in its bucket
+	uint64 pa;
+	uint hash;
+};
+
+static struct {
+	struct spinlock lock;
+	struct kmem_cache *cache;	// struct ksm_pages
+	struct ksm_page *stable[KSM_NHASH];
+	struct {
+		uint64 pa;
+		uint hash;
+		uint pass;		// pass the page was seen in
+	} unstable[KSM_NUNSTABLE];
+	uint pass;			// passes started, from 1
+	uint64 hand;			// seq of the process being scanned, or 0
+	uint64 nscan;
+	uint64 nmerge;
+} ksm;
+
+/*
+ * FNV-1a over the page's 64-bit words, folded to 32 bits.
+ */
+static uint
+ksm_hash(void *pa)
+{
+	uint64 *w, h;
+	int i;
+
+	w = (uint64 *) pa;
+	h = 0xcbf29ce484222325UL;
+	for (i = 0; i < PGSIZE / sizeof(uint64); i++) {
+		h ^= w[i];
+		h *= 0x100000001b3UL;
+	}
+
+	return (uint) (h ^ (h >> 32));
+}
+
+/*
+ * Map the page at pa at va in p, in place of the page the PTE maps now, the way
+ * a fork child would: a writable page becomes copy-on-write.
+ */
+static void
+ksm_map(struct proc *p, uint64 va, pte_t *pte, uint64 pa)
+{
+	pte_t flags;
+
+	flags = PTE_FLAGS(*pte);
+	if (flags & PTE_W)
+		flags = (flags & ~PTE_W) | PTE_C;
+	*pte = PA2PTE(pa) | flags;
+
+	tlb_flush_page(p, va);
+}
+
+/*
+ * Merge p's page at va with another page with the same contents, if there is
+ * one. Called with p->lock and ksm.lock held.
+ */
+static void
+ksm_page(struct proc *p, uint64 va, pte_t *pte)
+{
+	struct ksm_page *k;
+	uint64 pa;
+	uint hash;
+	int i;
+
+	pa = PTE2PA(*pte);
+	hash = ksm_hash((void *) pa);
+
+	for (k = ksm.stable[hash % KSM_NHASH]; k; k = k->next) {
+		if (k->hash == hash &&
+		    memcmp((void *) k->pa, (void *) pa, PGSIZE) == 0) {
+			kalloc_refcnt_add((void *) k->pa);
+			ksm_map(p, va, pte, k->pa);
+			kalloc_refcnt_dec((void *) pa);
+			ksm.nmerge++;
+			return;
+		}
+	}
+
+	/*
+	 * The page remembered may have been written to, or freed, since. That
+	 * only matters if its contents no longer match, which is checked.
+	 */
+	i = hash % KSM_NUNSTABLE;
+	if (ksm.unstable[i].pass == ksm.pass && ksm.unstable[i].hash == hash &&
+	    ksm.unstable[i].pa != pa &&
+	    memcmp((void *) ksm.unstable[i].pa, (void *) pa, PGSIZE) == 0) {
+		k = kmem_cache_alloc(ksm.cache, 0);
+		if (k == 0)
+			return;
+		k->pa = pa;
+		k->hash = hash;
+		k->next = ksm.stable[hash % KSM_NHASH];
+		ksm.stable[hash % KSM_NHASH] = k;
+		kalloc_refcnt_add((void *) pa);
+		ksm_map(p, va, pte, pa);
+		ksm.unstable[i].pass = 0;
+		return;
+	}
+
+	ksm.unstable[i].pa = pa;
+	ksm.unstable[i].hash = hash;
+	ksm.unstable[i].pass = ksm.pass;
+}
+
+/*
+ * Start a pass: forget the pages seen in the last one, and free the stable
+ * pages that only the stable table holds on to.
+ */
+static void
+ksm_newpass(void)
+{
+	struct ksm_page **kp, *k;
+	int i;
+
+	acquire(&ksm.lock);
+	ksm.pass++;
+	for (i = 0; i < KSM_NHASH; i++) {
+		kp = &ksm.stable[i];
+		while ((k = *kp) != 0) {
+			if (kalloc_refcnt_get((void *) k->pa) == 1) {
+				*kp = k->next;
+				kalloc_refcnt_dec((void *) k->pa);
+				kmem_cache_free(ksm.cache, k);
+			} else {
+				kp = &k->next;
+			}
+		}
+	}
+	release(&ksm.lock);
+}
+
+/*
+ * Scan up to n of p's pages from p->ksm_next. Holes between p's regions, the
+ * guard page and mapped files are passed over whole. Called with p->lock held
+ * and p stopped. Returns the number scanned.
+ */
+static int
+ksm_scan_proc(struct proc *p, int n)
+{
+	struct vma *v;
+	pte_t *pte;
+	int i;
+
+	acquire(&ksm.lock);
+	i = 0;
+	while (i < n && p->ksm_next < p->sz) {
+		v = vma_next(p, p->ksm_next);
+		if (v == 0) {
+			p->ksm_next = p->sz;
+			break;
+		}
+		if (v->file || v->type == VMA_GUARD) {
+			p->ksm_next = v->end;
+			continue;
+		}
+		p->ksm_next = max(p->ksm_next, v->start);
+
+		pte = uvm_merge_pte(p, p->ksm_next);
+		if (pte != 0 && kalloc_refcnt_get((void *) PTE2PA(*pte)) == 1)
+			ksm_page(p, p->ksm_next, pte);
+		p->ksm_next += PGSIZE;
+		i++;
+	}
+	ksm.nscan += i;
+	release(&ksm.lock);
+
+	return i;
+}
+
+/*
+ * Scan up to n pages, taking the processes in turn, and starting at most one
+ * new pass. A process that is running or isn't stopped where its pages may be
+ * merged is passed over until the next pass.
+ *
+ * The process to go on with is remembered by its place on proc_list (p->seq)
+ * rather than by pointer, since it may be freed while ksmd sleeps.
+ */
+static void
+ksm_scan(int n)
+{
+	struct proc *p, *next;
+	int started;
+
+	started = 0;
+	proc_walk_begin();
+	p = 0;
+	if (ksm.hand != 0)
+		for (p = proc_list; p && p->seq < ksm.hand; p = p->next)
+			;
+
+	while (n > 0) {
+		if (p == 0) {
+			if (started)
+				break;
+			ksm_newpass();
+			started = 1;
+			p = proc_list;
+			continue;
+		}
+
+		next = p;
+		acquire(&p->lock);
+		if (p->ksm && p->vm_quiet &&
+		    (p->state == RUNNABLE || p->state == SLEEPING) &&
+		    p->ksm_next < p->sz) {
+			n -= ksm_scan_proc(p, min(n, KSM_BATCH));
+			if (p->ksm_next >= p->sz) {
+				p->ksm_next = 0;
+				next = p->next;
+			}
+		} else {
+			if (p->ksm_next >= p->sz)
+				p->ksm_next = 0;
+			next = p->next;
+		}
+		release(&p->lock);
+		p = next;
+	}
+
+	ksm.hand = p ? p->seq : 0;
+	proc_walk_end();
+}
+
+static void
+ksmd(void)
+{
+	uint ticks0;
+
+	for (;;) {
+		ksm_scan(KSM_PAGES);
+
+		acquire(&tickslock);
+		ticks0 = ticks;
+		while (ticks - ticks0 < KSM_INTERVAL)
+			sleep(&ticks, &tickslock);
+		release(&tickslock);
+	}
+}
+
+void
+ksminit(void)
+{
+	initlock(&ksm.lock, "ksm");
+	if (!kmem_cache_create(&ksm.cache, "ksm", sizeof(struct ksm_page)))
+		panic("ksminit");
+	if (kthread_create("ksmd", ksmd) < 0)
+		panic("ksminit: ksmd");
+}
+
+/*
+ * Fill in the merging statistics of a struct vmstat.
+ */
+void
+ksm_stat(struct vmstat *st)
+{
+	struct ksm_page *k;
+	int i;
+
+	st->nksmshared = 0;
+	st->nksmsharing = 0;
+
+	acquire(&ksm.lock);
+	st->nksmscan = ksm.nscan;
+	st->nksmmerge = ksm.nmerge;
+	for (i = 0; i < KSM_NHASH; i++) {
+		for (k = ksm.stable[i]; k; k = k->next) {
+			st->nksmshared++;
+			st->nksmsharing += kalloc_refcnt_get((void *) k->pa) - 1;
+		}
+	}
+	release(&ksm.lock);
+}
+
+/*
+ * Opt the calling process in to merging its pages (on != 0) or out of it, and
+ * return whether it was in. Pages already merged stay so until written to.
+ */
+uint64
+sys_ksm(void)
+{
+	struct proc *p;
+	int on, old;
+
+	if (argint(0, &on) < 0)
+		return -1;
+
+	p = myproc();
+	acquire(&p->lock);
+	old = p->ksm;
+	p->ksm = (on != 0);
+	release(&p->lock);
+
+	return old;
+}
@@ -20,19 +20,25 @@ main()
     printf("\n");
     printf("xv6 kernel is booting\n");
     printf("\n");
+    reclaiminit();   // memory reclaim
     kinit();         // physical page allocator
+    kmem_cache_init(); // slab allocator
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
+    tlbinit();       // address space IDs
     procinit();      // process table
+    vmainit();       // address-space regions
     trapinit();      // trap vectors
     trapinithart();  // install kernel trap vector
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
     iinit();         // inode cache
+    pcacheinit();    // page cache
     fileinit();      // file table
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
+    ksminit();       // same-page merging thread
     dev_special_init();	// initialize the special devices.
     __sync_synchronize();
     started = 1;
@@ -0,0 +1,248 @@
+/*
+ * Memory block routines: memset, memmove, memcmp and the page-sized
+ * memzero_page and memcpy_page.
+ *
+ * This file is compiled into both the kernel and the user library (see ULIB in
+ * the Makefile), so it must not depend on anything but types.h and riscv.h.
+ *
+ * The routines work a 64-bit word at a time, with the loop body unrolled four
+ * words deep, once the pointers are 8-byte aligned. The unaligned head and the
+ * short tail are done a byte at a time. RISC-V does not guarantee fast (or any)
+ * misaligned word access, so when two buffers are not aligned with respect to
+ * each other the byte loop is used throughout.
+ */
+
+#include "types.h"
+#include "riscv.h"
+
+#define WORD		sizeof(uint64)
+#define WORD_MASK	(WORD - 1)
+
+/*
+ * Buffers shorter than this are not worth aligning.
+ */
+#define WORD_MIN	(4 * WORD)
+
+/*
+ * The 64-bit pattern with every byte set to c.
+ */
+#define WORD_FILL(c)	((uint64) (uchar) (c) * 0x0101010101010101ull)
+
+void *
+memset(void *dst, int c, uint n)
+{
+	uchar *d;
+	uint64 *w, fill;
+
+	d = dst;
+	if (n >= WORD_MIN) {
+		while ((uint64) d & WORD_MASK) {
+			*d++ = c;
+			n--;
+		}
+
+		fill = WORD_FILL(c);
+		w = (uint64 *) d;
+		for (; n >= 4 * WORD; n -= 4 * WORD, w += 4) {
+			w[0] = fill;
+			w[1] = fill;
+			w[2] = fill;
+			w[3] = fill;
+		}
+		for (; n >= WORD; n -= WORD)
+			*w++ = fill;
+		d = (uchar *) w;
+	}
+
+	while (n-- > 0)
+		*d++ = c;
+
+	return dst;
+}
+
+/*
+ * Copy forwards, from low to high addresses. Safe when dst is below src even
+ * if the buffers overlap.
+ */
+static void
+memmove_fwd(uchar *d, const uchar *s, uint n)
+{
+	uint64 *wd;
+	const uint64 *ws;
+
+	if (n >= WORD_MIN && (((uint64) d ^ (uint64) s) & WORD_MASK) == 0) {
+		while ((uint64) d & WORD_MASK) {
+			*d++ = *s++;
+			n--;
+		}
+
+		wd = (uint64 *) d;
+		ws = (const uint64 *) s;
+		for (; n >= 4 * WORD; n -= 4 * WORD, wd += 4, ws += 4) {
+			wd[0] = ws[0];
+			wd[1] = ws[1];
+			wd[2] = ws[2];
+			wd[3] = ws[3];
+		}
+		for (; n >= WORD; n -= WORD)
+			*wd++ = *ws++;
+		d = (uchar *) wd;
+		s = (const uchar *) ws;
+	}
+
+	while (n-- > 0)
+		*d++ = *s++;
+}
+
+/*
+ * Copy backwards, from high to low addresses. d and s point one past the end
+ * of the buffers. Safe when dst is above src even if the buffers overlap.
+ */
+static void
+memmove_bwd(uchar *d, const uchar *s, uint n)
+{
+	uint64 *wd;
+	const uint64 *ws;
+
+	if (n >= WORD_MIN && (((uint64) d ^ (uint64) s) & WORD_MASK) == 0) {
+		while ((uint64) d & WORD_MASK) {
+			*--d = *--s;
+			n--;
+		}
+
+		wd = (uint64 *) d;
+		ws = (const uint64 *) s;
+		for (; n >= 4 * WORD; n -= 4 * WORD) {
+			wd -= 4;
+			ws -= 4;
+			wd[3] = ws[3];
+			wd[2] = ws[2];
+			wd[1] = ws[1];
+			wd[0] = ws[0];
+		}
+		for (; n >= WORD; n -= WORD)
+			*--wd = *--ws;
+		d = (uchar *) wd;
+		s = (const uchar *) ws;
+	}
+
+	while (n-- > 0)
+		*--d = *--s;
+}
+
+void *
+memmove(void *dst, const void *src, uint n)
+{
+	uchar *d;
+	const uchar *s;
+
+	d = dst;
+	s = src;
+	if (n == 0 || d == s)
+		return dst;
+
+	if (s < d && s + n > d)
+		memmove_bwd(d + n, s + n, n);
+	else
+		memmove_fwd(d, s, n);
+
+	return dst;
+}
+
+/*
+ * memcpy exists to placate GCC. Use memmove.
+ */
+void *
+memcpy(void *dst, const void *src, uint n)
+{
+	return memmove(dst, src, n);
+}
+
+int
+memcmp(const void *v1, const void *v2, uint n)
+{
+	const uchar *s1, *s2;
+	const uint64 *w1, *w2;
+
+	s1 = v1;
+	s2 = v2;
+	if (n >= WORD_MIN && (((uint64) s1 ^ (uint64) s2) & WORD_MASK) == 0) {
+		while ((uint64) s1 & WORD_MASK) {
+			if (*s1 != *s2)
+				return *s1 - *s2;
+			s1++, s2++;
+			n--;
+		}
+
+		/*
+		 * Skip over equal words. The first differing word (if any) is
+		 * left for the byte loop, which finds the differing byte.
+		 */
+		w1 = (const uint64 *) s1;
+		w2 = (const uint64 *) s2;
+		for (; n >= 4 * WORD; n -= 4 * WORD, w1 += 4, w2 += 4) {
+			if (((w1[0] ^ w2[0]) | (w1[1] ^ w2[1]) |
+			    (w1[2] ^ w2[2]) | (w1[3] ^ w2[3])) != 0)
+				break;
+		}
+		for (; n >= WORD && *w1 == *w2; n -= WORD)
+			w1++, w2++;
+		s1 = (const uchar *) w1;
+		s2 = (const uchar *) w2;
+	}
+
+	while (n-- > 0) {
+		if (*s1 != *s2)
+			return *s1 - *s2;
+		s1++, s2++;
+	}
+
+	return 0;
+}
+
+/*
+ * Zero one page. pa must be page-aligned, so there is no head or tail to
+ * handle and the loop is unrolled eight words deep.
+ */
+void
+memzero_page(void *pa)
+{
+	uint64 *w, *end;
+
+	w = pa;
+	end = w + PGSIZE / WORD;
+	for (; w < end; w += 8) {
+		w[0] = 0;
+		w[1] = 0;
+		w[2] = 0;
+		w[3] = 0;
+		w[4] = 0;
+		w[5] = 0;
+		w[6] = 0;
+		w[7] = 0;
+	}
+}
+
+/*
+ * Copy one page to another. Both must be page-aligned and must not overlap.
+ */
+void
+memcpy_page(void *dst, const void *src)
+{
+	uint64 *d, *end;
+	const uint64 *s;
+
+	d = dst;
+	s = src;
+	end = d + PGSIZE / WORD;
+	for (; d < end; d += 8, s += 8) {
+		d[0] = s[0];
+		d[1] = s[1];
+		d[2] = s[2];
+		d[3] = s[3];
+		d[4] = s[4];
+		d[5] = s[5];
+		d[6] = s[6];
+		d[7] = s[7];
+	}
+}
@@ -27,6 +27,7 @@
 
 // core local interruptor (CLINT), which contains the timer.
 #define CLINT 0x2000000L
+#define CLINT_MSIP(hartid) (CLINT + 4*(hartid)) // machine software interrupt pending.
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
 
@@ -54,14 +55,30 @@
 // map kernel stacks beneath the trampoline,
 // each surrounded by invalid guard pages.
 #define KSTACK(p) (TRAMPOLINE - ((p)+1)* 2*PGSIZE)
+#define NKSTACK (1 << 15)  // kernel stack slots
+
+// the kernel reaches the CLINT, to interrupt other CPUs (see
+// tlb.c), at the bottom of the last gigabyte, far below the
+// kernel stacks, rather than at its physical address, so that
+// nothing the kernel maps lies below UACCESS_TOP.
+#define KCLINT (MAXVA - (1L << 30))
+#define KCLINT_MSIP(hartid) (KCLINT + 4*(hartid))
+
+// kernels built with UACCESS=1 map user memory below this
+// address into each process's kernel page table (see vm.c).
+#define UACCESS_TOP PLIC
 
 // User memory layout.
 // Address zero first:
 //   text
 //   original data and bss
+//   stack guard page
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   mapped files, placed from MMAP_BASE up
+//   ...
 //   TRAPFRAME (p->trapframe, used by the trampoline)
+#define MMAP_BASE (1L << 30)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
@@ -0,0 +1,28 @@
+#ifndef _MMAN_H
+#define _MMAN_H
+
+/*
+ * Memory-management flags shared by the kernel and user programs.
+ */
+
+#define PROT_READ	0x1	// Allow reading to a mapped file.
+#define PROT_WRITE	0x10	// Allow writing to a mapped file.
+#define PROT_EXEC	0x100	// Allow executing a mapped file.
+
+#define MAP_SHARED	0x1	// Writes to file eventually written to disk.
+#define MAP_PRIVATE	0x10	// Writes to file are not written to disk.
+#define MAP_POPULATE	0x20	// Read the whole region in now, not on faults.
+
+#define MS_ASYNC	0x1	// msync(): start writing back (done at once).
+#define MS_SYNC		0x4	// msync(): write back before returning.
+
+#define SBRK_POPULATE	0x1	// sbrkflags(): allocate the new memory now.
+
+/*
+ * Allocation policies for vmpolicy(): when a process's memory gets pages.
+ */
+#define VM_LAZY		0	// One page per page fault.
+#define VM_FAULTAROUND	1	// A window of pages per page fault (default).
+#define VM_EAGER	2	// All of it at sbrk() or mmap() time.
+
+#endif // _MMAN_H
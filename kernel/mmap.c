@@ -1,4 +1,5 @@
 #include "types.h"
+#include "memlayout.h"
 #include "riscv.h"
 #include "defs.h"
 #include "param.h"
@@ -7,29 +8,31 @@
 #include "fs.h"
 #include "file.h"
 #include "proc.h"
-#include "mmap.h"
+#include "mman.h"
+#include "vmstat.h"
 
 #define MAP_FAILED ((uint64) -1)
 
-#define PROT_READ	0x1	// Allow reading to a mapped file.
-#define PROT_WRITE	0x10	// Allow writing to a mapped file.
-
-#define MAP_SHARED	0x1	// Writes to file eventually written to disk.
-#define MAP_PRIVATE	0x10	// Writes to file are not written to disk.
+/*
+ * Writeback and read-ahead statistics (see sys_vmstat()).
+ */
+static uint64 mmap_nwbpage;
+static uint64 mmap_nwbop;
+static uint64 mmap_nreadahead;
 
 static int mmap_args_collect(size_t *, int *, int *, int *, struct file **,
 				offset_t *);
 static int munmap_args_collect(uint64 *, size_t *);
-static int mmap_info_reserve(struct proc *, uint64, size_t, int, int,
-				struct file *, offset_t);
-static void mmap_info_free(struct mmap_info *);
 
 /*
- * Memory-map a file the process' address space.
+ * Memory-map a file the process' address space, in the first hole big enough
+ * at or above MMAP_BASE (see vma_gap()), away from the heap.
  *
  * Note that this syscall does not immediately map the file to the process'
- * address space. Rather, it stores the region's data and lazily maps the file's
- * pages on pagefaults.
+ * address space. Rather, it adds a region for it and lazily maps the file's
+ * pages on pagefaults. With MAP_POPULATE, or under the VM_EAGER allocation
+ * policy, the whole file region is read in before returning, as far as memory
+ * allows.
  */
 uint64
 sys_mmap(void)
@@ -48,7 +51,15 @@ sys_mmap(void)
 		goto out;
 
 	ret = mmap_args_collect(&len, &prot, &flags, &fd, &file, &offset);
-	if (ret < 0)
+	if (ret < 0 || len == 0)
+		goto out;
+
+	/*
+	 * The file offset must be page-aligned, since the region's pages map
+	 * the file's pages, and the page cache holds offsets of 32 bits.
+	 */
+	if (offset % PGSIZE != 0 || offset + PGROUNDUP(len) < offset ||
+	    offset + PGROUNDUP(len) > (1UL << 32))
 		goto out;
 
 	/*
@@ -67,25 +78,28 @@ sys_mmap(void)
 		goto out;
 
 	/*
-	 * Start the region on a page boundary.
+	 * Regions are whole pages.
 	 */
-	start = PGROUNDUP(p->sz);
-
-	/*
-	 * Reserve an mmap_region struct to allow the lazy mapping of file data
-	 * on pagefaults.
-	 */
-	ret = mmap_info_reserve(p, start, len, prot, flags, file, offset);
-	if (ret < 0)
+	len = PGROUNDUP(len);
+	start = vma_gap(p, len);
+	if (start == 0)
 		goto out;
 
 	/*
-	 * Indicate another user of the file.
+	 * The region holds its own reference to the file, so that it can be
+	 * closed.
 	 */
 	filedup(file);
+	if (vma_map(p, start, start + len, VMA_MMAP, prot, flags, file,
+	    offset) < 0) {
+		fileclose(file);
+		goto out;
+	}
 
 	ret_addr = start;
-	p->sz = start + len;
+
+	if ((flags & MAP_POPULATE) || p->vm_policy == VM_EAGER)
+		uvm_populate(p, start, len);
 out:
 	return ret_addr;
 }
@@ -124,18 +138,14 @@ mmap_args_collect(size_t *len, int *prot, int *flags, int *fd,
 }
 
 /*
- * Unmap a memory-mapped region from a process' address space.
+ * Unmap [addr, addr+len) from a process' address space, mapped files or not.
  */
 uint64
 sys_munmap(void)
 {
 	int ret;
 	size_t len;
-	uint64 vaddr_u64;
-	struct mmap_info *info;
-	struct proc *p;
-	struct inode *ip;
-	uint write_amount;
+	uint64 vaddr_u64, end;
 
 	ret = munmap_args_collect(&vaddr_u64, &len);
 	if (ret < 0)
@@ -145,204 +155,313 @@ sys_munmap(void)
 	 * Mapped regions are aligned on a page boundary. Align the faulting
 	 * virtual address to a page boundary.
 	 */
+	end = PGROUNDUP(vaddr_u64 + len);
 	vaddr_u64 = PGROUNDDOWN(vaddr_u64);
-
-	p = myproc();
-	if (!p)
+	if (len == 0 || end > TRAPFRAME || end < vaddr_u64)
 		return -1;
 
-	/*
-	 * Fetch the mmap_region struct for the page's region. If one isn't
-	 * found, it can be assumed that the page was not memory-mapped.
-	 */
-	info = mmap_info_get(p, vaddr_u64);
-	if (!info)
-		return -1;
+	return mmap_unmap(myproc(), vaddr_u64, end);
+}
 
-	/*
-	 * If the number of the region's pages mapped is zero, then this page
-	 * was likely not mapped.
-	 */
-	if (info->num_pages == 0)
-		return -1;
+/*
+ * Blocks of file data that one writeback transaction may write: all the blocks
+ * a transaction may write but the inode's. Writeback stops at the end of the
+ * file, so it never allocates blocks.
+ */
+#define WB_BLOCKS	(MAXOPBLOCKS - 1)
 
-	/*
-	 * Traverse each mapped page in the process' address space.
-	 */
-	for (int i = 0; i < len; i += PGSIZE, vaddr_u64 += PGSIZE) {
-		/*
-		 * If the mapping is shared, write the file's mappings back to
-		 * disk. Any updates will thus be saved to the underlying file
-		 * on disk.
-		 */
-		if (info->flags & MAP_SHARED) {
-			ip = info->file->ip;
-			write_amount = min(PGSIZE, info->len - vaddr_u64);
-
-			begin_op();
-			ilock(ip);
-			ret = writei(ip, 1, vaddr_u64, i, write_amount);
-			if (ret < 0) {
+/*
+ * Write the dirty pages of [start, end) in the shared file region v of p back
+ * to its file, as far as the file goes, and mark them clean. Pages never read
+ * in, or not written to since they were last written back, are skipped. Each
+ * run of adjacent dirty pages is written by as few writei() calls as the log
+ * allows, and runs share log transactions for as long as they fit in one.
+ * Returns 0 on success, -1 if writing fails.
+ */
+static int
+mmap_writeback(struct proc *p, struct vma *v, uint64 start, uint64 end)
+{
+	struct inode *ip;
+	uint64 va, next, a, off, n;
+	int nblk, ret;
+
+	ip = v->file->ip;
+	nblk = -1;	// blocks written in the open transaction, or -1 if none
+	ret = 0;
+	for (va = start; va < end && ret == 0; va = next) {
+		next = va + PGSIZE;
+		if (!uvm_dirty(p->pagetable, va))
+			continue;
+		while (next < end && uvm_dirty(p->pagetable, next))
+			next += PGSIZE;
+
+		for (a = va; a < next; a += n) {
+			if (nblk < 0) {
+				begin_op();
+				ilock(ip);
+				nblk = 0;
+				__sync_fetch_and_add(&mmap_nwbop, 1);
+			}
+
+			off = v->off + (a - v->start);
+			if (off >= ip->size)
+				break;
+			n = min(next - a, ip->size - off);
+			n = min(n, (WB_BLOCKS - nblk) * BSIZE - off % BSIZE);
+			if (writei(ip, 1, a, off, n) != n) {
+				ret = -1;
+				break;
+			}
+
+			nblk += (off % BSIZE + n + BSIZE - 1) / BSIZE;
+			if (nblk >= WB_BLOCKS) {
 				iunlock(ip);
 				end_op();
-
-				return -1;
+				nblk = -1;
 			}
-			iunlock(ip);
-			end_op();
 		}
 
-		/*
-		 * Unmap the page from the process' address space.
-		 */
-		uvmunmap(p->pagetable, vaddr_u64, PGSIZE, 1);
-		if ((--info->num_pages) == 0)
-			mmap_info_free(info);
+		if (ret == 0) {
+			uvm_protect(p->pagetable, va, next - va, 0, PTE_D);
+			__sync_fetch_and_add(&mmap_nwbpage, (next - va) / PGSIZE);
+		}
 	}
 
-	return 0;
+	if (nblk >= 0) {
+		iunlock(ip);
+		end_op();
+	}
+
+	return ret;
 }
 
 /*
- * Collect munmap syscall arguments from the trap frame.
+ * Write back the dirty pages of the files mapped shared in [start, end) of p.
+ * Returns 0 on success, -1 if writing any of them fails.
+ */
+static int
+mmap_sync(struct proc *p, uint64 start, uint64 end)
+{
+	struct vma *v;
+	int ret;
+
+	ret = 0;
+	for (v = vma_next(p, start); v != 0 && v->start < end;
+	    v = vma_next(p, v->end)) {
+		if (v->file && (v->flags & MAP_SHARED) &&
+		    mmap_writeback(p, v, max(start, v->start),
+		    min(end, v->end)) < 0)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+/*
+ * Remove [start, end) from p's address space: write the dirty pages of files
+ * mapped shared there back, unmap them, and drop the regions, letting go of
+ * their files. p must be the current process. The range is removed even if
+ * writing back fails, which returns -1.
  */
-static
 int
-munmap_args_collect(uint64 *addr, size_t *len)
+mmap_unmap(struct proc *p, uint64 start, uint64 end)
 {
 	int ret;
 
-	ret = argaddr(0, addr);
-	if (ret < 0)
-		return -1;
+	ret = mmap_sync(p, start, end);
 
-	ret = argaddr(1, len);
-	if (ret < 0)
+	if (uvmunmap(p->pagetable, start, end - start, 1) < 0 ||
+	    vma_unmap(p, start, end) < 0)
 		return -1;
 
-	return 0;
+	return ret;
 }
 
 /*
- * Reserve an mmap_info struct from the process' memory.
+ * Write the dirty pages of the files mapped shared in [addr, addr+len) back,
+ * without unmapping them. The whole range must be mapped. The log commits
+ * each transaction before end_op() returns, so MS_ASYNC writes back at once
+ * too.
  */
-static
-int
-mmap_info_reserve(struct proc *p, uint64 vaddr, size_t len, int prot, int flags,
-			struct file *file, offset_t off)
+uint64
+sys_msync(void)
 {
-	struct mmap_info *info;
-
-	for (int i = 0; i < MMAP_INFO_MAX; i++) {
-		info = &p->mmap_regions[i];
-		if (info->used == 0) {
-			info->used = 1;
-
-			info->p = p;
-			info->vaddr = vaddr;
-			info->len = len;
-			info->prot = prot;
-			info->flags = flags;
-			info->file = file;
-			info->off = off;
-
-			info->num_pages = len / PGSIZE;
-			if (len % PGSIZE != 0)
-				info->num_pages++;
-
-			return 0;
-		}
+	uint64 addr, len, end, a;
+	struct vma *v;
+	struct proc *p;
+	int flags;
+
+	if (argaddr(0, &addr) < 0 || argaddr(1, &len) < 0 ||
+	    argint(2, &flags) < 0)
+		return -1;
+
+	if (addr % PGSIZE != 0 || (flags & ~(MS_ASYNC | MS_SYNC)) != 0 ||
+	    (flags & (MS_ASYNC | MS_SYNC)) == (MS_ASYNC | MS_SYNC))
+		return -1;
+
+	end = PGROUNDUP(addr + len);
+	if (end > TRAPFRAME || end < addr)
+		return -1;
+
+	p = myproc();
+	for (a = addr; a < end; a = v->end) {
+		v = vma_next(p, a);
+		if (v == 0 || v->start > a)
+			return -1;
 	}
 
-	return -1;
+	return mmap_sync(p, addr, end);
 }
 
 /*
- * Release an mmap_info struct to the process' memory.
+ * Fill in the writeback and read-ahead statistics of a struct vmstat.
  */
-static
 void
-mmap_info_free(struct mmap_info *info)
+mmap_stat(struct vmstat *st)
 {
-	info->used = 0;
+	st->nwbpage = __atomic_load_n(&mmap_nwbpage, __ATOMIC_RELAXED);
+	st->nwbop = __atomic_load_n(&mmap_nwbop, __ATOMIC_RELAXED);
+	st->nreadahead = __atomic_load_n(&mmap_nreadahead, __ATOMIC_RELAXED);
 }
 
 /*
- * Fetch a mmap_info struct in which a file is mapped to the virtual address
- * given as input.
+ * Unmap all of the current process's mapped files, on exit() or exec().
  */
-struct mmap_info *
-mmap_info_get(struct proc *p, uint64 vaddr)
+void
+mmap_exit(struct proc *p)
+{
+	struct vma *v;
+	uint64 end;
+
+	v = vma_next(p, 0);
+	while (v != 0) {
+		end = v->end;
+		if (v->type == VMA_MMAP)
+			mmap_unmap(p, v->start, end);
+		v = vma_next(p, end);
+	}
+}
+
+/*
+ * Change the protection of [addr, addr+len) to prot, which must allow reading.
+ * Taking write permission away write-protects the pages now; giving it back
+ * leaves them to be made writable by page faults, as copy-on-write pages are.
+ */
+uint64
+sys_mprotect(void)
 {
-	int addr_in_range;
-	struct mmap_info *info;
-	uint64 mm_begin, mm_end;
+	uint64 addr, len, end;
+	int prot, clear, set;
+	struct proc *p;
 
-	for (int i = 0; i < MMAP_INFO_MAX; i++) {
-		info = &p->mmap_regions[i];
-		mm_begin = info->vaddr;
-		mm_end = mm_begin + info->len;
+	if (argaddr(0, &addr) < 0 || argaddr(1, &len) < 0 ||
+	    argint(2, &prot) < 0)
+		return -1;
 
-		addr_in_range = (vaddr >= mm_begin) && (vaddr < mm_end);
+	end = PGROUNDUP(addr + len);
+	addr = PGROUNDDOWN(addr);
+	if (len == 0 || end > TRAPFRAME || end < addr || !(prot & PROT_READ))
+		return -1;
 
-		if (info->used && addr_in_range)
-			return info;
-	}
+	p = myproc();
+	if (vma_protect(p, addr, end, prot) < 0)
+		return -1;
 
-	return 0;
+	clear = 0;
+	set = 0;
+	if (!(prot & PROT_WRITE))
+		clear |= PTE_W;
+	if (prot & PROT_EXEC)
+		set |= PTE_X;
+	else
+		clear |= PTE_X;
+
+	return uvm_protect(p->pagetable, addr, end - addr, set, clear);
 }
 
 /*
- * Lazily map a file's contents to a page. Ensure that the file offset matches
- * that of the page's position from the start of the mapped region.
+ * Collect munmap syscall arguments from the trap frame.
  */
+static
 int
-mmap_pagefault_handle(struct mmap_info *info, uint64 vaddr, void *phys)
+munmap_args_collect(uint64 *addr, size_t *len)
 {
-	int ret, perms;
-	uint offset, len;
+	int ret;
 
-	/*
-	 * Allow for reading/writing the page depending on the protections
-	 * specified at the call to mmap.
-	 */
-	perms = PTE_U;
-	if (info->prot & PROT_READ)
-		perms |= PTE_R;
-	if (info->prot & PROT_WRITE)
-		perms |= PTE_W;
+	ret = argaddr(0, addr);
+	if (ret < 0)
+		return -1;
 
-	/*
-	 * The contents to be mapped should be at the same offset within the
-	 * file as the page is from the beginning of the mapped region.
-	 */
-	offset = min(PGSIZE, vaddr - info->vaddr);
+	ret = argaddr(1, len);
+	if (ret < 0)
+		return -1;
 
-	/*
-	 * If the amount of bytes to write is less than the page's size, only
-	 * write that number of bytes.
-	 */
-	len = min(PGSIZE, (info->vaddr + info->len) - vaddr);
+	return 0;
+}
 
-	/*
-	 * Read the file's contents to the physical page frame.
-	 */
-	ilock(info->file->ip);
-	ret = readi(info->file->ip, 0, (uint64) phys, offset, len);
-	if (ret < 0) {
-		iunlock(info->file->ip);
+/*
+ * Map the page at vaddr of the mapped file region v of p: the file's page at
+ * the same offset in the file as vaddr is in the region, from the page cache
+ * (see pcache.c). A shared region maps the cached page itself, so that every
+ * process mapping the file writes to the same page. A private one maps it
+ * copy-on-write, the way fork() shares pages, so that its first write to the
+ * page copies it.
+ */
+int
+mmap_pagefault_handle(struct proc *p, struct vma *v, uint64 vaddr)
+{
+	struct inode *ip;
+	uint64 offset;
+	void *pa;
+	int perms;
+
+	offset = v->off + (vaddr - v->start);
+	ip = v->file->ip;
+
+	ilock(ip);
+	pa = pcache_get(ip, offset);
+	iunlock(ip);
+	if (pa == 0)
 		return -1;
-	}
-	iunlock(info->file->ip);
 
-	/*
-	 * Map the page frame to the process' virtual address space.
-	 */
-	ret = mappages(info->p->pagetable, vaddr, PGSIZE, (uint64) phys, perms);
-	if (ret != 0) {
-		kalloc_refcnt_dec(phys);
+	perms = vma_perms(v);
+	if ((v->flags & MAP_PRIVATE) && (perms & PTE_W))
+		perms = (perms & ~PTE_W) | PTE_C;
+
+	if (mappages(p->pagetable, vaddr, PGSIZE, (uint64) pa, perms) != 0) {
+		kalloc_refcnt_dec(pa);
 		return -1;
 	}
 
 	return 0;
 }
+
+/*
+ * Read ahead for a page fault at vaddr in the mapped file region v, before its
+ * pages are mapped. A fault where the region's previous one left off
+ * (v->ra_next) is reading the file sequentially, so the region's read-ahead
+ * window doubles, up to READAHEAD_MAX pages; any other fault shrinks it back to
+ * the faulting page. The window's pages that aren't cached yet are read into
+ * the page cache together (see pcache_readahead()), so that the faults that map
+ * them find them there.
+ */
+void
+mmap_readahead(struct vma *v, uint64 vaddr)
+{
+	struct inode *ip;
+	int n;
+
+	if (vaddr == v->ra_next)
+		v->ra_window = min(v->ra_window * 2, READAHEAD_MAX);
+	else
+		v->ra_window = 1;
+
+	n = max(min(v->ra_window, (v->end - vaddr) / PGSIZE), 1);
+	ip = v->file->ip;
+
+	ilock(ip);
+	n = pcache_readahead(ip, v->off + (vaddr - v->start), n);
+	iunlock(ip);
+
+	__sync_fetch_and_add(&mmap_nreadahead, n);
+}
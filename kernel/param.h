@@ -1,13 +1,34 @@
-#define NPROC        64  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
+#define NPROC_SPARE  16  // unused procs idle CPUs leave allocated
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // i-nodes cached before unused ones are recycled
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define NBUF         (MAXOPBLOCKS*3)  // blocks cached before unused buffers are recycled
 #define FSSIZE       2000  // size of file system in blocks
+#define SWAPSIZE     65536 // size of swap space after it, in blocks
 #define MAXPATH      128   // maximum file path name
+#define KMEM_BATCH   32    // pages moved per kalloc refill/drain
+#define KMEM_HIGH    (KMEM_BATCH*4)  // per-CPU free pages before a drain
+#define KMEM_LOW     (KMEM_BATCH/4)  // per-CPU free pages before a refill
+#define KMEM_MAX_ORDER   10   // largest kalloc_pages() block: 2^10 pages
+#define KMEM_PCP_ORDER   3    // largest block order cached per CPU
+#define KMEM_PCP_NBLK    8    // blocks of each such order cached per CPU
+#define KMEM_ZERO_MAX    512  // pre-zeroed pages kept by idle CPUs
+#define KMEM_ZERO_REFILL 8    // pages an idle CPU zeroes between scheduler scans
+#define KMEM_MAG_SIZE    15   // objects per slab allocator magazine
+#define KMEM_RECLAIM_LOW   256  // free pages below which idle CPUs reclaim
+#define KMEM_RECLAIM_BATCH 32   // pages reclaimed at a time
+#define FAULTAROUND_MAX    16   // most pages mapped by one lazy page fault
+#define READAHEAD_MAX      8    // most pages of a file read in by one page fault
+#define WSS_INTERVAL       10   // ticks of CPU time between working-set scans
+#define WSS_WINDOW         (WSS_INTERVAL*4)  // ticks a page stays in the working set
+#define SWAP_LOW           64   // free pages below which page faults swap out
+#define SWAP_BATCH         16   // pages a page fault swaps out at a time
+#define KSM_INTERVAL       10   // ticks between ksmd's scans
+#define KSM_PAGES          256  // pages ksmd scans at a time
+#define KSM_BATCH          32   // pages ksmd scans per hold of a process's lock
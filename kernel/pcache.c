@@ -0,0 +1,307 @@
+/*
+ * pcache.c: Page cache
+ *
+ * The pages of files mapped with mmap() are kept in the page cache, by inode
+ * and page-aligned offset, so that every process that maps a page of a file
+ * maps the same physical page. Shared mappings write to it directly, and see
+ * each other's writes at once; private ones map it copy-on-write (see
+ * mmap_pagefault_handle()). The cache holds a reference on each of its pages,
+ * and the PTEs that map one hold the others.
+ *
+ * readi() reads from a cached page rather than from the buffer cache, and
+ * writei() updates the cached page as well as the buffer, so that read() and
+ * write() agree with the mappings. Mappings are written back when they are
+ * unmapped, so a page that no one maps any more holds nothing that isn't on
+ * disk, and the shrinker may free it. An inode's pages are dropped when it is
+ * truncated, or when its last reference goes.
+ *
+ * Page faults on a mapped file read its pages ahead, several at a time (see
+ * pcache_readahead() and mmap_readahead()), so that their blocks come from the
+ * disk in one request. They are read through the buffer cache, which has the
+ * latest copy of blocks written but not yet committed.
+ *
+ * Pages are only added with the inode locked, so pcache_get() can read a
+ * missing page in without the cache lock, and add it afterwards without looking
+ * again.
+ */
+
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "reclaim.h"
+#include "defs.h"
+
+#define PCACHE_NHASH	256	// hash table buckets
+
+/*
+ * A cached page of a file.
+ */
+struct pcpage {
+	struct pcpage *next;	// next in its bucket
+	struct pcpage *inext;	// next page of the same inode
+	struct inode *ip;
+	uint off;		// offset in the file, page-aligned
+	char *pa;
+};
+
+static int pcache_shrink(int);
+
+static struct shrinker pcache_shrinker = {
+	.name = "pcache",
+	.shrink = pcache_shrink,
+	.cost = SHRINK_COST_CACHE,
+};
+
+static struct {
+	struct spinlock lock;		// protects the table and ip->pages
+	struct kmem_cache *cache;	// struct pcpages
+	struct pcpage *hash[PCACHE_NHASH];
+} pcache;
+
+void
+pcacheinit(void)
+{
+	initlock(&pcache.lock, "pcache");
+	if (!kmem_cache_create(&pcache.cache, "pcache", sizeof(struct pcpage)))
+		panic("pcacheinit");
+
+	shrinker_register(&pcache_shrinker);
+}
+
+static struct pcpage **
+pcache_bucket(struct inode *ip, uint off)
+{
+	return &pcache.hash[(((uint64) ip >> 6) + off / PGSIZE) %
+	    PCACHE_NHASH];
+}
+
+/*
+ * Find ip's cached page at off, which must be page-aligned. Called with
+ * pcache.lock held.
+ */
+static struct pcpage *
+pcache_find(struct inode *ip, uint off)
+{
+	struct pcpage *pg;
+
+	for (pg = *pcache_bucket(ip, off); pg; pg = pg->next)
+		if (pg->ip == ip && pg->off == off)
+			return pg;
+
+	return 0;
+}
+
+/*
+ * Take a page out of the cache and drop the cache's reference to it. Called
+ * with pcache.lock held.
+ */
+static void
+pcache_remove(struct pcpage *pg)
+{
+	struct pcpage **pp;
+
+	for (pp = pcache_bucket(pg->ip, pg->off); *pp != pg; pp = &(*pp)->next)
+		;
+	*pp = pg->next;
+
+	for (pp = &pg->ip->pages; *pp != pg; pp = &(*pp)->inext)
+		;
+	*pp = pg->inext;
+
+	kalloc_refcnt_dec(pg->pa);
+	kmem_cache_free(pcache.cache, pg);
+}
+
+/*
+ * Return ip's cached page holding the file's bytes from off, with a reference
+ * for the caller, or 0 if it isn't cached. The caller must hold ip's lock.
+ */
+void *
+pcache_lookup(struct inode *ip, uint off)
+{
+	struct pcpage *pg;
+	char *pa;
+
+	/*
+	 * Nothing can be added without the inode's lock, which the caller
+	 * holds.
+	 */
+	if (ip->pages == 0)
+		return 0;
+
+	pa = 0;
+	acquire(&pcache.lock);
+	pg = pcache_find(ip, PGROUNDDOWN(off));
+	if (pg) {
+		pa = pg->pa;
+		kalloc_refcnt_add(pa);
+	}
+	release(&pcache.lock);
+
+	return pa;
+}
+
+/*
+ * Add pa to the cache as ip's page at off, which must be page-aligned, with the
+ * cache's reference to it. The caller must hold ip's lock, and must have found
+ * the page not cached.
+ */
+static void
+pcache_insert(struct pcpage *pg, struct inode *ip, uint off, char *pa)
+{
+	pg->ip = ip;
+	pg->off = off;
+	pg->pa = pa;
+	kalloc_refcnt_add(pa);
+
+	acquire(&pcache.lock);
+	pg->next = *pcache_bucket(ip, off);
+	*pcache_bucket(ip, off) = pg;
+	pg->inext = ip->pages;
+	ip->pages = pg;
+	release(&pcache.lock);
+}
+
+/*
+ * Return ip's page at off, which must be page-aligned, with a reference for the
+ * caller, reading it in and adding it to the cache if it isn't there. The part
+ * of the page past the end of the file is zero. The caller must hold ip's lock.
+ * Returns 0 if out of memory.
+ */
+void *
+pcache_get(struct inode *ip, uint off)
+{
+	struct pcpage *pg;
+	char *pa;
+
+	pa = pcache_lookup(ip, off);
+	if (pa)
+		return pa;
+
+	pa = kalloc();
+	if (pa == 0)
+		return 0;
+	pg = kmem_cache_alloc(pcache.cache, 0);
+	if (pg == 0) {
+		kalloc_refcnt_dec(pa);
+		return 0;
+	}
+
+	readpages(ip, off, &pa, 1);
+	pcache_insert(pg, ip, off, pa);
+
+	return pa;
+}
+
+/*
+ * Read those of ip's n pages from off, which must be page-aligned, that aren't
+ * cached into the cache, all with one call to readpages(), so that their blocks
+ * come from the disk in as few requests as can be. Pages already cached at the
+ * start are skipped; reading stops at the end of the file, and at the next page
+ * that is cached. The caller must hold ip's lock. Returns the number of pages
+ * read.
+ */
+int
+pcache_readahead(struct inode *ip, uint off, int n)
+{
+	struct pcpage *pg[READAHEAD_MAX];
+	char *pages[READAHEAD_MAX], *pa;
+	int i, m;
+
+	n = min(n, READAHEAD_MAX);
+	for (; n > 0 && (pa = pcache_lookup(ip, off)) != 0; n--) {
+		kalloc_refcnt_dec(pa);
+		off += PGSIZE;
+	}
+
+	for (m = 0; m < n && off + m * PGSIZE < ip->size; m++) {
+		if ((pa = pcache_lookup(ip, off + m * PGSIZE)) != 0) {
+			kalloc_refcnt_dec(pa);
+			break;
+		}
+		if ((pages[m] = kalloc()) == 0)
+			break;
+		if ((pg[m] = kmem_cache_alloc(pcache.cache, 0)) == 0) {
+			kalloc_refcnt_dec(pages[m]);
+			break;
+		}
+	}
+	if (m == 0)
+		return 0;
+
+	readpages(ip, off, pages, m);
+	for (i = 0; i < m; i++) {
+		pcache_insert(pg[i], ip, off + i * PGSIZE, pages[i]);
+		/* The cache holds the only reference. */
+		kalloc_refcnt_dec(pages[i]);
+	}
+
+	return m;
+}
+
+/*
+ * Copy n bytes that writei() wrote to ip at off into its cached page, if there
+ * is one. The bytes must all lie in one page. The caller must hold ip's lock.
+ */
+void
+pcache_update(struct inode *ip, uint off, void *src, uint n)
+{
+	struct pcpage *pg;
+
+	if (ip->pages == 0)
+		return;
+
+	acquire(&pcache.lock);
+	pg = pcache_find(ip, PGROUNDDOWN(off));
+	if (pg)
+		memmove(pg->pa + off % PGSIZE, src, n);
+	release(&pcache.lock);
+}
+
+/*
+ * Drop all of ip's cached pages. Pages still mapped stay so, but are no longer
+ * shared with later mappings. Called when ip is truncated or released, by
+ * whoever holds its lock or its last reference.
+ */
+void
+pcache_drop(struct inode *ip)
+{
+	if (ip->pages == 0)
+		return;
+
+	acquire(&pcache.lock);
+	while (ip->pages)
+		pcache_remove(ip->pages);
+	release(&pcache.lock);
+}
+
+/*
+ * The page cache's shrinker: free up to npages pages that nothing maps. Returns
+ * the number freed, which is none if pcache.lock is busy.
+ */
+static int
+pcache_shrink(int npages)
+{
+	struct pcpage *pg, *next;
+	int i, n;
+
+	n = 0;
+	if (!tryacquire(&pcache.lock))
+		return 0;
+	for (i = 0; i < PCACHE_NHASH && n < npages; i++) {
+		for (pg = pcache.hash[i]; pg && n < npages; pg = next) {
+			next = pg->next;
+			if (kalloc_refcnt_get(pg->pa) == 1) {
+				pcache_remove(pg);
+				n++;
+			}
+		}
+	}
+	release(&pcache.lock);
+
+	return n;
+}
@@ -8,7 +8,8 @@
 #include "sleeplock.h"
 #include "file.h"
 
-#define PIPESIZE 512
+#define PIPESIZE 4096
+#define PIPEORDER 1    // struct pipe is allocated as 2^PIPEORDER pages
 
 struct pipe {
   struct spinlock lock;
@@ -28,7 +29,9 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  // the buffer is written before it is read, and the rest is
+  // set below, so the pages needn't be zeroed.
+  if((pi = (struct pipe*)kalloc_pages_flags(PIPEORDER, 0)) == 0)
     goto bad;
   pi->readopen = 1;
   pi->writeopen = 1;
@@ -47,7 +50,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi)
-    kalloc_refcnt_dec((char*)pi);
+    kfree_pages((char*)pi, PIPEORDER);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -68,7 +71,8 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kalloc_refcnt_dec((char*)pi);
+    freelock(&pi->lock);
+    kfree_pages((char*)pi, PIPEORDER);
   } else
     release(&pi->lock);
 }
@@ -79,6 +83,9 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
   int i = 0;
   struct proc *pr = myproc();
 
+  // copyin() can't read pages in from swap or a file with pi->lock held.
+  uvm_fault_in(pr->pagetable, addr, n);
+
   acquire(&pi->lock);
   while(i < n){
     if(pi->readopen == 0 || pr->killed){
@@ -109,6 +116,9 @@ piperead(struct pipe *pi, uint64 addr, int n)
   struct proc *pr = myproc();
   char ch;
 
+  // copyout() can't read pages in from swap or a file with pi->lock held.
+  uvm_fault_in(pr->pagetable, addr, n);
+
   acquire(&pi->lock);
   while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
     if(pr->killed){
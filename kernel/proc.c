@@ -8,11 +8,52 @@
 #include "file.h"
 #include "proc.h"
 #include "defs.h"
-#include "mmap.h"
+#include "mman.h"
+#include "reclaim.h"
 
 struct cpu cpus[NCPU];
 
-struct proc proc[NPROC];
+// All proc structures, linked through p->next in the order they
+// were allocated from a slab cache. allocproc() recycles UNUSED
+// ones; those beyond NPROC_SPARE are taken off the list again
+// when the CPUs are idle, and all of them when memory is short
+// (see proc_shrink()), and their kernel stacks freed.
+//
+// Walks of the list take no lock. A proc is only taken off it
+// while UNUSED, and keeps its next pointer, so a walk that has
+// got to it can go on; its struct is freed only once every CPU
+// has since passed a quiescent state in scheduler(), where no
+// walk is under way on it. Walks elsewhere must not give up the
+// CPU midway, which proc_walk_begin() ensures by turning off
+// interrupts. proc_list_lock serializes changes to the list.
+struct proc *proc_list;
+static struct proc *proc_tail;
+static uint64 proc_seq;
+static struct spinlock proc_list_lock;
+static struct kmem_cache *proc_cache;
+
+// Procs taken off the list, waiting for every CPU whose
+// proc_qs was qs[i] then to pass a quiescent state.
+static struct {
+  struct proc *procs[KMEM_RECLAIM_BATCH];
+  int n;
+  uint64 qs[NCPU];
+} proc_retired;
+
+static int proc_shrink_pages(int);
+
+static struct shrinker proc_shrinker = {
+  .name = "proc",
+  .shrink = proc_shrink_pages,
+  .cost = SHRINK_COST_EMPTY,
+};
+
+// Kernel stack slots (see KSTACK()) in use, one bit each.
+static uint64 kstack_used[NKSTACK / 64];
+
+// Bumped every time a new kernel stack is mapped, so that a CPU knows
+// to flush its TLB before running on a stack it may not have seen.
+static uint64 kstack_gen;
 
 struct proc *initproc;
 
@@ -20,30 +61,230 @@ int nextpid = 1;
 struct spinlock pid_lock;
 
 extern void forkret(void);
+static void kthread_start(void);
 static void wakeup1(struct proc *chan);
+static void freeproc(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
 
+extern pagetable_t kernel_pagetable;
+
 void
 procinit(void)
 {
-  struct proc *p;
-  
   initlock(&pid_lock, "nextpid");
-  for(p = proc; p < &proc[NPROC]; p++) {
-      initlock(&p->lock, "proc");
-
-      // Allocate a page for the process's kernel stack.
-      // Map it high in memory, followed by an invalid
-      // guard page.
-      char *pa = kalloc();
-      if(pa == 0)
-        panic("kalloc");
-      uint64 va = KSTACK((int) (p - proc));
-      kvmmap(va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
-      p->kstack = va;
+  initlock(&proc_list_lock, "proc_list");
+  if(!kmem_cache_create(&proc_cache, "proc", sizeof(struct proc)))
+    panic("procinit");
+  shrinker_register(&proc_shrinker);
+}
+
+// Start and end a walk of proc_list outside scheduler().
+void
+proc_walk_begin(void)
+{
+  push_off();
+}
+
+void
+proc_walk_end(void)
+{
+  pop_off();
+}
+
+// Record that this CPU is in no walk of proc_list, and holds
+// no pointer to a proc taken off it.
+static void
+proc_quiesce(struct cpu *c)
+{
+  __sync_synchronize();
+  __atomic_store_n(&c->proc_qs, c->proc_qs + 1, __ATOMIC_RELAXED);
+  __sync_synchronize();
+}
+
+// Find a free kernel stack slot and mark it used.
+// Returns its number, or -1 if there is none.
+// Caller must hold proc_list_lock.
+static int
+kstack_alloc(void)
+{
+  int i, b;
+
+  for(i = 0; i < NELEM(kstack_used); i++){
+    if(kstack_used[i] == ~0UL)
+      continue;
+    for(b = 0; kstack_used[i] & (1UL << b); b++)
+      ;
+    kstack_used[i] |= 1UL << b;
+    return i * 64 + b;
+  }
+  return -1;
+}
+
+// Allocate a new proc structure and its kernel stack, and add it to
+// the list of all procs. Returns with p->lock held, or 0 if out of
+// memory.
+static struct proc*
+procgrow(void)
+{
+  struct proc *p;
+  char *pa;
+  uint64 va;
+  int slot;
+
+  if((p = kmem_cache_alloc(proc_cache, KALLOC_ZERO)) == 0)
+    return 0;
+  if((pa = kalloc_flags(0)) == 0){
+    kmem_cache_free(proc_cache, p);
+    return 0;
+  }
+  initlock(&p->lock, "proc");
+
+  acquire(&proc_list_lock);
+
+  // Map the kernel stack high in memory, followed by an invalid
+  // guard page.
+  if((slot = kstack_alloc()) < 0)
+    goto bad;
+  va = KSTACK(slot);
+  if(mappages(kernel_pagetable, va, PGSIZE, (uint64)pa, PTE_R | PTE_W) != 0){
+    kstack_used[slot / 64] &= ~(1UL << (slot % 64));
+    goto bad;
+  }
+  p->kstack = va;
+  __sync_fetch_and_add(&kstack_gen, 1);
+  sfence_vma();
+
+  // Lock p before anyone else can find it, and make sure its
+  // contents are visible before it is.
+  acquire(&p->lock);
+  p->seq = ++proc_seq;
+  __sync_synchronize();
+  if(proc_tail)
+    proc_tail->next = p;
+  else
+    proc_list = p;
+  proc_tail = p;
+
+  release(&proc_list_lock);
+
+  return p;
+
+bad:
+  release(&proc_list_lock);
+  freelock(&p->lock);
+  kfree(pa);
+  kmem_cache_free(proc_cache, p);
+  return 0;
+}
+
+// Free the procs taken off proc_list last time, if every CPU
+// has passed a quiescent state since. Returns 0 if they must
+// wait longer. Caller must hold proc_list_lock.
+static int
+proc_free_retired(void)
+{
+  struct proc *p;
+  int i;
+
+  for(i = 0; i < NCPU; i++){
+    if(proc_retired.qs[i] != 0 &&
+       __atomic_load_n(&cpus[i].proc_qs, __ATOMIC_RELAXED) == proc_retired.qs[i])
+      return 0;
+  }
+  __sync_synchronize();
+
+  for(i = 0; i < proc_retired.n; i++){
+    p = proc_retired.procs[i];
+    freelock(&p->lock);
+    kmem_cache_free(proc_cache, p);
+  }
+  proc_retired.n = 0;
+  return 1;
+}
+
+// Take up to n UNUSED procs off proc_list, leaving the first keep
+// of them, and free their kernel stacks; their structs are freed
+// a later time round. Called with no proc lock held that it
+// could wait for: it gives up on any lock that is taken.
+// Returns the number of kernel stack pages freed.
+static int
+proc_shrink(int keep, int n)
+{
+  struct proc *p, *prev, *next;
+  int i, spare, slot;
+
+  if(!tryacquire(&proc_list_lock))
+    return 0;
+  if(proc_retired.n > 0 && !proc_free_retired()){
+    release(&proc_list_lock);
+    return 0;
+  }
+
+  n = min(n, NELEM(proc_retired.procs));
+  spare = 0;
+  prev = 0;
+  for(p = proc_list; p && proc_retired.n < n; p = next){
+    next = p->next;
+    if(!tryacquire(&p->lock)){
+      prev = p;
+      continue;
+    }
+    if(p->state != UNUSED || spare++ < keep){
+      release(&p->lock);
+      prev = p;
+      continue;
+    }
+
+    // Walks may still get to p, and go on from it, but
+    // allocproc() must not take it.
+    if(prev)
+      prev->next = next;
+    else
+      proc_list = next;
+    if(proc_tail == p)
+      proc_tail = prev;
+    p->retired = 1;
+    release(&p->lock);
+
+    kfree((void*)kvmunmap(p->kstack));
+    slot = (TRAMPOLINE - p->kstack) / (2*PGSIZE) - 1;
+    kstack_used[slot / 64] &= ~(1UL << (slot % 64));
+    proc_retired.procs[proc_retired.n++] = p;
   }
-  kvminithart();
+
+  __sync_synchronize();
+  for(i = 0; i < NCPU; i++)
+    proc_retired.qs[i] = __atomic_load_n(&cpus[i].proc_qs, __ATOMIC_RELAXED);
+  n = proc_retired.n;
+  release(&proc_list_lock);
+
+  return n;
+}
+
+// The proc shrinker: free the kernel stacks of up to npages
+// UNUSED procs.
+static int
+proc_shrink_pages(int npages)
+{
+  return proc_shrink(0, npages);
+}
+
+// Trim the UNUSED procs back to NPROC_SPARE, a batch at a time
+// and at most once a tick. Called by idle CPUs from scheduler().
+// Returns the number of procs taken off the list.
+static int
+proc_trim(void)
+{
+  static uint last;
+  uint now;
+
+  now = __atomic_load_n(&ticks, __ATOMIC_RELAXED);
+  if(now == __atomic_load_n(&last, __ATOMIC_RELAXED))
+    return 0;
+  __atomic_store_n(&last, now, __ATOMIC_RELAXED);
+
+  return proc_shrink(NPROC_SPARE, KMEM_RECLAIM_BATCH);
 }
 
 // Must be called with interrupts disabled,
@@ -87,26 +328,28 @@ allocpid() {
   return pid;
 }
 
-// Look in the process table for an UNUSED proc.
-// If found, initialize state required to run in the kernel,
+// Look in the process table for an UNUSED proc, or add a new one.
+// Initialize state required to run in the kernel,
 // and return with p->lock held.
-// If there are no free procs, return 0.
+// If there is no memory for a new proc, return 0.
 static struct proc*
 allocproc(void)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
+  proc_walk_begin();
+  for(p = proc_list; p; p = p->next) {
     acquire(&p->lock);
-    if(p->state == UNUSED) {
-      goto found;
+    if(p->state == UNUSED && !p->retired) {
+      break;
     } else {
       release(&p->lock);
     }
   }
-  return 0;
+  proc_walk_end();
+  if(p == 0 && (p = procgrow()) == 0)
+    return 0;
 
-found:
   p->pid = allocpid();
 
   // Allocate a trapframe page.
@@ -117,6 +360,34 @@ found:
 
   // An empty user page table.
   p->pagetable = proc_pagetable(p);
+  if(p->pagetable == 0){
+    freeproc(p);
+    release(&p->lock);
+    return 0;
+  }
+#ifdef UACCESS
+  p->kpagetable = uvm_kview_create();
+  if(p->kpagetable == 0){
+    freeproc(p);
+    release(&p->lock);
+    return 0;
+  }
+#endif
+  p->asid = 0;      // given one on the way to user space
+  p->asid_cpu = -1;
+  p->fault_next = 0;
+  p->fault_window = 1;
+  p->swap_hand = 0;
+  p->vm_policy = VM_FAULTAROUND;
+  p->wss_ticks = 0;
+  memset(&p->wss, 0, sizeof(p->wss));
+  p->ksm = 0;
+  p->ksm_next = 0;
+  p->vm_quiet = 0;
+  p->kthread = 0;
+  p->vmas = 0;
+  p->heap_start = 0;
+  p->brk = 0;
 
   // Set up new context to start executing at forkret,
   // which returns to user space.
@@ -147,6 +418,13 @@ freeproc(struct proc *p)
   if(p->pagetable)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
+  vma_free(p->vmas);
+  p->vmas = 0;
+#ifdef UACCESS
+  if(p->kpagetable)
+    uvm_kview_free(p->kpagetable);
+  p->kpagetable = 0;
+#endif
   p->sz = 0;
   p->pid = 0;
   p->parent = 0;
@@ -159,6 +437,7 @@ freeproc(struct proc *p)
 
 // Create a page table for a given process,
 // with no user pages, but with trampoline pages.
+// Returns 0 if out of memory.
 pagetable_t
 proc_pagetable(struct proc *p)
 {
@@ -166,17 +445,26 @@ proc_pagetable(struct proc *p)
 
   // An empty page table.
   pagetable = uvmcreate();
+  if(pagetable == 0)
+    return 0;
 
   // map the trampoline code (for system call return)
   // at the highest user virtual address.
   // only the supervisor uses it, on the way
   // to/from user space, so not PTE_U.
-  mappages(pagetable, TRAMPOLINE, PGSIZE,
-           (uint64)trampoline, PTE_R | PTE_X);
+  if(mappages(pagetable, TRAMPOLINE, PGSIZE,
+              (uint64)trampoline, PTE_R | PTE_X) < 0){
+    uvmfree(pagetable, 0);
+    return 0;
+  }
 
   // map the trapframe just below TRAMPOLINE, for trampoline.S.
-  mappages(pagetable, TRAPFRAME, PGSIZE,
-           (uint64)(p->trapframe), PTE_R | PTE_W);
+  if(mappages(pagetable, TRAPFRAME, PGSIZE,
+              (uint64)(p->trapframe), PTE_R | PTE_W) < 0){
+    uvmunmap(pagetable, TRAMPOLINE, PGSIZE, 0);
+    uvmfree(pagetable, 0);
+    return 0;
+  }
 
   return pagetable;
 }
@@ -188,8 +476,7 @@ proc_freepagetable(pagetable_t pagetable, uint64 sz)
 {
   uvmunmap(pagetable, TRAMPOLINE, PGSIZE, 0);
   uvmunmap(pagetable, TRAPFRAME, PGSIZE, 0);
-  if(sz > 0)
-    uvmfree(pagetable, sz);
+  uvmfree(pagetable, sz);
 }
 
 // a user program that calls exec("/init")
@@ -216,7 +503,11 @@ userinit(void)
   // allocate one user page and copy init's instructions
   // and data into it.
   uvminit(p->pagetable, initcode, sizeof(initcode));
+  if(vma_add(&p->vmas, 0, PGSIZE, VMA_TEXT,
+             PROT_READ | PROT_WRITE | PROT_EXEC) < 0)
+    panic("userinit: vma");
   p->sz = PGSIZE;
+  p->heap_start = p->brk = PGSIZE;
 
   // prepare for the very first "return" from kernel to user.
   p->trapframe->epc = 0;      // user program counter
@@ -230,24 +521,57 @@ userinit(void)
   release(&p->lock);
 }
 
-// Grow or shrink user memory by n bytes.
-// Return 0 on success, -1 on failure.
+// Start a kernel thread running fn(), which must not return.
+// It is scheduled like a process, but has no user memory and
+// never leaves the kernel. Returns its pid, or -1.
 int
-growproc(int n)
+kthread_create(char *name, void (*fn)(void))
+{
+  struct proc *p;
+  int pid;
+
+  if((p = allocproc()) == 0)
+    return -1;
+
+  p->kthread = fn;
+  p->context.ra = (uint64)kthread_start;
+  safestrcpy(p->name, name, sizeof(p->name));
+  pid = p->pid;
+
+  p->state = RUNNABLE;
+
+  release(&p->lock);
+  return pid;
+}
+
+// Move the program break by n bytes, growing or shrinking the
+// heap, and return the old break, or -1. New memory is mapped
+// right away if flags has SBRK_POPULATE or the process's
+// allocation policy is VM_EAGER, and on page faults otherwise.
+uint64
+growproc(int n, int flags)
 {
-  uint sz;
   struct proc *p = myproc();
+  uint64 old;
 
-  sz = p->sz;
-  if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
-      return -1;
-    }
-  } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+  old = p->brk;
+  if(vma_brk(p, old + n) < 0)
+    return -1;
+
+  if(n < 0 && uvmdealloc(p->pagetable, old, p->brk) != p->brk){
+    vma_brk(p, old);
+    return -1;
   }
-  p->sz = sz;
-  return 0;
+
+  // Eager allocation is all or nothing.
+  if(n > 0 && ((flags & SBRK_POPULATE) || p->vm_policy == VM_EAGER) &&
+     uvm_populate(p, old, n) < 0){
+    uvmdealloc(p->pagetable, p->brk, old);
+    vma_brk(p, old);
+    return -1;
+  }
+
+  return old;
 }
 
 // Create a new process, copying the parent.
@@ -258,20 +582,28 @@ fork(void)
   int i, pid;
   struct proc *np;
   struct proc *p = myproc();
-  struct mmap_info *mm_p, *mm_np;
 
   // Allocate process.
   if((np = allocproc()) == 0){
     return -1;
   }
 
-  // Copy user memory from parent to child.
+  // Copy user memory, and the regions it lies in, from parent
+  // to child. np->sz must cover what uvmcopy() mapped before
+  // anything can fail, so that freeproc() unmaps it.
   if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
     freeproc(np);
     release(&np->lock);
     return -1;
   }
   np->sz = p->sz;
+  if(vma_copy(np, p) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  np->vm_policy = p->vm_policy;
+  np->ksm = p->ksm;
 
   np->parent = p;
 
@@ -289,25 +621,6 @@ fork(void)
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
-  for (i = 0; i < MMAP_INFO_MAX; i++) {
-	mm_p = &p->mmap_regions[i];
-	mm_np = &np->mmap_regions[i];
-
-	if (mm_p->used) {
-		mm_np->p = np;
-
-		mm_np->vaddr = mm_p->vaddr;
-		mm_np->len = mm_p->len;
-		mm_np->prot = mm_p->prot;
-		mm_np->flags = mm_p->flags;
-		mm_np->file = mm_p->file;
-		mm_np->off = mm_p->off;
-		mm_np->num_pages = mm_p->num_pages;
-
-		mm_np->used = 1;
-	}
-  }
-
   pid = np->pid;
 
   np->state = RUNNABLE;
@@ -324,7 +637,8 @@ reparent(struct proc *p)
 {
   struct proc *pp;
 
-  for(pp = proc; pp < &proc[NPROC]; pp++){
+  proc_walk_begin();
+  for(pp = proc_list; pp; pp = pp->next){
     // this code uses pp->parent without holding pp->lock.
     // acquiring the lock first could cause a deadlock
     // if pp or a child of pp were also in exit()
@@ -341,6 +655,7 @@ reparent(struct proc *p)
       release(&pp->lock);
     }
   }
+  proc_walk_end();
 }
 
 // Exit the current process.  Does not return.
@@ -354,6 +669,9 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  // Write back and let go of mapped files.
+  mmap_exit(p);
+
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -381,8 +699,10 @@ exit(int status)
   // parent we locked. in case our parent gives us away to init while
   // we're waiting for the parent lock. we may then race with an
   // exiting parent, but the result will be a harmless spurious wakeup
-  // to a dead or wrong process; proc structs are never re-allocated
-  // as anything else.
+  // to a dead or wrong process. as in a walk of proc_list, this
+  // CPU mustn't pass a quiescent state until it holds the parent's
+  // lock, lest the parent's struct be freed meanwhile.
+  proc_walk_begin();
   acquire(&p->lock);
   struct proc *original_parent = p->parent;
   release(&p->lock);
@@ -390,6 +710,7 @@ exit(int status)
   // we need the parent's lock in order to wake it up from wait().
   // the parent-then-child rule says we have to lock it first.
   acquire(&original_parent->lock);
+  proc_walk_end();
 
   acquire(&p->lock);
 
@@ -418,6 +739,11 @@ wait(uint64 addr)
   int havekids, pid;
   struct proc *p = myproc();
 
+  // copyout() can't read a swapped-out page back in with
+  // the locks below held.
+  if(addr != 0)
+    uvm_fault_in(p->pagetable, addr, sizeof(int));
+
   // hold p->lock for the whole time to avoid lost
   // wakeups from a child's exit().
   acquire(&p->lock);
@@ -425,7 +751,8 @@ wait(uint64 addr)
   for(;;){
     // Scan through table looking for exited children.
     havekids = 0;
-    for(np = proc; np < &proc[NPROC]; np++){
+    proc_walk_begin();
+    for(np = proc_list; np; np = np->next){
       // this code uses np->parent without holding np->lock.
       // acquiring the lock first would cause a deadlock,
       // since np might be an ancestor, and we already hold p->lock.
@@ -440,17 +767,20 @@ wait(uint64 addr)
           if(addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
                                   sizeof(np->xstate)) < 0) {
             release(&np->lock);
+            proc_walk_end();
             release(&p->lock);
             return -1;
           }
           freeproc(np);
           release(&np->lock);
+          proc_walk_end();
           release(&p->lock);
           return pid;
         }
         release(&np->lock);
       }
     }
+    proc_walk_end();
 
     // No point waiting if we don't have any children.
     if(!havekids || p->killed){
@@ -486,21 +816,41 @@ scheduler(void)
     // cause a lost wakeup.
     intr_off();
 
+    proc_quiesce(c);
     int found = 0;
-    for(p = proc; p < &proc[NPROC]; p++) {
+    for(p = proc_list; p; p = p->next) {
       acquire(&p->lock);
       if(p->state == RUNNABLE) {
+        // p's kernel stack may have been mapped since this CPU
+        // last flushed its TLB.
+        if(c->kstack_gen != kstack_gen){
+          c->kstack_gen = kstack_gen;
+          sfence_vma();
+        }
+
         // Switch to chosen process.  It is the process's job
         // to release its lock and then reacquire it
         // before jumping back to us.
         p->state = RUNNING;
         c->proc = p;
+#ifdef UACCESS
+        // p runs in the kernel on its own page table, which
+        // must be let go of before p->lock is.
+        tlb_switch_kernel(p);
+#endif
         swtch(&c->scheduler, &p->context);
+#ifdef UACCESS
+        tlb_switch_kernel(0);
+#endif
 
         // Process is done running for now.
         // It should have changed its p->state before coming back.
         c->proc = 0;
 
+        // Any walks of proc_list it made are over, and p
+        // itself isn't UNUSED, so can't have been taken off.
+        proc_quiesce(c);
+
         found = 1;
       }
 
@@ -511,7 +861,11 @@ scheduler(void)
       release(&p->lock);
     }
     if(found == 0){
-      asm volatile("wfi");
+      // Nothing to run: zero some free pages for later, or
+      // reclaim memory if it is short, and only sleep once
+      // there is no such work left.
+      if(kzero_refill() == 0 && reclaim_idle() == 0 && proc_trim() == 0)
+        asm volatile("wfi");
     }
   }
 }
@@ -575,6 +929,20 @@ forkret(void)
   usertrapret();
 }
 
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthread_start.
+static void
+kthread_start(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+
+  p->kthread();
+  panic("kthread returned");
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
@@ -616,13 +984,15 @@ wakeup(void *chan)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
+  proc_walk_begin();
+  for(p = proc_list; p; p = p->next) {
     acquire(&p->lock);
     if(p->state == SLEEPING && p->chan == chan) {
       p->state = RUNNABLE;
     }
     release(&p->lock);
   }
+  proc_walk_end();
 }
 
 // Wake up p if it is sleeping in wait(); used by exit().
@@ -645,7 +1015,8 @@ kill(int pid)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++){
+  proc_walk_begin();
+  for(p = proc_list; p; p = p->next){
     acquire(&p->lock);
     if(p->pid == pid){
       p->killed = 1;
@@ -654,10 +1025,12 @@ kill(int pid)
         p->state = RUNNABLE;
       }
       release(&p->lock);
+      proc_walk_end();
       return 0;
     }
     release(&p->lock);
   }
+  proc_walk_end();
   return -1;
 }
 
@@ -708,7 +1081,8 @@ procdump(void)
   char *state;
 
   printf("\n");
-  for(p = proc; p < &proc[NPROC]; p++){
+  proc_walk_begin();
+  for(p = proc_list; p; p = p->next){
     if(p->state == UNUSED)
       continue;
     if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
@@ -718,4 +1092,5 @@ procdump(void)
     printf("%d %s %s", p->pid, state, p->name);
     printf("\n");
   }
+  proc_walk_end();
 }
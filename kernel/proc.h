@@ -1,4 +1,5 @@
-#include "mmap.h"
+#include "vma.h"
+#include "wss.h"
 
 // Saved registers for kernel context switches.
 struct context {
@@ -26,6 +27,9 @@ struct cpu {
   struct context scheduler;   // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint64 kstack_gen;          // kstack_gen (proc.c) at the last TLB flush.
+  uint64 asid_gen;            // ASID generation the TLB is clean for (tlb.c).
+  uint64 proc_qs;             // Quiescent states passed for proc_list (proc.c).
 };
 
 extern struct cpu cpus[NCPU];
@@ -95,11 +99,30 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  struct proc *next;           // Next on proc_list (see proc.c)
+  uint64 seq;                  // Increases along proc_list
+  int retired;                 // Taken off proc_list, to be freed
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
-  uint64 sz;                   // Size of process memory (bytes)
+  uint64 sz;                   // End of the highest region (vma.c)
+  struct vma *vmas;            // Tree of address-space regions (vma.c)
+  uint64 heap_start;           // Where the heap begins
+  uint64 brk;                  // Program break: where the heap ends
   pagetable_t pagetable;       // Page table
+  pagetable_t kpagetable;      // Kernel page table, if UACCESS (vm.c)
+  uint64 asid;                 // Address space ID and its generation (tlb.c)
+  int asid_cpu;                // CPU that last ran the process in user space
+  uint64 fault_next;           // Page a sequential lazy fault would hit next
+  int fault_window;            // Pages the next lazy fault maps (vm.c)
+  uint64 swap_hand;            // Where uvm_swap_out()'s clock hand points
+  int vm_policy;               // Allocation policy (see mman.h)
+  int wss_ticks;               // Ticks of CPU time since the last wss_scan()
+  struct wss wss;              // Working set at the last scan (wss.c)
+  int ksm;                     // Opted in to same-page merging (ksm.c)
+  uint64 ksm_next;             // Where ksmd's scan of the process resumes
+  int vm_quiet;                // Stopped holding on to none of its pages
+  void (*kthread)(void);       // A kernel thread's function, or 0
   struct trapframe *trapframe; // data page for trampoline.S
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
@@ -112,6 +135,4 @@ struct proc {
   uint64 sigalarm_fn;
   struct trapframe *alarm_tf;
   int alarm_in_handler;
-
-  struct mmap_info mmap_regions[MMAP_INFO_MAX];
 };
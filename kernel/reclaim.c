@@ -0,0 +1,110 @@
+/*
+ * reclaim.c: Memory reclaim
+ *
+ * Parts of the kernel hold on to memory they could do without: the buffer and
+ * inode caches keep unused entries, slab caches keep empty slabs, and idle CPUs
+ * fill a pool of pre-zeroed pages. Each of them registers a shrinker, which
+ * gives some of that memory back to the page allocator when asked.
+ *
+ * Reclaim runs synchronously when an allocation would otherwise fail (see
+ * kalloc_flags() and kalloc_pages()), and asynchronously on idle CPUs whenever
+ * fewer than KMEM_RECLAIM_LOW pages are free, a batch at a time, so that
+ * allocations seldom have to wait for it.
+ *
+ * Only one CPU reclaims at a time. Reclaim does not wait for another CPU's
+ * reclaim to finish, nor recurse: a shrinker may itself allocate (a slab
+ * magazine, say) and that allocation may fail. Since the allocation that
+ * started reclaim may have been made with a lock held, shrinkers only try
+ * their locks (see struct shrinker).
+ */
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "reclaim.h"
+
+static struct {
+	struct spinlock lock;		// Protects additions to the list.
+	struct shrinker *shrinkers;	// In order of increasing cost.
+	int busy;
+} reclaimer;
+
+void
+reclaiminit(void)
+{
+	initlock(&reclaimer.lock, "reclaim");
+}
+
+/*
+ * Add a shrinker. Shrinkers are never removed.
+ */
+void
+shrinker_register(struct shrinker *s)
+{
+	struct shrinker **pp;
+
+	s->ncall = 0;
+	s->nfreed = 0;
+
+	acquire(&reclaimer.lock);
+	for (pp = &reclaimer.shrinkers; *pp; pp = &(*pp)->next)
+		if ((*pp)->cost > s->cost)
+			break;
+	s->next = *pp;
+	__sync_synchronize();
+	*pp = s;
+	release(&reclaimer.lock);
+}
+
+/*
+ * Call the shrinkers, cheapest first, until about npages pages are freed.
+ * Returns the number of pages freed, which is 0 if another CPU is already
+ * reclaiming.
+ */
+int
+reclaim(int npages)
+{
+	struct shrinker *s;
+	int n, freed;
+
+	if (__sync_lock_test_and_set(&reclaimer.busy, 1))
+		return 0;
+
+	freed = 0;
+	for (s = reclaimer.shrinkers; s && freed < npages; s = s->next) {
+		n = s->shrink(npages - freed);
+		s->ncall++;
+		s->nfreed += n;
+		freed += n;
+	}
+
+	__sync_lock_release(&reclaimer.busy);
+
+	return freed;
+}
+
+/*
+ * Reclaim a batch of pages if free memory is below the low watermark. Called
+ * by idle CPUs from scheduler(). Returns the number of pages freed; 0 means
+ * there is nothing (more) to do.
+ */
+int
+reclaim_idle(void)
+{
+	if (kmem_nfree() >= KMEM_RECLAIM_LOW)
+		return 0;
+
+	return reclaim(KMEM_RECLAIM_BATCH);
+}
+
+void
+reclaim_stats_print(void)
+{
+	struct shrinker *s;
+
+	for (s = reclaimer.shrinkers; s; s = s->next)
+		printf("shrinker %s: #call %d #freed %d\n", s->name, s->ncall,
+			s->nfreed);
+}
@@ -0,0 +1,32 @@
+/*
+ * A shrinker gives memory that a part of the kernel keeps cached back to the
+ * page allocator when asked to (see reclaim.c).
+ */
+struct shrinker {
+	char *name;
+
+	/*
+	 * Try to free about npages pages. Returns the number of pages freed.
+	 *
+	 * Called from inside kalloc_flags() and kalloc_pages() when memory
+	 * runs out, so possibly with interrupts off and any spinlock held
+	 * that an allocating caller may hold, or from an idle CPU's scheduler
+	 * loop with no current process. It must not sleep, and must take
+	 * such locks with tryacquire(), freeing nothing if one is busy.
+	 */
+	int (*shrink)(int npages);
+
+	/*
+	 * Shrinkers are called in order of increasing cost: how much the
+	 * memory they free would be missed.
+	 */
+	int cost;
+
+	struct shrinker *next;
+	uint64 ncall;		// Times called.
+	uint64 nfreed;		// Pages freed.
+};
+
+#define SHRINK_COST_FREE	0	// Free memory held back (the zero pool).
+#define SHRINK_COST_EMPTY	1	// Memory holding nothing (empty slabs).
+#define SHRINK_COST_CACHE	2	// Cached data that may be needed again.
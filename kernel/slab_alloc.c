@@ -12,16 +12,33 @@
  * The solution is to adopt the slab allocator.
  *
  * The slab allocator builds on the page allocator and manages objects of a
- * specific size (e.g., file structures). It maintains a number of "slabs". For
- * simplicity, we assume that a slab spans exactly one page. Each slab contains
- * some metadata at the beginning and a number of objects after the metadata.
+ * specific size (e.g., file structures). It maintains a number of "slabs". A
+ * slab is a block of 2^order pages from kalloc_pages(), with a struct slab
+ * header at the beginning and a number of objects after the header. Small
+ * objects use single-page slabs; larger objects use multi-page slabs, so that
+ * enough objects fit in each slab to keep the wasted space small.
  *
- * For allocation, the slab allocator finds a slab that is not full and
- * allocates a free object from the slab. If all slabs are full, the slab
- * allocator may ask the page allocator for more free slabs (via kalloc). For
- * deallocation, the slab allocator gives an object back to the corresponding
- * slab. If all objects within a slab are free, the slab allocator may give the
- * slab back to the page allocator (via kfree).
+ * Each cache keeps its slabs on three lists: partial (some objects free), full
+ * (no objects free) and empty (all objects free). The free objects of a slab
+ * are chained through their first word, so allocating or freeing an object is a
+ * constant-time pop or push. kalloc_pages() returns blocks aligned to their
+ * size, so the slab that owns an object is found by rounding the object's
+ * address down to the slab size.
+ *
+ * For allocation, the slab allocator takes an object from a partial slab, or
+ * failing that from an empty slab. If there are no such slabs, it asks the page
+ * allocator for a new one. For deallocation, the object goes back on its slab's
+ * freelist. When a slab becomes empty it is kept for reuse, but only up to
+ * KMEM_SLAB_EMPTY_MAX of them; the rest go back to the page allocator, as does
+ * every empty slab when the cache is shrunk with kmem_cache_shrink().
+ *
+ * In front of the slab layer, each CPU has two "magazines" of free objects
+ * per cache (Bonwick and Adams, "Magazines and Vmem", USENIX 2001). Most
+ * allocations and frees only push or pop the current CPU's loaded magazine
+ * with interrupts disabled, and take no lock at all. When both of a CPU's
+ * magazines are empty (or full) it exchanges one with the cache's depot of full
+ * and empty magazines, and only when the depot has nothing to offer does it go
+ * down to the slab layer.
  *
  * This implementation attempts to mimic the slab allocator discussed in Jeff
  * Bonwick's "The Slab Allocator: An Object-Caching Kernel Memory Allocator".
@@ -30,11 +47,95 @@
  */
 
 #include "types.h"
+#include "param.h"
+#include "spinlock.h"
 #include "riscv.h"
 #include "defs.h"
+#include "reclaim.h"
 
 #define KMEM_CACHE_MAX 200
 
+/*
+ * Aim for at least this many objects per slab, using slabs of up to
+ * 2^KMEM_SLAB_ORDER pages. Objects too large for that get the smallest slab
+ * that fits one of them.
+ */
+#define KMEM_SLAB_MINOBJ	8
+#define KMEM_SLAB_ORDER		3
+
+/*
+ * Empty slabs kept by a cache after its objects are freed.
+ */
+#define KMEM_SLAB_EMPTY_MAX	1
+
+/*
+ * Objects are aligned to this many bytes.
+ */
+#define KMEM_SLAB_ALIGN		8
+
+#define SLAB_SIZE(cp)		((uint64) PGSIZE << (cp)->order)
+
+/*
+ * The cache does not have a magazine layer (the magazine cache itself).
+ */
+#define KMEM_CACHE_NOMAG	0x1
+
+/*
+ * The header at the start of every slab. The list link must come first, as
+ * the list functions in list.c treat the slab as a struct list.
+ */
+struct slab {
+	struct list link;		// On one of the cache's slab lists.
+	struct kmem_cache *cache;	// The cache that owns the slab.
+	void *free;			// First free object.
+	int inuse;			// Objects allocated from the slab.
+};
+
+/*
+ * A stack of up to KMEM_MAG_SIZE free objects.
+ */
+struct kmem_magazine {
+	struct kmem_magazine *next;	// In the depot.
+	int n;
+	void *obj[KMEM_MAG_SIZE];
+};
+
+/*
+ * A CPU's view of a cache. Only ever touched by its own CPU, with interrupts
+ * disabled, so it needs no lock. The loaded magazine is used first, then the
+ * previous one; between them the CPU can absorb KMEM_MAG_SIZE allocations or
+ * frees in a row after an exchange with the depot.
+ */
+struct kmem_cpu_cache {
+	struct kmem_magazine *loaded;
+	struct kmem_magazine *prev;
+	uint64 nhit;		// Served from this CPU's magazines.
+	uint64 nmiss;		// Had to go to the depot or slab layer.
+};
+
+struct kmem_cache {
+	struct spinlock lock;	// Protects the slab lists and the depot.
+	char *name;
+	int flags;
+	int size;		// Object size, rounded up to KMEM_SLAB_ALIGN.
+	int order;		// Each slab is 2^order pages.
+	int nobj;		// Objects per slab.
+	int offset;		// Offset of the first object in a slab.
+
+	struct list partial;	// Slabs with some objects free.
+	struct list full;	// Slabs with no objects free.
+	struct list empty;	// Slabs with every object free.
+	int nempty;
+
+	uint64 nslabs;		// Slabs currently owned by the cache.
+	uint64 nalloc;		// Objects allocated from the slab layer.
+
+	struct kmem_magazine *depot_full;	// Depot: magazines with objects.
+	struct kmem_magazine *depot_empty;	// Depot: magazines with no objects.
+
+	struct kmem_cpu_cache cpu[NCPU];
+};
+
 /*
  * Kernel caches can be statically initialized. For each cache, a corresponding
  * bitflag is needed to indicate whether or not the cache is currently in use
@@ -42,26 +143,88 @@
  */
 struct kmem_cache	KMEM_CACHES[KMEM_CACHE_MAX];
 int			KMEM_CACHE_FLAGS[KMEM_CACHE_MAX];
+struct spinlock		KMEM_CACHES_LOCK;
+
+/*
+ * Magazines are themselves allocated from a cache, which has no magazine layer.
+ */
+static struct kmem_cache *kmem_magazine_cache;
 
-static void kmem_cache_slab_zero(struct kmem_cache *);
-static void *kmem_cache_slab_find(struct kmem_cache *);
 static struct kmem_cache *KMEM_CACHES_RESERVE(void);
-static int KMEM_CACHES_FREE(struct kmem_cache *);
+static int kmem_cache_setup(struct kmem_cache **, char *, int, int);
+static void *kmem_slab_alloc(struct kmem_cache *);
+static void *kmem_slab_free(struct kmem_cache *, void *);
+static void *kmem_mag_pop(struct kmem_cache *, struct kmem_cpu_cache *);
+static int kmem_mag_push(struct kmem_cache *, struct kmem_cpu_cache *, void *);
+static struct slab *kmem_cache_grow(struct kmem_cache *);
+static struct slab *kmem_slab_of(struct kmem_cache *, void *);
+static int kmem_cache_reap(int);
+
+static struct shrinker kmem_cache_shrinker = {
+	.name = "kmem_cache",
+	.shrink = kmem_cache_reap,
+	.cost = SHRINK_COST_EMPTY,
+};
+
+/*
+ * Initialize the lock protecting KMEM_CACHES and the magazine cache. Called
+ * once, before any cache is created.
+ */
+void
+kmem_cache_init(void)
+{
+	initlock(&KMEM_CACHES_LOCK, "kmem_caches");
+
+	if (!kmem_cache_setup(&kmem_magazine_cache, "kmem_magazine",
+	    sizeof(struct kmem_magazine), KMEM_CACHE_NOMAG))
+		panic("kmem_cache_init");
+
+	shrinker_register(&kmem_cache_shrinker);
+}
 
 /*
  * Allocate a new "clean" (i.e. no previous data contained) cache from
- * KMEM_CACHES and point to it with cp.
+ * KMEM_CACHES for objects of the given size and point to it with cp. Returns 1
+ * on success, 0 on failure.
  */
 int
-kmem_cache_create(struct kmem_cache **cp, int align)
+kmem_cache_create(struct kmem_cache **cp, char *name, int size)
+{
+	return kmem_cache_setup(cp, name, size, 0);
+}
+
+static int
+kmem_cache_setup(struct kmem_cache **cp, char *name, int size, int flags)
 {
 	struct kmem_cache *cache;
+	int order, offset, nobj;
+
+	if (size <= 0)
+		return 0;
 
 	/*
-	 * Current caches only allocate 1 page for their slabs, so any object
-	 * sizes larger than that are not currently allowed.
+	 * Objects hold the freelist link while they are free, so they must have
+	 * room for a pointer.
 	 */
-	if (align <= 0 || align > SLAB_LIM)
+	size = (size + KMEM_SLAB_ALIGN - 1) & ~(KMEM_SLAB_ALIGN - 1);
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+
+	/*
+	 * Pick the slab size: the smallest one that holds KMEM_SLAB_MINOBJ
+	 * objects, or the largest allowed one if none does (as long as at least
+	 * one object fits).
+	 */
+	offset = (sizeof(struct slab) + KMEM_SLAB_ALIGN - 1) &
+		~(KMEM_SLAB_ALIGN - 1);
+	for (order = 0; order <= KMEM_MAX_ORDER; order++) {
+		nobj = (((uint64) PGSIZE << order) - offset) / size;
+		if (nobj >= KMEM_SLAB_MINOBJ)
+			break;
+		if (nobj > 0 && order >= KMEM_SLAB_ORDER)
+			break;
+	}
+	if (order > KMEM_MAX_ORDER)
 		return 0;
 
 	/*
@@ -75,12 +238,22 @@ kmem_cache_create(struct kmem_cache **cp, int align)
 	 * Ensure that all data is prepared for the kernel object that the cache
 	 * will hold.
 	 */
-	cache->align = align;
-	cache->slab = 0;
-	cache->size = 0;
-	cache->len = SLAB_LIM / align;
-	cache->prev = 0;
-	cache->next = 0;
+	initlock(&cache->lock, name);
+	cache->name = name;
+	cache->flags = flags;
+	cache->size = size;
+	cache->order = order;
+	cache->nobj = nobj;
+	cache->offset = offset;
+	lst_init(&cache->partial);
+	lst_init(&cache->full);
+	lst_init(&cache->empty);
+	cache->nempty = 0;
+	cache->nslabs = 0;
+	cache->nalloc = 0;
+	cache->depot_full = 0;
+	cache->depot_empty = 0;
+	memset(cache->cpu, 0, sizeof(cache->cpu));
 
 	*cp = cache;
 
@@ -88,277 +261,544 @@ kmem_cache_create(struct kmem_cache **cp, int align)
 }
 
 /*
- * Allocate an object from the current cache.
+ * Allocate an object from a cache. With KALLOC_ZERO in flags the object is
+ * zero-filled; otherwise its contents are undefined. Returns 0 if no memory is
+ * available.
  */
 void *
 kmem_cache_alloc(struct kmem_cache *cp, int flags)
 {
-	int ret;
 	void *obj;
 
-	/*
-	 * If the cache's size is 0, then the slab is NULL (i.e. has not been
-	 * allocated yet). Allocate the slab with kalloc().
-	 */
-	if (cp->size == 0) {
-		cp->slab = kalloc();
-		if (!cp->slab)
+	obj = 0;
+	if (!(cp->flags & KMEM_CACHE_NOMAG)) {
+		push_off();
+		obj = kmem_mag_pop(cp, &cp->cpu[cpuid()]);
+		pop_off();
+	}
+
+	if (!obj) {
+		acquire(&cp->lock);
+		obj = kmem_slab_alloc(cp);
+		release(&cp->lock);
+		if (!obj)
 			return 0;
+	}
 
-		kmem_cache_slab_zero(cp);
-	} else if (cp->size == cp->len) {
-		/*
-		 * The slab is full. Allocate the object from the next cache in
-		 * the linked list.
-		 */
-		if (!cp->next) {
-			/*
-			 * The next cache in the list does not currently exist.
-			 * Attempt to allocate (reserve) it and return NULL (0)
-			 * if allocation fails.
-			 */
-			ret = kmem_cache_create(&cp->next, cp->align);
-			if (!ret)
-				return 0;
-
-			/*
-			 * Allocation was successful, ensure that the next cache
-			 * understands which cache comes BEFORE it in the
-			 * linked list (i.e. the current cache).
-			 */
-			cp->next->prev = cp;
-		}
+	if (flags & KALLOC_ZERO)
+		memset(obj, 0, cp->size);
 
-		/*
-		 * Allocate the object from the next cache and return it.
-		 */
-		return kmem_cache_alloc(cp->next, cp->align);
+	return obj;
+}
+
+/*
+ * Free an object back to the cache it was allocated from.
+ */
+void
+kmem_cache_free(struct kmem_cache *cp, void *obj)
+{
+	void *slab;
+	int cached;
+
+	cached = 0;
+	if (!(cp->flags & KMEM_CACHE_NOMAG)) {
+		push_off();
+		cached = kmem_mag_push(cp, &cp->cpu[cpuid()], obj);
+		pop_off();
 	}
+	if (cached)
+		return;
 
-	/*
-	 * Find a free space for the object in the cache's slab. If a free
-	 * space doesn't exist (which shouldn't happen here, as we've already
-	 * verified that 0 <= cp->size < cp->len, thus there is space in the
-	 * slab), then return NULL (0).
-	 */
-	obj = kmem_cache_slab_find(cp);
-	if (obj == 0)
-		return 0;
+	acquire(&cp->lock);
+	slab = kmem_slab_free(cp, obj);
+	release(&cp->lock);
+
+	if (slab)
+		kfree_pages(slab, cp->order);
+}
+
+/*
+ * Take an object from the current CPU's magazines, exchanging an empty
+ * magazine for a full one from the depot if need be. Returns 0 if the depot has
+ * no full magazines either. Interrupts must be disabled.
+ */
+static void *
+kmem_mag_pop(struct kmem_cache *cp, struct kmem_cpu_cache *cc)
+{
+	struct kmem_magazine *m;
+
+	if (cc->loaded && cc->loaded->n > 0) {
+		cc->nhit++;
+		return cc->loaded->obj[--cc->loaded->n];
+	}
+
+	if (cc->prev && cc->prev->n > 0) {
+		m = cc->prev;
+		cc->prev = cc->loaded;
+		cc->loaded = m;
+		cc->nhit++;
+		return m->obj[--m->n];
+	}
+
+	cc->nmiss++;
 
 	/*
-	 * Update the cache's size and return the free space's location.
+	 * Both magazines are empty (or missing). Swap the previous one for a
+	 * full magazine from the depot.
 	 */
-	cp->size++;
+	acquire(&cp->lock);
+	m = cp->depot_full;
+	if (m) {
+		cp->depot_full = m->next;
+		if (cc->prev) {
+			cc->prev->next = cp->depot_empty;
+			cp->depot_empty = cc->prev;
+		}
+		cc->prev = cc->loaded;
+		cc->loaded = m;
+	}
+	release(&cp->lock);
 
-	return obj;
+	if (!m)
+		return 0;
+
+	return m->obj[--m->n];
 }
 
 /*
- * Free an object from the current cache.
+ * Put a free object in the current CPU's magazines, exchanging a full magazine
+ * for an empty one from the depot (or a newly allocated one) if need be.
+ * Returns 0 if there was no room, in which case the caller frees the object
+ * to the slab layer. Interrupts must be disabled.
  */
-void
-kmem_cache_free(struct kmem_cache **cp, void *obj)
+static int
+kmem_mag_push(struct kmem_cache *cp, struct kmem_cpu_cache *cc, void *obj)
 {
-	int *p;
-	struct kmem_cache *cache;
-	void *ptr;
+	struct kmem_magazine *m;
+
+	if (cc->loaded && cc->loaded->n < KMEM_MAG_SIZE) {
+		cc->loaded->obj[cc->loaded->n++] = obj;
+		cc->nhit++;
+		return 1;
+	}
+
+	if (cc->prev && cc->prev->n == 0) {
+		m = cc->prev;
+		cc->prev = cc->loaded;
+		cc->loaded = m;
+		m->obj[m->n++] = obj;
+		cc->nhit++;
+		return 1;
+	}
+
+	cc->nmiss++;
 
-	cache = *cp;
+	acquire(&cp->lock);
+	m = cp->depot_empty;
+	if (m)
+		cp->depot_empty = m->next;
+	release(&cp->lock);
+
+	if (!m) {
+		m = kmem_cache_alloc(kmem_magazine_cache, 0);
+		if (!m)
+			return 0;
+		m->n = 0;
+	}
 
 	/*
-	 * Iterate through this cache's slab and check if the slab currently
-	 * holds the object to be freed.
+	 * Hand the previous magazine (which holds objects) to the depot, and
+	 * load the empty one.
 	 */
-	for (ptr = cache->slab; ptr < (cache->slab + SLAB_LIM); ptr += cache->align) {
-		/*
-		 * If the current position in the slab does not match the
-		 * object's position, continue on.
-		 */
-		if (ptr != obj)
-			continue;
+	acquire(&cp->lock);
+	if (cc->prev) {
+		cc->prev->next = cp->depot_full;
+		cp->depot_full = cc->prev;
+	}
+	release(&cp->lock);
 
-		/*
-		 * Set the first four bytes of the object in the cache to -1 to
-		 * show it is a free space. Decrement the cache's size to show a
-		 * slot was freed.
-		 */
-		p = (int *) obj;
-		*p = -1;
+	cc->prev = cc->loaded;
+	cc->loaded = m;
+	m->obj[m->n++] = obj;
 
-		cache->size--;
+	return 1;
+}
 
-		/*
-		 * If it is shown that the cache no longer holds any more
-		 * objects, free the cache's slab and deallocate the cache on
-		 * KMEM_CACHES.
-		 */
-		if (cache->size < 0) {
-			kalloc_refcnt_dec(cache->slab);
-			KMEM_CACHES_FREE(cache);
-
-			/*
-			 * If the cache is in the middle of 2 nodes of the
-			 * linked list, set cache->prev's next to cache->next
-			 * and cache->next's prev to cache->prev. In effect,
-			 * this will do the following:
-			 *
-			 * BEFORE:
-			 *	prev <--> curr <--> next
-			 *
-			 * AFTER:
-			 *	prev <--> next
-			 *
-			 * Thus, the current cache is now completely
-			 * deallocated.
-			 */
-			if (cache->next && cache->prev) {
-				cache->prev->next = cache->next;
-				cache->next->prev = cache->prev;
-			} else if (cache->next && !cache->prev)
-				/*
-				 * If this cache node is the current head of a
-				 * linked list, update its pointer to point to
-				 * cache->next (in effect, this will make
-				 * cache->next the new head of the linked list).
-				 */
-				*cp = cache->next;
-		}
+/*
+ * Take an object from the slab layer. The cache's lock must be held.
+ */
+static void *
+kmem_slab_alloc(struct kmem_cache *cp)
+{
+	struct slab *s;
+	void *obj;
 
-		break;
+	/*
+	 * Prefer partially used slabs, so that empty ones can be given back to
+	 * the page allocator. If there are none, grow the cache.
+	 */
+	if (!lst_empty(&cp->partial)) {
+		s = (struct slab *) cp->partial.next;
+	} else if (!lst_empty(&cp->empty)) {
+		s = (struct slab *) cp->empty.next;
+		lst_remove(&s->link);
+		lst_push(&cp->partial, s);
+		cp->nempty--;
+	} else {
+		s = kmem_cache_grow(cp);
+		if (!s)
+			return 0;
 	}
 
 	/*
-	 * The object wasn't found in the current cache, so move on to the next
-	 * cache (if it exists).
+	 * Pop the first free object off of the slab's freelist, and move the
+	 * slab to the full list if that was its last one.
 	 */
-	if (cache->next)
-		kmem_cache_free(&cache->next, obj);
+	obj = s->free;
+	s->free = *(void **) obj;
+	s->inuse++;
+	cp->nalloc++;
+	if (s->inuse == cp->nobj) {
+		lst_remove(&s->link);
+		lst_push(&cp->full, s);
+	}
+
+	return obj;
 }
 
 /*
- * Reserve a cache from KMEM_CACHES.
+ * Return an object to its slab. The cache's lock must be held. If the slab is
+ * now empty and the cache already has enough empty slabs, the slab is taken
+ * off the cache's lists and returned, for the caller to free with
+ * kfree_pages() once the lock is released.
  */
-static struct kmem_cache *
-KMEM_CACHES_RESERVE(void)
+static void *
+kmem_slab_free(struct kmem_cache *cp, void *obj)
 {
-	/*
-	 * Traverse the KMEM_CACHES and KMEM_CACHE_FLAGS arrays, if a
-	 * corresponding cache's bit flag is 0 (indicating the cache that the
-	 * flag is representing is free), reserve the cache.
-	 */
-	for (int i = 0; i < KMEM_CACHE_MAX; i++) {
+	struct slab *s;
+
+	s = kmem_slab_of(cp, obj);
+
+	*(void **) obj = s->free;
+	s->free = obj;
+	s->inuse--;
+	cp->nalloc--;
+
+	if (s->inuse == 0) {
 		/*
-		 * If the cache is currently allocated, continue.
+		 * The slab is now empty. Keep a few empty slabs around for
+		 * future allocations and give the rest back.
 		 */
-		if (KMEM_CACHE_FLAGS[i] == 1)
-			continue;
-
+		lst_remove(&s->link);
+		if (cp->nempty < KMEM_SLAB_EMPTY_MAX) {
+			lst_push(&cp->empty, s);
+			cp->nempty++;
+		} else {
+			cp->nslabs--;
+			return s;
+		}
+	} else if (s->inuse == cp->nobj - 1) {
 		/*
-		 * An unallocated cache has been reached. Set its corresponding
-		 * bit flag to 1 (indicating it's currently taken) and return
-		 * a pointer to the cache.
+		 * The slab was full until now.
 		 */
-		KMEM_CACHE_FLAGS[i] = 1;
+		lst_remove(&s->link);
+		lst_push(&cp->partial, s);
+	}
+
+	return 0;
+}
+
+/*
+ * Give every empty slab of a cache back to the page allocator. Returns the
+ * number of pages freed.
+ *
+ * The objects in the depot's magazines, and in the current CPU's magazines,
+ * are first returned to their slabs. Other CPUs' magazines are left alone:
+ * only their own CPU may touch them.
+ *
+ * Frees nothing if the cache's lock is busy, since this is called by
+ * shrinkers (see reclaim.h).
+ */
+int
+kmem_cache_shrink(struct kmem_cache *cp)
+{
+	struct kmem_magazine *mags, *m;
+	struct kmem_cpu_cache *cc;
+	struct list freed;
+	struct slab *s;
+	int n;
+
+	lst_init(&freed);
+	mags = 0;
+
+	push_off();
+	if (!tryacquire(&cp->lock)) {
+		pop_off();
+		return 0;
+	}
 
-		return &KMEM_CACHES[i];
+	if (!(cp->flags & KMEM_CACHE_NOMAG)) {
+		cc = &cp->cpu[cpuid()];
+		if (cc->loaded) {
+			cc->loaded->next = cp->depot_full;
+			cp->depot_full = cc->loaded;
+			cc->loaded = 0;
+		}
+		if (cc->prev) {
+			cc->prev->next = cp->depot_full;
+			cp->depot_full = cc->prev;
+			cc->prev = 0;
+		}
 	}
 
 	/*
-	 * No free cache was found, return NULL (0).
+	 * Empty every magazine in the depot into the slab layer, and collect
+	 * the magazines to be freed once the lock is dropped.
 	 */
-	return 0;
+	while ((m = cp->depot_full) != 0) {
+		cp->depot_full = m->next;
+		while (m->n > 0) {
+			s = kmem_slab_free(cp, m->obj[--m->n]);
+			if (s)
+				lst_push(&freed, s);
+		}
+		m->next = mags;
+		mags = m;
+	}
+	while ((m = cp->depot_empty) != 0) {
+		cp->depot_empty = m->next;
+		m->next = mags;
+		mags = m;
+	}
+
+	while (!lst_empty(&cp->empty)) {
+		s = lst_pop(&cp->empty);
+		lst_push(&freed, s);
+		cp->nslabs--;
+	}
+	cp->nempty = 0;
+	release(&cp->lock);
+	pop_off();
+
+	while ((m = mags) != 0) {
+		mags = m->next;
+		kmem_cache_free(kmem_magazine_cache, m);
+	}
+
+	n = 0;
+	while (!lst_empty(&freed)) {
+		kfree_pages(lst_pop(&freed), cp->order);
+		n += 1 << cp->order;
+	}
+
+	return n;
 }
 
 /*
- * Return a cache to KMEM_CACHES for future use/allocation for others (or the
- * system returning the cache).
+ * The slab allocator's shrinker: shrink caches until about npages pages are
+ * freed. The magazine cache goes last, since shrinking the others frees
+ * magazines. Caches are never destroyed, so KMEM_CACHES can be walked without
+ * KMEM_CACHES_LOCK.
  */
 static int
-KMEM_CACHES_FREE(struct kmem_cache *cp)
+kmem_cache_reap(int npages)
 {
-	struct kmem_cache *cache_ptr;
+	int i, n;
 
-	/*
-	 * Traverse KMEM_CACHES and find which cache in the array corresponds
-	 * to the one being returned.
-	 */
-	for (int i = 0; i < KMEM_CACHE_MAX; i++) {
-		cache_ptr = &KMEM_CACHES[i];
-		if (cp != cache_ptr)
+	n = 0;
+	for (i = 0; i < KMEM_CACHE_MAX && n < npages; i++) {
+		if (KMEM_CACHE_FLAGS[i] == 0 ||
+		    &KMEM_CACHES[i] == kmem_magazine_cache)
 			continue;
+		n += kmem_cache_shrink(&KMEM_CACHES[i]);
+	}
+	n += kmem_cache_shrink(kmem_magazine_cache);
 
-		/*
-		 * The cache has been found in the array, set its corresponding
-		 * bit flag to 0 (indicating the cache is now free) and return
-		 * a success code.
-		 */
-		KMEM_CACHE_FLAGS[i] = 0;
+	return n;
+}
 
-		return 1;
+/*
+ * Append a string, or an unsigned number padded to width columns, to the text
+ * in buf. Output that does not fit in size bytes is dropped. Also used for the
+ * other /dev reports.
+ */
+int
+kmem_put_str(char *buf, int off, int size, char *str, int width)
+{
+	int n;
+
+	for (n = 0; str[n]; n++)
+		if (off < size)
+			buf[off++] = str[n];
+	for (; n < width; n++)
+		if (off < size)
+			buf[off++] = ' ';
+
+	return off;
+}
+
+int
+kmem_put_num(char *buf, int off, int size, uint64 num, int width)
+{
+	char digits[21];
+	int i;
+
+	i = sizeof(digits) - 1;
+	digits[i] = 0;
+	do {
+		digits[--i] = '0' + num % 10;
+		num /= 10;
+	} while (num);
+
+	return kmem_put_str(buf, off, size, &digits[i], width);
+}
+
+/*
+ * Describe every cache in use, one line each, in buf (see /dev/slabinfo).
+ * Returns the length of the text, which is truncated to size bytes.
+ *
+ * The per-CPU hit and miss counters are read without any locking, so they may
+ * be slightly stale.
+ */
+int
+kmem_cache_report(char *buf, int size)
+{
+	struct kmem_cache *cp;
+	uint64 nhit, nmiss, nslabs, nalloc;
+	int i, c, off;
+
+	off = 0;
+	off = kmem_put_str(buf, off, size, "name", 16);
+	off = kmem_put_str(buf, off, size,
+	    "size  objs  slabs   alloc   hits       misses\n", 0);
+
+	acquire(&KMEM_CACHES_LOCK);
+	for (i = 0; i < KMEM_CACHE_MAX; i++) {
+		if (KMEM_CACHE_FLAGS[i] == 0)
+			continue;
+		cp = &KMEM_CACHES[i];
+
+		acquire(&cp->lock);
+		nslabs = cp->nslabs;
+		nalloc = cp->nalloc;
+		release(&cp->lock);
+
+		nhit = nmiss = 0;
+		for (c = 0; c < NCPU; c++) {
+			nhit += cp->cpu[c].nhit;
+			nmiss += cp->cpu[c].nmiss;
+		}
+
+		off = kmem_put_str(buf, off, size, cp->name, 16);
+		off = kmem_put_num(buf, off, size, cp->size, 6);
+		off = kmem_put_num(buf, off, size, cp->nobj, 6);
+		off = kmem_put_num(buf, off, size, nslabs, 8);
+		off = kmem_put_num(buf, off, size, nalloc, 8);
+		off = kmem_put_num(buf, off, size, nhit, 11);
+		off = kmem_put_num(buf, off, size, nmiss, 0);
+		off = kmem_put_str(buf, off, size, "\n", 0);
 	}
+	release(&KMEM_CACHES_LOCK);
 
-	/*
-	 * The cache was not found. This should never happen for a cache
-	 * allocated from KMEM_CACHES.
-	 */
-	return 0;
+	return off < size ? off : size;
 }
 
 /*
- * When a new slab is allocated, each space in the slab must indicate that the
- * space in that position is free (indicated by setting the (int *) of an
- * object's space in the cache to -1).
+ * Allocate a new slab for a cache, thread all of its objects onto its freelist
+ * and put it on the partial list. The cache's lock must be held; it is dropped
+ * while the page allocator is called, since that may take a while.
  */
-static void
-kmem_cache_slab_zero(struct kmem_cache *cp)
+static struct slab *
+kmem_cache_grow(struct kmem_cache *cp)
 {
-	int *p;
-	void *ptr;
+	struct slab *s;
+	char *obj;
+	int i;
 
 	/*
-	 * Go through each space for an object (aligned on a boundary specified
-	 * by cp->align) in the slab and set the (int *) of the space to -1.
+	 * Objects are zeroed when allocated, if asked to be, so the slab
+	 * needn't be.
 	 */
-	for (ptr = cp->slab; ptr < (cp->slab + SLAB_LIM); ptr += cp->align) {
-		p = (int *) ptr;
-		*p = -1;
+	release(&cp->lock);
+	s = kalloc_pages_flags(cp->order, 0);
+	acquire(&cp->lock);
+
+	if (!s)
+		return 0;
+
+	s->cache = cp;
+	s->inuse = 0;
+	s->free = 0;
+
+	/*
+	 * Chain the objects in address order, so that consecutive allocations
+	 * return neighbouring objects.
+	 */
+	obj = (char *) s + cp->offset + (cp->nobj - 1) * cp->size;
+	for (i = 0; i < cp->nobj; i++, obj -= cp->size) {
+		*(void **) obj = s->free;
+		s->free = obj;
 	}
+
+	lst_push(&cp->partial, s);
+	cp->nslabs++;
+
+	return s;
 }
 
 /*
- * Find a free space within a slab in which a kernel object can be allocated
- * from.
+ * Find the slab that holds an object: slabs are aligned to their size, so it
+ * starts at the object's address rounded down to the slab size.
  */
-static void *
-kmem_cache_slab_find(struct kmem_cache *cp)
+static struct slab *
+kmem_slab_of(struct kmem_cache *cp, void *obj)
 {
-	int *p;
-	void *ptr;
+	struct slab *s;
+
+	s = (struct slab *) ((uint64) obj & ~(SLAB_SIZE(cp) - 1));
+	if (s->cache != cp || (char *) obj < (char *) s + cp->offset)
+		panic("kmem_cache_free");
+
+	return s;
+}
+
+/*
+ * Reserve a cache from KMEM_CACHES.
+ */
+static struct kmem_cache *
+KMEM_CACHES_RESERVE(void)
+{
+	struct kmem_cache *cache;
+
+	cache = 0;
+	acquire(&KMEM_CACHES_LOCK);
 
 	/*
-	 * Go through each space for an object (aligned on a boundary specified
-	 * by cp->align) in the slab.
+	 * Traverse the KMEM_CACHES and KMEM_CACHE_FLAGS arrays, if a
+	 * corresponding cache's bit flag is 0 (indicating the cache that the
+	 * flag is representing is free), reserve the cache.
 	 */
-	for (ptr = cp->slab; ptr < (cp->slab + SLAB_LIM); ptr += cp->align) {
-		p = (int *) ptr;
+	for (int i = 0; i < KMEM_CACHE_MAX; i++) {
+		/*
+		 * If the cache is currently allocated, continue.
+		 */
+		if (KMEM_CACHE_FLAGS[i] == 1)
+			continue;
 
 		/*
-		 * If the (int *) of the space is -1, then the space is
-		 * currently free.
+		 * An unallocated cache has been reached. Set its corresponding
+		 * bit flag to 1 (indicating it's currently taken) and return
+		 * a pointer to the cache.
 		 */
-		if (*p == -1) {
-			/*
-			 * Set the (int *) of the space to 0 (indicating that
-			 * the space is currently in-use) and return the space's
-			 * location.
-			 */
-			*p = 0;
-			return ptr;
-		}
+		KMEM_CACHE_FLAGS[i] = 1;
+		cache = &KMEM_CACHES[i];
+		break;
 	}
 
+	release(&KMEM_CACHES_LOCK);
+
 	/*
-	 * No free space was found. Return NULL (0).
+	 * If no free cache was found, this is NULL (0).
 	 */
-	return 0;
+	return cache;
 }
@@ -10,10 +10,14 @@
 
 #define NLOCK 1000
 
+// Registry of locks, for the contention statistics in sys_ntas().
+// Locks embedded in dynamically allocated objects (procs, inodes,
+// buffers, pipes) come and go, so a lock that does not fit is simply
+// left out of the statistics, and freelock() takes a lock out again.
 static int nlock;
 static struct spinlock *locks[NLOCK];
+static struct spinlock lockslock;
 
-// assumes locks are not freed
 void
 initlock(struct spinlock *lk, char *name)
 {
@@ -22,10 +26,34 @@ initlock(struct spinlock *lk, char *name)
   lk->cpu = 0;
   lk->nts = 0;
   lk->n = 0;
-  if(nlock >= NLOCK)
-    panic("initlock");
-  locks[nlock] = lk;
-  nlock++;
+
+  acquire(&lockslock);
+  if(nlock < NLOCK){
+    locks[nlock] = lk;
+    nlock++;
+  }
+  release(&lockslock);
+}
+
+// Forget about a lock that is about to be freed.
+void
+freelock(struct spinlock *lk)
+{
+  int i;
+
+  if(lk->locked)
+    panic("freelock");
+
+  acquire(&lockslock);
+  for(i = 0; i < nlock; i++){
+    if(locks[i] == lk){
+      locks[i] = locks[nlock-1];
+      locks[nlock-1] = 0;
+      nlock--;
+      break;
+    }
+  }
+  release(&lockslock);
 }
 
 // Acquire the lock.
@@ -43,8 +71,12 @@ acquire(struct spinlock *lk)
   //   a5 = 1
   //   s1 = &lk->locked
   //   amoswap.w.aq a5, a5, (s1)
+  //
+  // While spinning, serve TLB shootdowns from other CPUs, one
+  // of which may be the holder, waiting for this CPU's flush.
   while(__sync_lock_test_and_set(&lk->locked, 1) != 0) {
      __sync_fetch_and_add(&lk->nts, 1);
+     tlb_ipi();
   }
   
   // Tell the C compiler and the processor to not move loads or stores
@@ -57,6 +89,24 @@ acquire(struct spinlock *lk)
   lk->cpu = mycpu();
 }
 
+// Acquire the lock if it is free, without spinning.
+// Returns 1 if it was acquired, 0 if another CPU or this
+// one holds it.
+int
+tryacquire(struct spinlock *lk)
+{
+  push_off();
+  if(holding(lk) || __sync_lock_test_and_set(&lk->locked, 1) != 0){
+    pop_off();
+    return 0;
+  }
+
+  __sync_fetch_and_add(&(lk->n), 1);
+  __sync_synchronize();
+  lk->cpu = mycpu();
+  return 1;
+}
+
 // Release the lock.
 void
 release(struct spinlock *lk)
@@ -141,14 +191,18 @@ sys_ntas(void)
     return -1;
   }
   if(zero == 0) {
+    acquire(&lockslock);
     for(int i = 0; i < NLOCK; i++) {
       if(locks[i] == 0)
         break;
       locks[i]->nts = 0;
     }
+    release(&lockslock);
+    kmem_stats_reset();
     return 0;
   }
 
+  acquire(&lockslock);
   printf("=== lock kmem stats\n");
   for(int i = 0; i < NLOCK; i++) {
     if(locks[i] == 0)
@@ -158,6 +212,7 @@ sys_ntas(void)
       print_lock(locks[i]);
     }
   }
+  kmem_stats_print();
 
   printf("=== top 5 contended locks:\n");
   int last = 100000000;
@@ -174,5 +229,6 @@ sys_ntas(void)
     print_lock(locks[top]);
     last = locks[top]->nts;
   }
+  release(&lockslock);
   return tot;
 }
@@ -11,7 +11,7 @@ void timerinit();
 __attribute__ ((aligned (16))) char stack0[4096 * NCPU];
 
 // A scratch area per CPU for machine-mode timer interrupts.
-uint64 timer_scratch[NCPU][5];
+uint64 timer_scratch[NCPU][7];
 
 // Assembly code in kernelvec.S for machine-mode timer interrupt.
 extern void timervec();
@@ -107,6 +107,14 @@ start()
   w_pmpaddr0(0x3fffffffffffffull);
   w_pmpcfg0(0xf);
 
+  /*
+   * Let supervisor mode read the cycle, time and instret counters, which the
+   * kernel uses to time its own code paths (see struct vmstat), and pass them
+   * on to user mode for benchmarks.
+   */
+  w_mcounteren(r_mcounteren() | MCOUNTEREN_CY | MCOUNTEREN_TM | MCOUNTEREN_IR);
+  w_scounteren(MCOUNTEREN_CY | MCOUNTEREN_TM | MCOUNTEREN_IR);
+
   /*
    * Ask for clock interrupts.
    */
@@ -154,18 +162,36 @@ timerinit()
    * scratch[0..2]: Space for timervec to save registers.
    * scratch[3]: Address of CLINT MTIMECMP register.
    * scratch[4]: Desired interval (in cycles) between timer interrupts.
+   * scratch[5]: Set by timervec on a timer interrupt (see timertick()).
+   * scratch[6]: Address of CLINT MSIP register, for software interrupts
+   *             (IPIs) sent by other CPUs.
    */
   uint64 *scratch = &timer_scratch[id][0];
   scratch[3] = CLINT_MTIMECMP(id);
   scratch[4] = interval;
+  scratch[5] = 0;
+  scratch[6] = CLINT_MSIP(id);
   w_mscratch((uint64) scratch);
 
-  // Set the machine-mode trap handler.
+  // Set the machine-mode trap handler, which also takes
+  // software interrupts.
   w_mtvec((uint64) timervec);
 
   // Enable machine-mode interrupts.
   w_mstatus(r_mstatus() | MSTATUS_MIE);
 
-  // Enable machine-mode timer interrupts.
-  w_mie(r_mie() | MIE_MTIE);
+  // Enable machine-mode timer and software interrupts.
+  w_mie(r_mie() | MIE_MTIE | MIE_MSIE);
+}
+
+/*
+ * Called by devintr() in supervisor mode on a software interrupt, which
+ * timervec raises both for timer interrupts and for IPIs. Returns 1 if a timer
+ * interrupt has arrived on this CPU since the last call.
+ */
+int
+timertick(void)
+{
+  return __atomic_exchange_n(&timer_scratch[cpuid()][5], 0,
+                             __ATOMIC_ACQUIRE) != 0;
 }
@@ -0,0 +1,144 @@
+/*
+ * swap.c: Swap space
+ *
+ * mkfs reserves SWAPSIZE blocks after the file system as swap space (see
+ * fs.h), which is divided into page-sized slots. When memory runs short, page
+ * faults write some of the faulting process's pages out to slots (see
+ * uvm_swap_out() in vm.c, which picks them), and replace their PTEs with ones
+ * that name the slot (PTE_SWAP). A later fault on such a page reads it back in.
+ *
+ * Each slot has a reference count: the number of leaf page-table pages whose
+ * PTEs name it. That can be more than one once fork() has shared a page-table
+ * page and one of the processes has then made its own copy (see uvm_unshare()).
+ *
+ * Slots are read and written one page per disk request, bypassing the buffer
+ * cache and the log. That sleeps, so it can't be done with a spinlock held:
+ * swap_write() and swap_read() fail instead, and callers that copy to or from
+ * user memory under a spinlock fault the pages in first (see uvm_fault_in()).
+ */
+
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fs.h"
+#include "defs.h"
+
+#define SLOTBLOCKS	(PGSIZE / BSIZE)	// Blocks per slot.
+#define NSLOT		(SWAPSIZE / SLOTBLOCKS)
+
+static struct {
+	struct spinlock lock;
+	uint start;		// First block of swap space.
+	uint nslot;		// Slots on the disk; 0 if it has no swap space.
+	uint next;		// Where the search for a free slot starts.
+	uint nfree;		// Free slots.
+	ushort ref[NSLOT];	// References to each slot.
+} swap;
+
+/*
+ * Find the swap space on the disk the file system sb was read from. Called by
+ * fsinit().
+ */
+void
+swapinit(int dev, struct superblock *sb)
+{
+	initlock(&swap.lock, "swap");
+	swap.start = sb->swapstart;
+	swap.nslot = min(sb->nswap / SLOTBLOCKS, NSLOT);
+	swap.nfree = swap.nslot;
+	swap.next = 0;
+}
+
+/*
+ * Return 1 if the caller may sleep for disk I/O: it is a process holding no
+ * spinlock.
+ */
+static int
+swap_can_sleep(void)
+{
+	int noff;
+
+	push_off();
+	noff = mycpu()->noff;
+	pop_off();
+
+	return noff == 1 && myproc() != 0;
+}
+
+/*
+ * Write the page at pa out to a free slot. Returns the slot, with one
+ * reference, or -1 if swap space is full or the caller can't sleep.
+ */
+int
+swap_write(void *pa)
+{
+	uint slot, i;
+
+	if (!swap_can_sleep())
+		return -1;
+
+	acquire(&swap.lock);
+	if (swap.nfree == 0) {
+		release(&swap.lock);
+		return -1;
+	}
+	slot = swap.next;
+	for (i = 0; i < swap.nslot; i++) {
+		if (swap.ref[slot] == 0)
+			break;
+		if (++slot == swap.nslot)
+			slot = 0;
+	}
+	swap.ref[slot] = 1;
+	swap.nfree--;
+	swap.next = slot + 1 < swap.nslot ? slot + 1 : 0;
+	release(&swap.lock);
+
+	virtio_disk_rw_page(swap.start + slot * SLOTBLOCKS, pa, 1);
+
+	return slot;
+}
+
+/*
+ * Read slot back into the page at pa. The slot keeps its reference. Returns 0,
+ * or -1 if the caller can't sleep.
+ */
+int
+swap_read(uint slot, void *pa)
+{
+	if (!swap_can_sleep())
+		return -1;
+
+	virtio_disk_rw_page(swap.start + slot * SLOTBLOCKS, pa, 0);
+
+	return 0;
+}
+
+/*
+ * Take another reference to a slot.
+ */
+void
+swap_dup(uint slot)
+{
+	acquire(&swap.lock);
+	if (slot >= swap.nslot || swap.ref[slot] == 0)
+		panic("swap_dup");
+	swap.ref[slot]++;
+	release(&swap.lock);
+}
+
+/*
+ * Drop a reference to a slot, freeing it when the last one is dropped.
+ */
+void
+swap_free(uint slot)
+{
+	acquire(&swap.lock);
+	if (slot >= swap.nslot || swap.ref[slot] == 0)
+		panic("swap_free");
+	if (--swap.ref[slot] == 0)
+		swap.nfree++;
+	release(&swap.lock);
+}
@@ -111,6 +111,14 @@ extern uint64 sys_sigreturn(void);
 extern uint64 sys_symlink(void);
 extern uint64 sys_mmap(void);
 extern uint64 sys_munmap(void);
+extern uint64 sys_vmstat(void);
+extern uint64 sys_kallocbench(void);
+extern uint64 sys_sbrkflags(void);
+extern uint64 sys_vmpolicy(void);
+extern uint64 sys_wss(void);
+extern uint64 sys_ksm(void);
+extern uint64 sys_mprotect(void);
+extern uint64 sys_msync(void);
 
 static uint64 (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -141,6 +149,14 @@ static uint64 (*syscalls[])(void) = {
 [SYS_symlink]	sys_symlink,
 [SYS_mmap]	sys_mmap,
 [SYS_munmap]	sys_munmap,
+[SYS_vmstat]	sys_vmstat,
+[SYS_kallocbench]	sys_kallocbench,
+[SYS_sbrkflags]	sys_sbrkflags,
+[SYS_vmpolicy]	sys_vmpolicy,
+[SYS_wss]	sys_wss,
+[SYS_ksm]	sys_ksm,
+[SYS_mprotect]	sys_mprotect,
+[SYS_msync]	sys_msync,
 };
 
 void
@@ -29,3 +29,11 @@
 #define SYS_symlink  26
 #define SYS_mmap  27
 #define SYS_munmap  28
+#define SYS_vmstat  29
+#define SYS_kallocbench  30
+#define SYS_sbrkflags  31
+#define SYS_vmpolicy  32
+#define SYS_wss  33
+#define SYS_ksm  34
+#define SYS_mprotect  35
+#define SYS_msync  36
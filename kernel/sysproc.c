@@ -6,6 +6,7 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "mman.h"
 
 uint64
 sys_exit(void)
@@ -42,29 +43,36 @@ uint64
 sys_sbrk(void)
 {
   int n;
-  struct proc *p;
-  uint64 old;
 
   if(argint(0, &n) < 0)
     return -1;
+  return growproc(n, 0);
+}
 
-  /*
-   * For lazy page allocation, we won't allocate any memory now, but instead
-   * increase the process's memory size ("tricking" the process into being
-   * convinced that the memory was allocated) and return the "old" memory size.
-   */
-  p = myproc();
-  old = p->sz;
+uint64
+sys_sbrkflags(void)
+{
+  int n, flags;
 
-  p->sz += n;
+  if(argint(0, &n) < 0 || argint(1, &flags) < 0)
+    return -1;
+  return growproc(n, flags);
+}
 
-  /*
-   * Decrease the size of the process if a negative argument is given
-   * (indicating that the process would like to shrink it's size).
-   */
-  if (n < 0)
-	uvmdealloc(p->pagetable, old, p->sz);
+// Set the calling process's allocation policy, and return
+// the old one, or -1 if policy isn't one of those in mman.h.
+uint64
+sys_vmpolicy(void)
+{
+  struct proc *p = myproc();
+  int policy, old;
 
+  if(argint(0, &policy) < 0)
+    return -1;
+  if(policy != VM_LAZY && policy != VM_FAULTAROUND && policy != VM_EAGER)
+    return -1;
+  old = p->vm_policy;
+  p->vm_policy = policy;
   return old;
 }
 
@@ -78,13 +86,16 @@ sys_sleep(void)
     return -1;
   acquire(&tickslock);
   ticks0 = ticks;
+  myproc()->vm_quiet = 1;  // see ksm.c
   while(ticks - ticks0 < n){
     if(myproc()->killed){
+      myproc()->vm_quiet = 0;
       release(&tickslock);
       return -1;
     }
     sleep(&ticks, &tickslock);
   }
+  myproc()->vm_quiet = 0;
   release(&tickslock);
   return 0;
 }
@@ -0,0 +1,365 @@
+/*
+ * tlb.c: Address space identifiers and TLB shootdown
+ *
+ * Each process's page table is tagged with an address space identifier (ASID)
+ * in satp, so that switching between page tables doesn't flush the TLB. The
+ * kernel runs with ASID 0 and every process with one of its own. ASIDs are
+ * handed out in order and carry a generation number. When they run out, the
+ * generation is bumped: each process's ASID goes stale and is replaced the next
+ * time the process returns to user space, and each CPU flushes its whole TLB
+ * before it first uses an ASID of the new generation. Hardware without ASIDs
+ * (see tlbinit()) falls back to trampoline.S flushing the TLB on every satp
+ * switch.
+ *
+ * Kernels built with UACCESS=1 run each process in the kernel on a kernel page
+ * table of its own (see uvm_kview_create()), which maps its user memory too.
+ * Each process then gets a pair of ASIDs: an even one for its page table and
+ * the odd one above it for its kernel page table, and TLB entries are flushed
+ * for both together.
+ *
+ * A process runs on one CPU at a time, and whenever it moves to another CPU
+ * that CPU flushes the process's ASID before entering user space. So only the
+ * CPU a process last returned to user space on can hold live TLB entries for
+ * it, and only that CPU needs to flush them when its PTEs change. If that is
+ * another CPU, the addresses are sent there in a batch, and the CPU is
+ * interrupted with a software interrupt through the CLINT.
+ */
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "tlb.h"
+
+#define ASID_MASK	0xFFFFL
+#define ASID_GEN_ONE	(ASID_MASK + 1)	// One generation, above the ASID bits.
+#ifdef UACCESS
+#define ASID_STEP	2		// ASIDs per process.
+#else
+#define ASID_STEP	1
+#endif
+
+extern pagetable_t kernel_pagetable;
+
+static struct {
+	struct spinlock lock;
+	uint64 gen;	// The current generation.
+	uint64 next;	// Next ASID of this generation to hand out.
+	uint64 max;	// Highest ASID the hardware has, or 0 for no ASIDs.
+} asid;
+
+/*
+ * A CPU's request to flush TLB entries on another CPU. Each CPU has a mailbox
+ * that other CPUs take turns to post to.
+ */
+static struct tlb_mailbox {
+	int busy;		// A request is being posted or served.
+	int pending;		// Posted, not yet served.
+	uint64 asid;
+	int n;
+	uint64 va[TLB_BATCH];
+} mailbox[NCPU];
+
+static void tlb_flush_local(uint64, uint64 *, int);
+
+/*
+ * Find out how many ASIDs the hardware supports by writing all ones to the
+ * ASID field of satp and seeing which bits stick. Called once, by CPU 0, with
+ * paging on.
+ */
+void
+tlbinit(void)
+{
+	uint64 satp;
+	int i;
+
+	initlock(&asid.lock, "asid");
+
+	satp = r_satp();
+	w_satp(satp | SATP_ASID_MASK);
+	asid.max = (r_satp() & SATP_ASID_MASK) >> SATP_ASID_SHIFT;
+	w_satp(satp);
+	sfence_vma();
+
+	/*
+	 * Too few for even one pair beside the kernel's.
+	 */
+	if (asid.max < 2 * ASID_STEP - 1)
+		asid.max = 0;
+
+	asid.gen = ASID_GEN_ONE;
+	asid.next = ASID_STEP;
+
+	/*
+	 * Every CPU flushes its whole TLB when it turns on paging, so they all
+	 * start out clean for the first generation.
+	 */
+	for (i = 0; i < NCPU; i++)
+		cpus[i].asid_gen = asid.gen;
+}
+
+/*
+ * Give p an ASID of the current generation.
+ */
+static void
+asid_alloc(struct proc *p)
+{
+	acquire(&asid.lock);
+	if ((p->asid & ~ASID_MASK) != asid.gen) {
+		if (asid.next + ASID_STEP - 1 > asid.max) {
+			/*
+			 * Out of ASIDs. Start a new generation.
+			 */
+			__atomic_store_n(&asid.gen, asid.gen + ASID_GEN_ONE,
+				__ATOMIC_RELEASE);
+			asid.next = ASID_STEP;
+		}
+		p->asid = asid.gen | asid.next;
+		asid.next += ASID_STEP;
+	}
+	release(&asid.lock);
+}
+
+/*
+ * Get ready to run p in user space on this CPU, and return the satp value for
+ * its page table. Called by usertrapret() with interrupts off.
+ */
+uint64
+tlb_activate(struct proc *p)
+{
+	struct cpu *c;
+	uint64 gen;
+	int id;
+
+	c = mycpu();
+	id = cpuid();
+
+	if (asid.max == 0) {
+		p->asid_cpu = id;
+		return MAKE_SATP(p->pagetable);
+	}
+
+	gen = __atomic_load_n(&asid.gen, __ATOMIC_ACQUIRE);
+	if ((p->asid & ~ASID_MASK) != gen) {
+		asid_alloc(p);
+		gen = p->asid & ~ASID_MASK;
+	}
+
+	if (c->asid_gen != gen) {
+		/*
+		 * The first ASID of a new generation on this CPU. Forget the
+		 * entries of the old one, whose ASIDs are being handed out
+		 * again.
+		 */
+		c->asid_gen = gen;
+		sfence_vma();
+	} else if (p->asid_cpu != id) {
+		/*
+		 * Entries left over from the last time p ran here may have gone
+		 * stale since.
+		 */
+		tlb_flush_local(p->asid & ASID_MASK, 0, TLB_ALL);
+	}
+
+	/*
+	 * Pairs with tlb_batch_flush(): a CPU that changes p's PTEs after this
+	 * either sees p->asid_cpu == id or had made its changes visible first.
+	 */
+	p->asid_cpu = id;
+	__sync_synchronize();
+
+	return MAKE_SATP_ASID(p->pagetable, p->asid & ASID_MASK);
+}
+
+/*
+ * Flush n pages (or TLB_ALL) of an address space from this CPU's TLB.
+ */
+static void
+tlb_flush_asid(uint64 asid, uint64 *va, int n)
+{
+	int i;
+
+	if (n > TLB_BATCH) {
+		sfence_vma_asid(asid);
+		return;
+	}
+	for (i = 0; i < n; i++)
+		sfence_vma_page(va[i], asid);
+}
+
+static void
+tlb_flush_local(uint64 asid, uint64 *va, int n)
+{
+	tlb_flush_asid(asid, va, n);
+#ifdef UACCESS
+	if (asid != 0)
+		tlb_flush_asid(asid | 1, va, n);
+#endif
+}
+
+#ifdef UACCESS
+/*
+ * Switch this CPU to p's own kernel page table, tagged with the odd ASID of
+ * its pair, or back to the kernel's if p is 0 or has none. Called by
+ * scheduler() and usertrapret() with interrupts off.
+ */
+void
+tlb_switch_kernel(struct proc *p)
+{
+	uint64 satp;
+
+	if (p == 0 || p->kpagetable == 0) {
+		satp = MAKE_SATP(kernel_pagetable);
+	} else {
+		tlb_activate(p);
+		if (asid.max == 0)
+			satp = MAKE_SATP(p->kpagetable);
+		else
+			satp = MAKE_SATP_ASID(p->kpagetable,
+				(p->asid & ASID_MASK) | 1);
+	}
+
+	if (r_satp() == satp)
+		return;
+
+	w_satp(satp);
+	if (asid.max == 0)
+		sfence_vma();
+}
+#endif
+
+/*
+ * Serve this CPU's mailbox. Called by devintr() on a software interrupt, and by
+ * CPUs that spin with interrupts off (in acquire() and tlb_shootdown()), so that
+ * two CPUs can't wait on each other forever. Interrupts must be off.
+ */
+void
+tlb_ipi(void)
+{
+	struct tlb_mailbox *m;
+
+	m = &mailbox[cpuid()];
+	if (__atomic_load_n(&m->pending, __ATOMIC_ACQUIRE) == 0)
+		return;
+
+	tlb_flush_local(m->asid, m->va, m->n);
+	__atomic_store_n(&m->pending, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Have CPU id flush a batch of pages, and wait until it has.
+ */
+static void
+tlb_shootdown(int id, uint64 asid, struct tlb_batch *b)
+{
+	struct tlb_mailbox *m;
+	int i;
+
+	m = &mailbox[id];
+	while (__sync_lock_test_and_set(&m->busy, 1) != 0)
+		tlb_ipi();
+
+	m->asid = asid;
+	m->n = b->n;
+	for (i = 0; i < b->n && i < TLB_BATCH; i++)
+		m->va[i] = b->va[i];
+	__atomic_store_n(&m->pending, 1, __ATOMIC_RELEASE);
+
+	*(volatile uint32 *) KCLINT_MSIP(id) = 1;
+
+	while (__atomic_load_n(&m->pending, __ATOMIC_ACQUIRE) != 0)
+		tlb_ipi();
+
+	__sync_lock_release(&m->busy);
+}
+
+void
+tlb_batch_init(struct tlb_batch *b, struct proc *p)
+{
+	b->p = p;
+	b->n = 0;
+}
+
+/*
+ * Add the pages in [va, va+len) to a batch. A batch that overflows flushes the
+ * whole address space, as does a len of 0.
+ */
+void
+tlb_batch_add(struct tlb_batch *b, uint64 va, uint64 len)
+{
+	uint64 a;
+
+	if (b->p == 0 || b->n == TLB_ALL)
+		return;
+
+	if (len == 0 || len > TLB_BATCH * PGSIZE) {
+		b->n = TLB_ALL;
+		return;
+	}
+
+	for (a = PGROUNDDOWN(va); a < va + len; a += PGSIZE) {
+		if (b->n == TLB_BATCH) {
+			b->n = TLB_ALL;
+			return;
+		}
+		b->va[b->n++] = a;
+	}
+}
+
+/*
+ * Flush the pages in a batch from the TLB of the CPU that last ran the process
+ * in user space, and empty the batch. If that is another CPU and the process is
+ * the current one, the CPU it next runs on flushes them anyway (see
+ * tlb_activate()).
+ */
+void
+tlb_batch_flush(struct tlb_batch *b)
+{
+	struct proc *p;
+	int id, target;
+
+	p = b->p;
+	if (p == 0 || b->n == 0)
+		return;
+
+	push_off();
+	id = cpuid();
+	__sync_synchronize();
+	target = p->asid_cpu;
+	if (target == id)
+		tlb_flush_local(p->asid & ASID_MASK, b->va, b->n);
+	else if (target >= 0 && p != mycpu()->proc)
+		tlb_shootdown(target, p->asid & ASID_MASK, b);
+	pop_off();
+
+	b->n = 0;
+}
+
+/*
+ * Flush one page of p's address space.
+ */
+void
+tlb_flush_page(struct proc *p, uint64 va)
+{
+	struct tlb_batch b;
+
+	tlb_batch_init(&b, p);
+	tlb_batch_add(&b, va, PGSIZE);
+	tlb_batch_flush(&b);
+}
+
+/*
+ * Flush all of p's address space.
+ */
+void
+tlb_flush_all(struct proc *p)
+{
+	struct tlb_batch b;
+
+	tlb_batch_init(&b, p);
+	tlb_batch_add(&b, 0, 0);
+	tlb_batch_flush(&b);
+}
@@ -0,0 +1,13 @@
+/*
+ * TLB invalidations for one process's address space, gathered while its PTEs
+ * are changed and carried out together by tlb_batch_flush() (see tlb.c).
+ */
+
+#define TLB_BATCH	16		// Pages flushed one at a time, at most.
+#define TLB_ALL		(TLB_BATCH + 1)	// n for "flush the whole space".
+
+struct tlb_batch {
+	struct proc *p;		// Whose address space, or 0 for nobody's.
+	int n;			// Pages in va[], or TLB_ALL.
+	uint64 va[TLB_BATCH];
+};
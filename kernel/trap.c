@@ -81,7 +81,7 @@ usertrap(void)
 	 * address.
 	 */
 	fault_va = r_stval();
-	if (uvm_handle_page_fault(p, fault_va) < 0)
+	if (uvm_handle_page_fault(p, fault_va, cause == 15) < 0)
 		p->killed = 1;
   } else {
     printf("usertrap(): unexpected scause %p (%s) pid=%d\n", cause, scause_desc(cause), p->pid);
@@ -94,6 +94,8 @@ usertrap(void)
 
   // give up the CPU if this is a timer interrupt.
   if(which_dev == 2) {
+    wss_tick(p);
+
     /*
      * If a valid sigalarm has been set and we're not already running in the
      * sigalarm handler, update the number of sigalarm ticks and execute the
@@ -128,7 +130,11 @@ usertrap(void)
 			goto yield;
     }
 yield:
+    // p holds on to none of its pages while it waits to run
+    // again, so ksmd may merge them (see ksm.c).
+    p->vm_quiet = 1;
     yield();
+    p->vm_quiet = 0;
   }
 
   usertrapret();
@@ -149,6 +155,12 @@ usertrapret(void)
   // send syscalls, interrupts, and exceptions to trampoline.S
   w_stvec(TRAMPOLINE + (uservec - trampoline));
 
+#ifdef UACCESS
+  // p's ASIDs may have changed since scheduler() switched to
+  // its kernel page table.
+  tlb_switch_kernel(p);
+#endif
+
   // set up trapframe values that uservec will need when
   // the process next re-enters the kernel.
   p->trapframe->kernel_satp = r_satp();         // kernel page table
@@ -168,8 +180,9 @@ usertrapret(void)
   // set S Exception Program Counter to the saved user pc.
   w_sepc(p->trapframe->epc);
 
-  // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  // tell trampoline.S the user page table to switch to,
+  // tagged with the process's ASID.
+  uint64 satp = tlb_activate(p);
 
   // jump to trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
@@ -193,6 +206,19 @@ kerneltrap()
   if(intr_get() != 0)
     panic("kerneltrap: interrupts enabled");
 
+#ifdef UACCESS
+  // a page fault on user memory in uaccess.S resumes either
+  // where it was or at the access's fixup code. handling the
+  // fault may sleep, and other traps meanwhile clobber sstatus.
+  uint64 resume;
+  if((scause == 13 || scause == 15) &&
+     (resume = uaccess_fault(sepc, r_stval())) != 0){
+    w_sepc(resume);
+    w_sstatus(sstatus);
+    return;
+  }
+#endif
+
   if((which_dev = devintr()) == 0){
     printf("scause %p (%s)\n", scause, scause_desc(scause));
     printf("sepc=%p stval=%p\n", r_sepc(), r_stval());
@@ -249,16 +275,22 @@ devintr()
 
     return 1;
   } else if(scause == 0x8000000000000001L){
-    // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
+    // software interrupt from a machine-mode timer interrupt
+    // or another CPU's IPI, forwarded by timervec in kernelvec.S.
+
+    // acknowledge the software interrupt by clearing
+    // the SSIP bit in sip, before looking at why it came,
+    // so that a new one isn't lost.
+    w_sip(r_sip() & ~2);
+
+    tlb_ipi();
+
+    if(!timertick())
+      return 1;
 
     if(cpuid() == 0){
       clockintr();
     }
-    
-    // acknowledge the software interrupt by clearing
-    // the SSIP bit in sip.
-    w_sip(r_sip() & ~2);
 
     return 2;
   } else {
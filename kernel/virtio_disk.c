@@ -20,8 +20,9 @@
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
 // this many virtio descriptors.
-// must be a power of two.
-#define NUM 8
+// must be a power of two. a request takes two, plus one
+// per buffer it reads or writes.
+#define NUM 32
 
 struct disk {
   // The descriptor table tells the device where to read and write
@@ -44,7 +45,7 @@ struct disk {
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    int *busy;    // cleared when the request is done
     char status;
   } info[NUM];
 
@@ -68,9 +69,6 @@ virtio_disk_init(void)
   disk.used = kalloc();
   if(!disk.desc || !disk.avail || !disk.used)
     panic("virtio disk kalloc");
-  memset(disk.desc, 0, PGSIZE);
-  memset(disk.avail, 0, PGSIZE);
-  memset(disk.used, 0, PGSIZE);
 
   if(*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
      *R(VIRTIO_MMIO_VERSION) != 2 ||
@@ -182,9 +180,9 @@ free_chain(int i)
 }
 
 static int
-alloc3_desc(int *idx)
+allocn_desc(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -195,27 +193,38 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// Read or write n buffers, data[i] of len[i] bytes, from or to
+// the disk, one after the other starting at block blockno, in
+// one request, and wait for the disk to finish. *busy is set
+// while the request is outstanding, and is the channel to sleep
+// on.
+static void
+virtio_disk_xfer(uint blockno, void **data, uint *len, int n, int write,
+                 int *busy)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  uint64 sector = blockno * (BSIZE / 512);
+  int idx[NUM];
+
+  if(n < 1 || n + 2 > NUM)
+    panic("virtio_disk_xfer");
 
   acquire(&disk.vdisk_lock);
 
   // the spec says that legacy block operations use three
   // descriptors: one for type/reserved/sector, one for
-  // the data, one for a 1-byte status result.
+  // the data, one for a 1-byte status result. the data
+  // may be split across a chain of descriptors, one per
+  // buffer.
 
-  // allocate the three descriptors.
-  int idx[3];
+  // allocate the descriptors.
   while(1){
-    if(alloc3_desc(idx) == 0) {
+    if(allocn_desc(idx, n + 2) == 0) {
       break;
     }
     sleep(&disk.free[0], &disk.vdisk_lock);
   }
   
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
   struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
@@ -232,24 +241,26 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[0]].flags = VIRTQ_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VIRTQ_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VIRTQ_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(int i = 1; i <= n; i++){
+    disk.desc[idx[i]].addr = (uint64) data[i-1];
+    disk.desc[idx[i]].len = len[i-1];
+    if(write)
+      disk.desc[idx[i]].flags = 0; // device reads the data
+    else
+      disk.desc[idx[i]].flags = VIRTQ_DESC_F_WRITE; // device writes the data
+    disk.desc[idx[i]].flags |= VIRTQ_DESC_F_NEXT;
+    disk.desc[idx[i]].next = idx[i+1];
+  }
 
   disk.info[idx[0]].status = 0;
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VIRTQ_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  disk.desc[idx[n+1]].addr = (uint64) &disk.info[idx[0]].status;
+  disk.desc[idx[n+1]].len = 1;
+  disk.desc[idx[n+1]].flags = VIRTQ_DESC_F_WRITE; // device writes the status
+  disk.desc[idx[n+1]].next = 0;
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  // record the request for virtio_disk_intr().
+  *busy = 1;
+  disk.info[idx[0]].busy = busy;
 
   // avail->idx tells the device how far to look in avail->ring.
   // avail->ring[...] are desc[] indices the device should process.
@@ -261,16 +272,56 @@ virtio_disk_rw(struct buf *b, int write)
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
 
   // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+  while(*busy == 1) {
+    sleep(busy, &disk.vdisk_lock);
   }
 
-  disk.info[idx[0]].b = 0;
+  disk.info[idx[0]].busy = 0;
   free_chain(idx[0]);
 
   release(&disk.vdisk_lock);
 }
 
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  void *data = b->data;
+  uint len = BSIZE;
+
+  virtio_disk_xfer(b->blockno, &data, &len, 1, write, &b->disk);
+}
+
+// Read or write the n buffers b[0..n-1], which must be of
+// consecutive blocks, in as few requests as there are
+// descriptors for (for bread_batch()).
+void
+virtio_disk_rw_batch(struct buf **b, int n, int write)
+{
+  void *data[NUM];
+  uint len[NUM];
+  int i, m;
+
+  for(; n > 0; n -= m, b += m){
+    m = n < NUM - 2 ? n : NUM - 2;
+    for(i = 0; i < m; i++){
+      data[i] = b[i]->data;
+      len[i] = BSIZE;
+    }
+    virtio_disk_xfer(b[0]->blockno, data, len, m, write, &b[0]->disk);
+  }
+}
+
+// Read or write the page at physical address pa from or to the
+// PGSIZE/BSIZE blocks starting at blockno, in one request (for swap.c).
+void
+virtio_disk_rw_page(uint blockno, void *pa, int write)
+{
+  uint len = PGSIZE;
+  int busy;
+
+  virtio_disk_xfer(blockno, &pa, &len, 1, write, &busy);
+}
+
 void
 virtio_disk_intr(void)
 {
@@ -282,8 +333,8 @@ virtio_disk_intr(void)
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
     
-    disk.info[id].b->disk = 0;   // disk is done with buf
-    wakeup(disk.info[id].b);
+    *disk.info[id].busy = 0;   // disk is done with the request
+    wakeup(disk.info[id].busy);
 
     disk.used_idx = (disk.used_idx + 1) % NUM;
   }
@@ -7,12 +7,44 @@
 #include "fs.h"
 #include "spinlock.h"
 #include "proc.h"
-#include "mmap.h"
+#include "mman.h"
+#include "vmstat.h"
+#include "tlb.h"
 
 #define NUM_PTE 512
 
+/*
+ * Bytes of address space mapped by one leaf page-table page.
+ */
+#define PTSPAN		((uint64) NUM_PTE * PGSIZE)
+#define PTROUNDUP(a)	(((a) + PTSPAN - 1) & ~(PTSPAN - 1))
+#define PTROUNDDOWN(a)	((a) & ~(PTSPAN - 1))
+
+/*
+ * A valid PTE with any of R, W or X set is a leaf. At level 1, it maps a 2MB
+ * megapage: the PTSPAN bytes a leaf page-table page would otherwise map.
+ */
+#define PTE_LEAF(pte)	((pte) & (PTE_R | PTE_W | PTE_X))
+#define MEGA_ORDER	9	/* kalloc_pages() order of a megapage. */
+
+/*
+ * walk() flags.
+ */
+#define WALK_ALLOC	0x1	/* Create missing page-table pages. */
+#define WALK_PRIVATE	0x2	/* Copy a shared leaf page-table page first. */
+
 static void vmprint_helper(pagetable_t, int);
 static void vmprint_pte(pte_t, int, int);
+static int uvm_unshare(pagetable_t, pte_t *);
+static int uvm_demote(pagetable_t, pte_t *);
+static int uvm_cow_fault(pagetable_t, uint64, pte_t *);
+static void uvm_promote(struct proc *, uint64);
+static int uvm_fault_window(struct proc *, uint64, struct vma *);
+static int uvm_fault_page(struct proc *, uint64, struct vma *);
+static int uvm_fault(struct proc *, uint64, struct vma *, int);
+static int uvm_mapped_file(struct proc *, uint64);
+static int uvm_swap_in(pte_t *);
+static int uvm_swap_out(struct proc *, int);
 
 /*
  * the kernel's page table.
@@ -25,6 +57,12 @@ extern char trampoline[]; // trampoline.S
 
 void print(pagetable_t);
 
+/*
+ * Fork and copy-on-write statistics. Updated with atomic adds from any hart;
+ * see sys_vmstat().
+ */
+static struct vmstat vmstat;
+
 /*
  * create a direct-map page table for the kernel and
  * turn on paging. called early, in supervisor mode.
@@ -35,11 +73,13 @@ kvminit()
 {
   // Allocate a page of physical memory to hold the root page-table page.
   kernel_pagetable = (pagetable_t) kalloc();
-  memset(kernel_pagetable, 0, PGSIZE);
 
   // map uart registers
   kvmmap(UART0, UART0, PGSIZE, PTE_R | PTE_W);
 
+  // map CLINT, for other CPUs' software interrupts (see tlb.c)
+  kvmmap(KCLINT, CLINT, 0x10000, PTE_R | PTE_W);
+
   // map virtio mmio disk interface
   kvmmap(VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
 
@@ -49,7 +89,8 @@ kvminit()
   // map kernel text executable and read-only.
   kvmmap(KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
-  // map kernel data and the physical RAM we'll make use of.
+  // map kernel data and the physical RAM we'll make use of,
+  // mostly with 2MB megapages (see mappages()).
   kvmmap((uint64)etext, (uint64)etext, PHYSTOP-(uint64)etext, PTE_R | PTE_W);
 
   // map the trampoline for trap entry/exit to
@@ -67,8 +108,16 @@ kvminithart()
 }
 
 // Return the address of the PTE in page table pagetable
-// that corresponds to virtual address va.  If alloc!=0,
-// create any required page-table pages.
+// that corresponds to virtual address va.  If flags has
+// WALK_ALLOC, create any required page-table pages. If it
+// has WALK_PRIVATE, first give pagetable its own copy of a
+// leaf page-table page it shares with other page tables
+// (see uvmcopy()), so that the caller can change the PTE.
+// Returns 0 if there is no such PTE or if out of memory.
+//
+// If va lies in a megapage, the level-1 PTE that maps it
+// is returned, unless flags ask for either of the above:
+// then the megapage is first split into 4096-byte pages.
 //
 // The risc-v Sv39 scheme has three levels of page-table
 // pages. A page-table page contains 512 64-bit PTEs.
@@ -79,25 +128,74 @@ kvminithart()
 //   12..20 -- 9 bits of level-0 index.
 //    0..12 -- 12 bits of byte offset within the page.
 static pte_t *
-walk(pagetable_t pagetable, uint64 va, int alloc)
+walk(pagetable_t pagetable, uint64 va, int flags)
 {
+  pagetable_t root = pagetable;
+
   if(va >= MAXVA)
     panic("walk");
 
   for(int level = 2; level > 0; level--) {
     pte_t *pte = &pagetable[PX(level, va)];
+    if((*pte & PTE_V) && PTE_LEAF(*pte)) {
+      if(flags == 0)
+        return pte;
+      if(level != 1 || uvm_demote(root, pte) < 0)
+        return 0;
+    }
     if(*pte & PTE_V) {
+      if((*pte & PTE_S) && (flags & WALK_PRIVATE) &&
+         uvm_unshare(root, pte) < 0)
+        return 0;
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!(flags & WALK_ALLOC) || (pagetable = (pde_t*)kalloc()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
   return &pagetable[PX(0, va)];
 }
 
+// Return the address of the level-1 PTE that points to the
+// leaf page-table page covering va, or 0 if there is no
+// level-1 page-table page. If alloc!=0, create it.
+static pte_t *
+walkpde(pagetable_t pagetable, uint64 va, int alloc)
+{
+  pte_t *pte;
+
+  if(va >= MAXVA)
+    panic("walkpde");
+
+  pte = &pagetable[PX(2, va)];
+  if(*pte & PTE_V) {
+    pagetable = (pagetable_t)PTE2PA(*pte);
+  } else {
+    if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      return 0;
+    *pte = PA2PTE(pagetable) | PTE_V;
+  }
+  return &pagetable[PX(1, va)];
+}
+
+/*
+ * The process whose TLB entries for pagetable must be flushed when its PTEs
+ * change: the current process, if pagetable is its own. Any other user page
+ * table is still being built or is being torn down, and isn't in use.
+ */
+static struct proc *
+uvm_owner(pagetable_t pagetable)
+{
+	struct proc *p;
+
+	p = myproc();
+	if (p != 0 && p->pagetable == pagetable)
+		return p;
+
+	return 0;
+}
+
 // Look up a virtual address, return the physical address,
 // or 0 if not mapped.
 // Can only be used to look up user pages.
@@ -105,20 +203,26 @@ uint64
 walkaddr(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
-  uint64 pa;
+  int level;
 
   if(va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
-  if(pte == 0)
-    return 0;
-  if((*pte & PTE_V) == 0)
-    return 0;
+  for(level = 2; level >= 0; level--){
+    pte = &pagetable[PX(level, va)];
+    if((*pte & PTE_V) == 0)
+      return 0;
+    if(PTE_LEAF(*pte))
+      break;
+    if(level == 0)
+      return 0;
+    pagetable = (pagetable_t)PTE2PA(*pte);
+  }
   if((*pte & PTE_U) == 0)
     return 0;
-  pa = PTE2PA(*pte);
-  return pa;
+  // a leaf above level 0 maps a megapage, of which va's
+  // page is one.
+  return PTE2PA(*pte) + (PGROUNDDOWN(va) & ((1L << PXSHIFT(level)) - 1));
 }
 
 // add a mapping to the kernel page table.
@@ -131,15 +235,35 @@ kvmmap(uint64 va, uint64 pa, uint64 sz, int perm)
     panic("kvmmap");
 }
 
+// remove the mapping of the page at va from the kernel page
+// table, and from this CPU's TLB. returns the physical address
+// it mapped.
+uint64
+kvmunmap(uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+
+  if((pte = walk(kernel_pagetable, va, 0)) == 0 || (*pte & PTE_V) == 0)
+    panic("kvmunmap");
+  pa = PTE2PA(*pte);
+  *pte = 0;
+  sfence_vma();
+  return pa;
+}
+
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
 // be page-aligned. Returns 0 on success, -1 if walk() couldn't
-// allocate a needed page-table page.
+// allocate a needed page-table page. Wherever va and pa are
+// both 2MB-aligned with at least 2MB left to map, and nothing
+// is mapped there yet, a single level-1 PTE maps a megapage.
 int
 mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 {
   uint64 a, last;
   pte_t *pte;
+  struct tlb_batch b;
 
   if(size == 0)
     panic("mappages: size");
@@ -147,7 +271,18 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   a = PGROUNDDOWN(va);
   last = PGROUNDDOWN(va + size - 1);
   for(;;){
-    if((pte = walk(pagetable, a, 1)) == 0)
+    if(a % PTSPAN == 0 && pa % PTSPAN == 0 && last - a >= PTSPAN - PGSIZE &&
+       (pte = walkpde(pagetable, a, 1)) != 0 && (*pte & PTE_V) == 0){
+      *pte = PA2PTE(pa) | perm | PTE_V;
+      a += PTSPAN - PGSIZE;
+      pa += PTSPAN - PGSIZE;
+      if(a == last)
+        break;
+      a += PGSIZE;
+      pa += PGSIZE;
+      continue;
+    }
+    if((pte = walk(pagetable, a, WALK_ALLOC|WALK_PRIVATE)) == 0)
       return -1;
     if(*pte & PTE_V)
       panic("mappages: remap");
@@ -157,27 +292,209 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
     a += PGSIZE;
     pa += PGSIZE;
   }
+
+  // the TLB may hold on to the PTEs having been invalid.
+  tlb_batch_init(&b, uvm_owner(pagetable));
+  tlb_batch_add(&b, va, size);
+  tlb_batch_flush(&b);
   return 0;
 }
 
+/*
+ * Drop a reference to a leaf page-table page. Dropping the last one also drops
+ * the references its PTEs hold on the pages and swap slots they map.
+ */
+static void
+uvm_table_put(pagetable_t table)
+{
+	if (kalloc_refcnt_release(table) == 0)
+		return;
+
+	for (int i = 0; i < NUM_PTE; i++) {
+		if (table[i] & PTE_V)
+			kalloc_refcnt_dec((void *) PTE2PA(table[i]));
+		else if (PTE_SWAPPED(table[i]))
+			swap_free(PTE2SLOT(table[i]));
+	}
+	kalloc_refcnt_dec(table);
+}
+
+/*
+ * Give a page table its own copy of the shared leaf page-table page that pde
+ * points to, so that its PTEs can be changed. The copied PTEs take their own
+ * references on the pages they map, which stay copy-on-write, and on the swap
+ * slots of pages written out to swap. Returns 0 on success, -1 if out of
+ * memory.
+ */
+static int
+uvm_unshare(pagetable_t pagetable, pte_t *pde)
+{
+	pagetable_t old, new;
+
+	old = (pagetable_t) PTE2PA(*pde);
+
+	/*
+	 * Every other page table has let go of it, so it can be used as is.
+	 */
+	if (kalloc_refcnt_get(old) == 1) {
+		*pde &= ~PTE_S;
+		return 0;
+	}
+
+	new = kalloc_flags(0);
+	if (new == 0)
+		return -1;
+
+	for (int i = 0; i < NUM_PTE; i++) {
+		new[i] = old[i];
+		if (old[i] & PTE_V)
+			kalloc_refcnt_add((void *) PTE2PA(old[i]));
+		else if (PTE_SWAPPED(old[i]))
+			swap_dup(PTE2SLOT(old[i]));
+	}
+	*pde = PA2PTE(new) | PTE_V;
+	uvm_table_put(old);
+
+	/*
+	 * The TLB may cache the level-1 PTE, and the old page-table page may
+	 * be about to be freed.
+	 */
+	tlb_flush_all(uvm_owner(pagetable));
+
+	__sync_fetch_and_add(&vmstat.nptcopy, 1);
+
+	return 0;
+}
+
+/*
+ * Take or drop the references a megapage's level-1 PTE holds: one on each of
+ * its pages, as if a leaf page-table page mapped them.
+ */
+static void
+uvm_mega_get(pte_t pde)
+{
+	for (int i = 0; i < NUM_PTE; i++)
+		kalloc_refcnt_add((void *) (PTE2PA(pde) + i * PGSIZE));
+}
+
+static void
+uvm_mega_put(pte_t pde)
+{
+	for (int i = 0; i < NUM_PTE; i++)
+		kalloc_refcnt_dec((void *) (PTE2PA(pde) + i * PGSIZE));
+}
+
+/*
+ * Split the megapage that the level-1 PTE pde maps into 4096-byte pages with
+ * the same permissions, mapped by a new leaf page-table page. The references
+ * on the pages move over to its PTEs unchanged. Returns 0 on success, -1 if
+ * out of memory.
+ */
+static int
+uvm_demote(pagetable_t pagetable, pte_t *pde)
+{
+	pagetable_t table;
+	uint64 pa;
+
+	table = kalloc_flags(0);
+	if (table == 0)
+		return -1;
+
+	pa = PTE2PA(*pde);
+	for (int i = 0; i < NUM_PTE; i++)
+		table[i] = PA2PTE(pa + i * PGSIZE) | PTE_FLAGS(*pde);
+	*pde = PA2PTE(table) | PTE_V;
+
+	tlb_flush_all(uvm_owner(pagetable));
+
+	__sync_fetch_and_add(&vmstat.nmegademote, 1);
+
+	return 0;
+}
+
+/*
+ * Unshare every leaf page-table page covering [va, va+size) before the PTEs in
+ * that range are changed, and split any megapage there. If drop is set,
+ * shared page-table pages and megapages lying wholly inside the range are
+ * released rather than copied or split, since the caller is about to remove
+ * all of their mappings anyway. Returns 0 on success, -1 if out of memory.
+ */
+static int
+uvm_unshare_range(pagetable_t pagetable, uint64 va, uint64 size, int drop)
+{
+	uint64 a, end;
+	pte_t *pde;
+	int dropped;
+
+	dropped = 0;
+	end = va + size;
+	for (a = PTROUNDDOWN(va); a < end; a += PTSPAN) {
+		pde = walkpde(pagetable, a, 0);
+		if (pde == 0 || (*pde & PTE_V) == 0)
+			continue;
+
+		if (PTE_LEAF(*pde)) {
+			if (drop && a >= va && a + PTSPAN <= end) {
+				uvm_mega_put(*pde);
+				*pde = 0;
+				dropped = 1;
+			} else if (uvm_demote(pagetable, pde) < 0)
+				return -1;
+			continue;
+		}
+
+		if ((*pde & PTE_S) == 0)
+			continue;
+
+		if (drop && a >= va && a + PTSPAN <= end) {
+			uvm_table_put((pagetable_t) PTE2PA(*pde));
+			*pde = 0;
+			dropped = 1;
+		} else if (uvm_unshare(pagetable, pde) < 0)
+			return -1;
+	}
+
+	if (dropped)
+		tlb_flush_all(uvm_owner(pagetable));
+
+	return 0;
+}
+
 // Remove mappings from a page table. The mappings in
 // the given range must exist. Optionally free the
-// physical memory.
-void
+// physical memory; swap slots are always freed.
+// Returns 0 on success, -1 if a shared leaf
+// page-table page could not be copied.
+int
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 size, int do_free)
 {
   uint64 a, last;
   pte_t *pte;
   uint64 pa;
+  struct tlb_batch b;
+
+  if(uvm_unshare_range(pagetable, va, size, do_free) < 0)
+    return -1;
+
+  tlb_batch_init(&b, uvm_owner(pagetable));
 
   a = PGROUNDDOWN(va);
   last = PGROUNDDOWN(va + size - 1);
   for(;;){
-    if((pte = walk(pagetable, a, 0)) == 0)
+    if((pte = walk(pagetable, a, 0)) == 0){
+      // no leaf page-table page, so nothing is mapped
+      // up to the next one.
+      a = PTROUNDDOWN(a) + PTSPAN - PGSIZE;
       goto next;
+    }
 
-    if((*pte & PTE_V) == 0)
-	goto next;
+    if((*pte & PTE_V) == 0){
+      if(PTE_SWAPPED(*pte)){
+        swap_free(PTE2SLOT(*pte));
+        *pte = 0;
+      }
+      goto next;
+    }
 
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
@@ -186,23 +503,25 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 size, int do_free)
       kalloc_refcnt_dec((void*)pa);
     }
     *pte = 0;
+    tlb_batch_add(&b, a, PGSIZE);
 next:
-    if(a == last)
+    if(a >= last)
       break;
     a += PGSIZE;
-    pa += PGSIZE;
   }
+  tlb_batch_flush(&b);
+  return 0;
 }
 
 // create an empty user page table.
+// returns 0 if out of memory.
 pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
   pagetable = (pagetable_t) kalloc();
   if(pagetable == 0)
-    panic("uvmcreate: out of memory");
-  memset(pagetable, 0, PGSIZE);
+    return 0;
   return pagetable;
 }
 
@@ -217,7 +536,6 @@ uvminit(pagetable_t pagetable, uchar *src, uint sz)
   if(sz >= PGSIZE)
     panic("inituvm: more than a page");
   mem = kalloc();
-  memset(mem, 0, PGSIZE);
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
@@ -253,7 +571,8 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
-// process size.  Returns the new process size.
+// process size.  Returns the new process size, or oldsz
+// if out of memory.
 uint64
 uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 {
@@ -261,8 +580,9 @@ uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
     return oldsz;
 
   uint64 newup = PGROUNDUP(newsz);
-  if(newup < PGROUNDUP(oldsz))
-    uvmunmap(pagetable, newup, oldsz - newup, 1);
+  if(newup < PGROUNDUP(oldsz) &&
+     uvmunmap(pagetable, newup, oldsz - newup, 1) < 0)
+    return oldsz;
 
   return newsz;
 }
@@ -292,235 +612,525 @@ freewalk(pagetable_t pagetable)
 void
 uvmfree(pagetable_t pagetable, uint64 sz)
 {
-  uvmunmap(pagetable, 0, sz, 1);
+  if(sz > 0){
+    // nothing is mapped between sz and the end of the last
+    // leaf page-table page, so shared ones can all be
+    // released without being copied.
+    uvm_unshare_range(pagetable, 0, PTROUNDUP(sz), 1);
+    uvmunmap(pagetable, 0, sz, 1);
+  }
   freewalk(pagetable);
 }
 
 /*
- * Given a parent process's page table, copy its memory into a child's page
- * table. Copies both the page table and the physical memory. returns 0 on
- * success, -1 on failure. Frees any allocated pages on failure.
+ * Set and clear permission bits in n consecutive PTEs, skipping invalid ones.
+ * The PTEs of pages out in swap keep the permissions the pages get back when
+ * read in, and are changed too, except to make them copy-on-write: each copy
+ * of a swapped-out page is read back in privately. Setting PTE_C only applies
+ * to writable PTEs, so pages that were read-only stay that way when their copy
+ * is broken.
+ */
+static void
+uvm_protect_ptes(pte_t *pte, int n, int set, int clear)
+{
+	for (; n > 0; n--, pte++) {
+		if ((*pte & PTE_V) == 0 &&
+		    (!PTE_SWAPPED(*pte) || (set & PTE_C)))
+			continue;
+		if ((set & PTE_C) && (*pte & PTE_W) == 0)
+			continue;
+		*pte = (*pte | set) & ~clear;
+	}
+}
+
+/*
+ * Return whether the page at va is mapped and has been written to since its
+ * PTE's dirty bit was last cleared (see mmap_writeback()).
  */
 int
-uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+uvm_dirty(pagetable_t pagetable, uint64 va)
 {
 	pte_t *pte;
-	uint64 pa, i;
-	uint flags;
 
-	for (i = 0; i < sz; i += PGSIZE){
-		if ((pte = walk(old, i, 0)) == 0)
-			continue;
+	pte = walk(pagetable, va, 0);
+	return pte != 0 && (*pte & (PTE_V | PTE_D)) == (PTE_V | PTE_D);
+}
 
-		if ((*pte & PTE_V) == 0)
-			continue;
+/*
+ * Set and clear permission bits in the PTEs of the pages mapped in
+ * [va, va+len), editing them in place. The page table is walked once per leaf
+ * page-table page and the TLB is flushed in one batch at the end. Returns 0 on success,
+ * -1 if out of memory.
+ */
+int
+uvm_protect(pagetable_t pagetable, uint64 va, uint64 len, int set, int clear)
+{
+	uint64 a, end, next;
+	pte_t *pte;
+	struct tlb_batch b;
 
-		pa = PTE2PA(*pte);
-		flags = PTE_FLAGS(*pte);
+	if (len == 0)
+		return 0;
 
-		/*
-		 * For copy-on-write pages:
-		 *
-		 * 1) Writing should be disallowed, as there will be a page
-		 *    fault when a process tries to write to the page (which the
-		 *    kernel can then use the make a copy of the page).
-		 *
-		 * 2) The PTE_C bit should be set, as the kernel will be able to
-		 *    distinguish a copy-on-write page from a page that just
-		 *    shouldn't be written to (such as a code page).
-		 */
-		flags &= ~PTE_W;
-		flags |= PTE_C;
+	if (uvm_unshare_range(pagetable, va, len, 0) < 0)
+		return -1;
 
-		/*
-		 * Map the "old" page table's underlying physical page to the
-		 * "new" page table (in essence, these two page tables will now.
-		 * share their underlying physical memory).
-		 */
-		if (mappages(new, i, PGSIZE, (uint64) pa, flags) != 0)
-			goto err;
+	end = PGROUNDUP(va + len);
+	for (a = PGROUNDDOWN(va); a < end; a = next) {
+		next = PTROUNDDOWN(a) + PTSPAN;
+		if (next > end)
+			next = end;
+
+		pte = walk(pagetable, a, 0);
+		if (pte != 0)
+			uvm_protect_ptes(pte, (next - a) / PGSIZE, set, clear);
+	}
+
+	tlb_batch_init(&b, uvm_owner(pagetable));
+	tlb_batch_add(&b, va, len);
+	tlb_batch_flush(&b);
+
+	return 0;
+}
+
+/*
+ * Share the leaf page-table pages covering [0, sz) between two page tables, so
+ * that fork costs one step per 2MB of address space rather than per page.
+ *
+ * Sv39 ignores the permission bits of non-leaf PTEs, so a page-table page can't
+ * be made read-only from the level above. Instead, the first time a leaf
+ * page-table page is shared its writable PTEs are made copy-on-write in place,
+ * and its level-1 PTE is marked PTE_S. From then on it just gains a reference
+ * per fork, and walk() gives a page table a private copy of it (WALK_PRIVATE)
+ * before any of its PTEs is changed.
+ */
+static int
+uvmcopy_pages(pagetable_t old, pagetable_t new, uint64 sz)
+{
+	pte_t *pde, *npde;
+	pagetable_t table;
+	uint64 a;
+	int ret, protected;
+
+	ret = 0;
+	protected = 0;
+	for (a = 0; a < sz; a += PTSPAN) {
+		pde = walkpde(old, a, 0);
+		if (pde == 0 || (*pde & PTE_V) == 0)
+			continue;
+
+		npde = walkpde(new, a, 1);
+		if (npde == 0) {
+			ret = -1;
+			break;
+		}
 
 		/*
-		 * Remap this page back to the "old" page table, but with new
-		 * PTE permissions indicating that the page is now
-		 * copy-on-write.
+		 * A megapage is shared copy-on-write the same way, with its
+		 * level-1 PTE standing in for a leaf page-table page. The
+		 * first write to it splits it in either page table.
 		 */
-		uvmunmap(old, i, PGSIZE, 0);
+		if (PTE_LEAF(*pde)) {
+			if (*pde & PTE_W)
+				protected = 1;
+			uvm_protect_ptes(pde, 1, PTE_C, PTE_W);
+			uvm_mega_get(*pde);
+			*npde = *pde;
+			continue;
+		}
+
+		table = (pagetable_t) PTE2PA(*pde);
+		if ((*pde & PTE_S) == 0) {
+			/*
+			 * For copy-on-write pages:
+			 *
+			 * 1) Writing should be disallowed, as there will be a
+			 *    page fault when a process tries to write to the
+			 *    page (which the kernel can then use the make a
+			 *    copy of the page).
+			 *
+			 * 2) The PTE_C bit should be set, as the kernel will be
+			 *    able to distinguish a copy-on-write page from a
+			 *    page that just shouldn't be written to (such as a
+			 *    code page).
+			 */
+			uvm_protect_ptes(table, NUM_PTE, PTE_C, PTE_W);
+			protected = 1;
+			*pde |= PTE_S;
+		}
 
-		if (mappages(old, i, PGSIZE, (uint64) pa, flags) != 0)
-			goto err;
+		kalloc_refcnt_add(table);
+		*npde = *pde;
 
-		kalloc_refcnt_add((void *) pa);
+		__sync_fetch_and_add(&vmstat.nptshare, 1);
 	}
 
-	return 0;
+	/*
+	 * The old page table lost write permission on its pages.
+	 */
+	if (protected)
+		tlb_flush_all(uvm_owner(old));
 
-err:
-	uvmunmap(new, 0, i, 1);
+	if (ret < 0)
+		uvm_unshare_range(new, 0, a, 1);
 
-	return -1;
+	return ret;
+}
+
+/*
+ * Given a parent process's page table, copy its memory into a child's page
+ * table. Copies both the page table and the physical memory. returns 0 on
+ * success, -1 on failure. Frees any allocated pages on failure.
+ */
+int
+uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+{
+	int ret;
+	uint64 start;
+
+	start = r_time();
+	ret = uvmcopy_pages(old, new, sz);
+
+	__sync_fetch_and_add(&vmstat.nuvmcopy, 1);
+	__sync_fetch_and_add(&vmstat.uvmcopy_time, r_time() - start);
+
+	return ret;
 }
 
-// mark a PTE invalid for user access.
-// used by exec for the user stack guard page.
+// unmap and free a page, so that neither the process nor
+// the kernel on its behalf can use it: a fault on it is
+// refused by its VMA_GUARD region. used by exec for the
+// user stack guard page.
 void
 uvmclear(pagetable_t pagetable, uint64 va)
 {
-  pte_t *pte;
-  
-  pte = walk(pagetable, va, 0);
-  if(pte == 0)
+  if(uvmunmap(pagetable, va, PGSIZE, 1) < 0)
     panic("uvmclear");
-  *pte &= ~PTE_U;
 }
 
+#ifdef UACCESS
 /*
- * Copy from kernel to user. Copy len bytes from src to virtual address dstva in
- * a given page table. Return 0 on success, -1 on error.
+ * Direct user access (make UACCESS=1).
+ *
+ * Each process runs in the kernel on a kernel page table of its own. Its
+ * top-level PTEs are the kernel's, except for the first gigabyte's: that
+ * level-1 page-table page is private, with the kernel's device mappings above
+ * UACCESS_TOP and, below it, the level-1 PTEs of the process's own page table,
+ * so that both share the same leaf page-table pages and megapages. The kernel
+ * can then reach user memory at its user address with sstatus.SUM set (see
+ * uaccess.S), without walking the page table. Only those level-1 PTEs have to
+ * be kept in step, by uvm_kview_sync().
+ *
+ * The kernel could access pages that aren't PTE_U this way, so the user half
+ * holds none: the stack guard page is left unmapped (see uvmclear()), and
+ * uaccess_fault() refuses a fault on it as the process's own access would be.
  */
-int
-copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
-{
-	int ret, flags, valid, writable, cow;
-	uint64 n, va0, pa0;
-	pte_t *pte;
-	void *phys;
-
-	while(len > 0) {
-		va0 = PGROUNDDOWN(dstva);
-		if (va0 > MAXVA)
-			return -1;
+#define UACCESS_NPDE	(UACCESS_TOP / PTSPAN)
 
-		pte = walk(pagetable, va0, 0);
-		if (pte == 0) {
-			/*
-			 * The user VM page that the kernel is writing to is not
-			 * yet mapped (i.e. it's a page that should be
-			 * lazy-allocated).
-			 */
-			phys = kalloc();
-			if (phys == 0)
-				return -1;
+struct uaccess_fixup {
+	uint64 start;
+	uint64 end;
+	uint64 fixup;
+};
 
-			flags = PTE_W | PTE_R | PTE_X | PTE_U;
+extern struct uaccess_fixup uaccess_table[], uaccess_table_end[];
 
-			ret = mappages(pagetable, va0, PGSIZE, (uint64) phys,
-				flags);
-			if (ret < 0) {
-				kalloc_refcnt_dec(phys);
-				return -1;
-			}
+int uaccess_copy(void *, void *, uint64);
+int uaccess_strncpy(char *, char *, uint64);
 
-			pa0 = (uint64) phys;
-		} else {
-			pa0 = walkaddr(pagetable, va0);
+/*
+ * Create a process's kernel page table, with no user memory in it yet.
+ * Returns 0 if out of memory.
+ */
+pagetable_t
+uvm_kview_create(void)
+{
+	pagetable_t root, low, klow;
+	int i;
+
+	root = kalloc();
+	if (root == 0)
+		return 0;
+	low = kalloc();
+	if (low == 0) {
+		kfree(root);
+		return 0;
+	}
 
-			/*
-			 * The PTE exists for this user VM page. Check whether
-			 * it's a copy-on-write page. If so, allocate a new page
-			 * frame and copy the contents of the original shared
-			 * page frame to it.
-			 */
-			flags = PTE_FLAGS(*pte);
-			valid = flags & PTE_V;
-			writable = flags & PTE_W;
-			cow = flags & PTE_C;
-			if (valid && !writable && cow) {
-				phys = kalloc();
-				if (phys == 0)
-					goto end;
-
-				/*
-				 * The new page will no longer be copy-on-write.
-				 * Allow for writing and disable the
-				 * copy-on-write identifier.
-				 */
-				flags |= PTE_W;
-				flags &= ~PTE_C;
-
-				/*
-				 * Copy the contents of the shared page frame to
-				 * the new private page frame and swap the two
-				 * in the page table.
-				 */
-				memmove(phys, (void *) pa0, PGSIZE);
-
-				uvmunmap(pagetable, va0, PGSIZE, 1);
-
-				ret = mappages(pagetable, va0, PGSIZE,
-					(uint64) phys, flags);
-				if (ret < 0) {
-					kalloc_refcnt_dec((void *) phys);
-					return -1;
-				}
+	for (i = 1; i < NUM_PTE; i++)
+		root[i] = kernel_pagetable[i];
 
-				pa0 = (uint64) phys;
-			}
-		}
+	klow = (pagetable_t) PTE2PA(kernel_pagetable[0]);
+	for (i = UACCESS_NPDE; i < NUM_PTE; i++)
+		low[i] = klow[i];
+	root[0] = PA2PTE(low) | PTE_V;
 
-end:
-		n = PGSIZE - (dstva - va0);
-		if (n > len)
-			n = len;
+	return root;
+}
 
-		if (pa0 != 0)
-			memmove((void *)(pa0 + (dstva - va0)), src, n);
+void
+uvm_kview_free(pagetable_t root)
+{
+	kfree((void *) PTE2PA(root[0]));
+	kfree(root);
+}
 
-		len -= n;
-		src += n;
-		dstva = va0 + PGSIZE;
+/*
+ * Bring the user half of p's kernel page table up to date with p's page table.
+ * Called with p's kernel page table in use, before accessing user memory and
+ * whenever the process's page table has been replaced.
+ */
+void
+uvm_kview_sync(struct proc *p)
+{
+	pagetable_t low, ulow;
+	pte_t pde;
+	int i, changed;
+
+	if (p->kpagetable == 0)
+		return;
+
+	low = (pagetable_t) PTE2PA(p->kpagetable[0]);
+	ulow = 0;
+	if (p->pagetable[0] & PTE_V)
+		ulow = (pagetable_t) PTE2PA(p->pagetable[0]);
+
+	changed = 0;
+	for (i = 0; i < UACCESS_NPDE; i++) {
+		pde = ulow ? ulow[i] : 0;
+		if (low[i] != pde) {
+			low[i] = pde;
+			changed = 1;
+		}
 	}
 
-	return 0;
+	/*
+	 * Entries cached from a replaced level-1 PTE, or from the page it
+	 * pointed to, may be stale.
+	 */
+	if (changed)
+		tlb_flush_all(p);
 }
 
 /*
- * Copy from user to kernel. Copy len bytes to dst from virtual address srcva in
- * a given page table. Return 0 on success, -1 on error.
+ * Return the process whose memory [va, va+len) in pagetable can be accessed
+ * directly, or 0 if it can't be.
+ */
+static struct proc *
+uaccess_owner(pagetable_t pagetable, uint64 va, uint64 len)
+{
+	struct proc *p;
+
+	p = uvm_owner(pagetable);
+	if (p == 0 || p->kpagetable == 0 || va >= UACCESS_TOP ||
+	    len > UACCESS_TOP - va)
+		return 0;
+
+	uvm_kview_sync(p);
+
+	return p;
+}
+
+/*
+ * Called by kerneltrap() on a page fault at va taken at sepc. If the faulting
+ * instruction is one of uaccess.S's, handle the fault as the process's own
+ * access would have been and return where to resume: at the instruction, to
+ * retry it, or at its fixup code if the page can't be had. As with
+ * uvm_copy_page(), pages of mapped files aren't read in. Returns 0 for any
+ * other fault.
+ */
+uint64
+uaccess_fault(uint64 sepc, uint64 va)
+{
+	struct uaccess_fixup *f;
+	struct proc *p;
+	pte_t *pte;
+
+	for (f = uaccess_table; f < uaccess_table_end; f++) {
+		if (sepc >= f->start && sepc < f->end)
+			break;
+	}
+	if (f == uaccess_table_end)
+		return 0;
+
+	p = myproc();
+	if (p == 0 || va >= UACCESS_TOP)
+		return f->fixup;
+
+	pte = walk(p->pagetable, PGROUNDDOWN(va), 0);
+	if ((pte == 0 || (*pte & PTE_V) == 0) && uvm_mapped_file(p, va))
+		return f->fixup;
+
+	if (uvm_handle_page_fault(p, va, r_scause() == 15) < 0)
+		return f->fixup;
+
+	uvm_kview_sync(p);
+
+	return sepc;
+}
+#endif
+
+/*
+ * A software TLB for the duration of one user copy: the leaf page-table page,
+ * or the megapage, that mapped the last page looked up. Copies walk through
+ * consecutive pages, so all but one lookup per 2MB is an array index rather
+ * than a walk(). Anything that changes the page table's structure must call
+ * uvm_cursor_reset().
+ */
+struct uvm_cursor {
+	pagetable_t pagetable;
+	uint64 base;		/* PTROUNDDOWN() of the cached span, or -1. */
+	pagetable_t table;	/* Its leaf page-table page, if any. */
+	pte_t *pde;		/* Its level-1 PTE, if it is a megapage. */
+};
+
+static void
+uvm_cursor_reset(struct uvm_cursor *c)
+{
+	c->base = -1;
+}
+
+/*
+ * Return the address of the PTE that maps va, as walk() would (the level-1 PTE
+ * of a megapage), or 0 if there is no such PTE.
+ */
+static pte_t *
+uvm_cursor_walk(struct uvm_cursor *c, uint64 va)
+{
+	pte_t *pde;
+
+	if (PTROUNDDOWN(va) != c->base) {
+		c->base = PTROUNDDOWN(va);
+		c->table = 0;
+		c->pde = 0;
+
+		pde = walkpde(c->pagetable, va, 0);
+		if (pde != 0 && (*pde & PTE_V)) {
+			if (PTE_LEAF(*pde))
+				c->pde = pde;
+			else
+				c->table = (pagetable_t) PTE2PA(*pde);
+		}
+	}
+
+	if (c->table)
+		return &c->table[PX(0, va)];
+
+	return c->pde;
+}
+
+/*
+ * Return the physical address of user page va0 for a copy into it (write) or
+ * out of it, or 0 if it can't be accessed that way. A page the process hasn't
+ * touched yet, or a read-only page about to be written, goes through the page
+ * fault handler, as the process's own access would have. Pages of mapped files
+ * aren't read in here, because callers may hold locks (a pipe's spinlock, the
+ * inode lock in writei()) that reading them would need or forbid; such callers
+ * read them in first with uvm_fault_in().
+ */
+static uint64
+uvm_copy_page(struct uvm_cursor *c, uint64 va0, int write)
+{
+	struct proc *p;
+	pte_t *pte;
+	int unmapped, fault;
+
+	if (va0 >= MAXVA)
+		return 0;
+
+	pte = uvm_cursor_walk(c, va0);
+	unmapped = pte == 0 || (*pte & PTE_V) == 0;
+	fault = unmapped || (write && (*pte & PTE_W) == 0);
+
+	if (fault) {
+		p = uvm_owner(c->pagetable);
+		if (p == 0 || (unmapped && uvm_mapped_file(p, va0)))
+			return 0;
+		if (uvm_handle_page_fault(p, va0, write) < 0)
+			return 0;
+
+		uvm_cursor_reset(c);
+		pte = uvm_cursor_walk(c, va0);
+		if (pte == 0 || (*pte & PTE_V) == 0)
+			return 0;
+	}
+
+	if ((*pte & PTE_U) == 0)
+		return 0;
+
+	if (c->table)
+		return PTE2PA(*pte);
+
+	return PTE2PA(*pte) + (va0 & (PTSPAN - 1));
+}
+
+/*
+ * Copy from kernel to user. Copy len bytes from src to virtual address dstva in
+ * a given page table. Return 0 on success, -1 on error.
  */
 int
-copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
+copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
-	int ret, flags;
+	struct uvm_cursor c;
 	uint64 n, va0, pa0;
-	pte_t *pte;
-	void *phys;
+
+#ifdef UACCESS
+	if (uaccess_owner(pagetable, dstva, len))
+		return uaccess_copy((void *) dstva, src, len);
+#endif
+
+	c.pagetable = pagetable;
+	uvm_cursor_reset(&c);
 
 	while (len > 0) {
-		va0 = PGROUNDDOWN(srcva);
-		if (va0 > MAXVA)
+		va0 = PGROUNDDOWN(dstva);
+		pa0 = uvm_copy_page(&c, va0, 1);
+		if (pa0 == 0)
 			return -1;
 
-		pte = walk(pagetable, va0, 0);
-		if (pte == 0) {
-			/*
-			 * The user VM page that the kernel is writing to is not
-			 * yet mapped (i.e. it's a page that should be
-			 * lazy-allocated).
-			 */
-			phys = kalloc();
-			if (phys == 0)
-				return -1;
+		n = PGSIZE - (dstva - va0);
+		if (n > len)
+			n = len;
 
-			flags = PTE_W | PTE_R | PTE_X | PTE_U;
+		memmove((void *)(pa0 + (dstva - va0)), src, n);
 
-			ret = mappages(pagetable, va0, PGSIZE, (uint64) phys,
-				flags);
-			if (ret < 0) {
-				kalloc_refcnt_dec(phys);
-				return -1;
-			}
+		len -= n;
+		src += n;
+		dstva = va0 + PGSIZE;
+	}
 
-			pa0 = (uint64) phys;
-		} else
-			pa0 = walkaddr(pagetable, va0);
+	return 0;
+}
+
+/*
+ * Copy from user to kernel. Copy len bytes to dst from virtual address srcva in
+ * a given page table. Return 0 on success, -1 on error.
+ */
+int
+copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
+{
+	struct uvm_cursor c;
+	uint64 n, va0, pa0;
+
+#ifdef UACCESS
+	if (uaccess_owner(pagetable, srcva, len))
+		return uaccess_copy(dst, (void *) srcva, len);
+#endif
+
+	c.pagetable = pagetable;
+	uvm_cursor_reset(&c);
+
+	while (len > 0) {
+		va0 = PGROUNDDOWN(srcva);
+		pa0 = uvm_copy_page(&c, va0, 0);
+		if (pa0 == 0)
+			return -1;
 
 		n = PGSIZE - (srcva - va0);
 		if (n > len)
 			n = len;
 
-		if (pa0 != 0)
-			memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+		memmove(dst, (void *)(pa0 + (srcva - va0)), n);
 
 		len -= n;
 		dst += n;
@@ -530,47 +1140,71 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 	return 0;
 }
 
-// Copy a null-terminated string from user to kernel.
-// Copy bytes to dst from virtual address srcva in a given page table,
-// until a '\0', or max.
-// Return 0 on success, -1 on error.
+/*
+ * Nonzero if any byte of the 64-bit word w is zero.
+ */
+#define WORD_HAS_NUL(w) \
+	(((w) - 0x0101010101010101ull) & ~(w) & 0x8080808080808080ull)
+
+/*
+ * Copy a null-terminated string from user to kernel. Copy bytes to dst from
+ * virtual address srcva in a given page table, until a '\0', or max. Aligned
+ * words of the source are checked for a '\0' and copied whole. Return 0 on
+ * success, -1 on error.
+ */
 int
 copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
-  uint64 n, va0, pa0;
-  int got_null = 0;
+	struct uvm_cursor c;
+	uint64 n, va0, pa0, w;
+	char *p;
 
-  while(got_null == 0 && max > 0){
-    va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
-      return -1;
-    n = PGSIZE - (srcva - va0);
-    if(n > max)
-      n = max;
-
-    char *p = (char *) (pa0 + (srcva - va0));
-    while(n > 0){
-      if(*p == '\0'){
-        *dst = '\0';
-        got_null = 1;
-        break;
-      } else {
-        *dst = *p;
-      }
-      --n;
-      --max;
-      p++;
-      dst++;
-    }
+#ifdef UACCESS
+	if (uaccess_owner(pagetable, srcva, max))
+		return uaccess_strncpy(dst, (char *) srcva, max) == 0 ? 0 : -1;
+#endif
 
-    srcva = va0 + PGSIZE;
-  }
-  if(got_null){
-    return 0;
-  } else {
-    return -1;
-  }
+	c.pagetable = pagetable;
+	uvm_cursor_reset(&c);
+
+	while (max > 0) {
+		va0 = PGROUNDDOWN(srcva);
+		pa0 = uvm_copy_page(&c, va0, 0);
+		if (pa0 == 0)
+			return -1;
+
+		n = PGSIZE - (srcva - va0);
+		if (n > max)
+			n = max;
+		max -= n;
+
+		p = (char *) (pa0 + (srcva - va0));
+		while (n > 0) {
+			if (((uint64) p % sizeof(w)) == 0 && n >= sizeof(w)) {
+				w = *(uint64 *) p;
+				if (!WORD_HAS_NUL(w)) {
+					if (((uint64) dst % sizeof(w)) == 0)
+						*(uint64 *) dst = w;
+					else
+						memmove(dst, p, sizeof(w));
+					p += sizeof(w);
+					dst += sizeof(w);
+					n -= sizeof(w);
+					continue;
+				}
+			}
+
+			if ((*dst = *p) == '\0')
+				return 0;
+			p++;
+			dst++;
+			n--;
+		}
+
+		srcva = va0 + PGSIZE;
+	}
+
+	return -1;
 }
 
 // Print the contents of a given page table.
@@ -618,27 +1252,119 @@ vmprint_pte(pte_t entry, int count, int level)
 	printf("%d: pte %p pa %p\n", count, entry, PTE2PA(entry));
 }
 
+/*
+ * Break copy-on-write sharing of the page at va, whose PTE pte must be in a leaf
+ * page-table page of the page table's own (see WALK_PRIVATE). The PTE is edited
+ * in place: if no other page table maps the page any more it is just made
+ * writable again, otherwise it is pointed at a private, writable copy.
+ */
+static int
+uvm_cow_fault(pagetable_t pagetable, uint64 va, pte_t *pte)
+{
+	void *old, *new;
+	uint64 perms;
+
+	old = (void *) PTE2PA(*pte);
+
+	/*
+	 * The page is no longer copy-on-write. Enable writing and disable the
+	 * COW identifier.
+	 */
+	perms = PTE_FLAGS(*pte);
+	perms |= PTE_W;
+	perms &= ~PTE_C;
+
+	if (kalloc_refcnt_get(old) == 1) {
+		/*
+		 * Ours is the only reference, and only this page table could
+		 * take another, so the page can be reused without a copy.
+		 */
+		*pte = PA2PTE(old) | perms;
+		__sync_fetch_and_add(&vmstat.ncowreuse, 1);
+	} else {
+		/*
+		 * The whole page is about to be overwritten, so don't ask for a
+		 * zeroed one.
+		 */
+		new = kalloc_flags(0);
+		if (new == 0)
+			return -1;
+
+		memcpy_page(new, old);
+
+		/*
+		 * Swap the shared page frame with the new, "owned" page frame,
+		 * and only then drop the reference to the shared one.
+		 */
+		*pte = PA2PTE(new) | perms;
+		kalloc_refcnt_dec(old);
+	}
+
+	/*
+	 * A stale read-only TLB entry would fault again.
+	 */
+	tlb_flush_page(uvm_owner(pagetable), va);
+
+	return 0;
+}
+
+/*
+ * Return whether va lies in a region of p that maps a file.
+ */
+static int
+uvm_mapped_file(struct proc *p, uint64 va)
+{
+	struct vma *v;
+
+	v = vma_find(p, va);
+	return v != 0 && v->file != 0;
+}
+
 /*
  * Handle a process's page fault by allocating memory for the faulting page and
  * mapping it to the process's virtual address space (at the faulting virtual
- * page's boundary).
+ * page's boundary), or by reading it back in from swap. write is whether the
+ * access was a store. An access outside of the process's regions, to the stack
+ * guard page, or that the region's protection doesn't allow is invalid.
+ *
+ * When free memory runs low, some of the process's own pages are written out to
+ * swap first, so that the fault (and the kernel's other allocations) can still
+ * be satisfied; if the fault fails anyway for want of memory, more are written
+ * out and it is retried once.
  */
 int
-uvm_handle_page_fault(struct proc *p, uint64 fault_va)
+uvm_handle_page_fault(struct proc *p, uint64 fault_va, int write)
 {
-	int ret, perms, guard, valid, cow, writable;
-	void *phys_pg;
-	uint64 vm_pg;
-	pte_t *pte;
-	struct mmap_info *info;
+	struct vma *v;
+	int ret;
 
-	/*
-	 * If the faulting address is larger than the process address space's
-	 * size, it's an invalid access.
-	 */
-	if (fault_va >= p->sz)
+	v = vma_find(p, fault_va);
+	if (v == 0 || v->type == VMA_GUARD ||
+	    (write && !(v->prot & PROT_WRITE)))
 		return -1;
 
+	if (kmem_nfree() < SWAP_LOW)
+		uvm_swap_out(p, SWAP_BATCH);
+
+	ret = uvm_fault(p, fault_va, v, write);
+	if (ret < 0 && kmem_nfree() < SWAP_LOW &&
+	    uvm_swap_out(p, SWAP_BATCH) > 0)
+		ret = uvm_fault(p, fault_va, v, write);
+
+	return ret;
+}
+
+/*
+ * The page fault handler proper, for a fault in region v: see
+ * uvm_handle_page_fault().
+ */
+static int
+uvm_fault(struct proc *p, uint64 fault_va, struct vma *v, int write)
+{
+	int ret, guard, valid, cow, writable, i, n;
+	uint64 vm_pg, start;
+	pte_t *pte;
+
 	/*
 	 * Since the faulting virtual address may not be aligned on a page
 	 * boundary, use PGROUNDDOWN(va) to find the starting address of the
@@ -647,93 +1373,564 @@ uvm_handle_page_fault(struct proc *p, uint64 fault_va)
 	vm_pg = PGROUNDDOWN(fault_va);
 
 	/*
-	 * Get the PTE of the virtual memory page and check it's not the
-	 * process's stack guard page (i.e. PTE_V && !PTE_U) or a copy-on-write
-	 * page.
+	 * Get the PTE of the virtual memory page and check it's not a page
+	 * the process may not use (i.e. PTE_V && !PTE_U) or a copy-on-write
+	 * page. The stack guard page isn't mapped at all; its region refuses
+	 * the fault.
 	 */
 	pte = walk(p->pagetable, vm_pg, 0);
 	if (pte != 0) {
 		/*
-		 * Check if the page is the stack guard page.
+		 * Check if the page is not user-accessible.
 		 */
 		guard = *pte & PTE_V;
 		guard &= !(*pte & PTE_U);
 
 		if (guard) {
 			/*
-			 * The PTE is valid yet not user-accessible, which are
-			 * the permissions for the stack guard page.
+			 * The PTE is valid yet not user-accessible.
 			 */
 			return -1;
 		}
 
+		/*
+		 * The page was written out to swap. Its PTE is about to be
+		 * changed, so the leaf page table must not be shared.
+		 */
+		if (PTE_SWAPPED(*pte)) {
+			pte = walk(p->pagetable, vm_pg, WALK_PRIVATE);
+			if (pte == 0)
+				return -1;
+			return uvm_swap_in(pte);
+		}
+
 		/*
 		 * Check if the page is a copy-on-write page. If it is, allocate
 		 * a new page frame and map it in the place of the copy-on-write
-		 * page.
+		 * page. A write to a page that mprotect() made read-only and
+		 * then writable again is handled the same way; the page is
+		 * reused if nothing else maps it.
 		 */
 		valid = *pte & PTE_V;
 		writable = *pte & PTE_W;
 		cow = *pte & PTE_C;
-		if (valid && !writable && cow) {
-			phys_pg = kalloc();
-			if (phys_pg == 0)
-				return -1;
-
-			memmove(phys_pg, (void *) PTE2PA(*pte), PGSIZE);
-
+		if (valid && !writable && (v->prot & PROT_WRITE) &&
+		    (cow || write)) {
 			/*
-			 * The page is no longer copy-on-write. Enable writing
-			 * and disable the COW identifier.
+			 * Except for a file mapped shared: every process
+			 * mapping it writes to the page cache's page, which is
+			 * just made writable again.
 			 */
-			perms = PTE_FLAGS(*pte);
-			perms |= PTE_W;
-			perms &= ~PTE_C;
+			if (v->file && (v->flags & MAP_SHARED)) {
+				pte = walk(p->pagetable, vm_pg, WALK_PRIVATE);
+				if (pte == 0)
+					return -1;
+				*pte = (*pte | PTE_W) & ~PTE_C;
+				tlb_flush_page(p, vm_pg);
+				return 0;
+			}
+
+			start = r_time();
 
 			/*
-			 * Swap the shared page frame with the new, "owned" page
-			 * frame.
+			 * The PTE is about to be changed, so the leaf page
+			 * table it lives in must not be shared.
 			 */
-			uvmunmap(p->pagetable, vm_pg, PGSIZE, 1);
+			pte = walk(p->pagetable, vm_pg, WALK_PRIVATE);
+			ret = -1;
+			if (pte != 0)
+				ret = uvm_cow_fault(p->pagetable, vm_pg, pte);
 
-			ret = mappages(p->pagetable, vm_pg, PGSIZE,
-				(uint64) phys_pg, perms);
-			if (ret < 0) {
-				kalloc_refcnt_dec(phys_pg);
-				return -1;
-			}
+			__sync_fetch_and_add(&vmstat.ncowfault, 1);
+			__sync_fetch_and_add(&vmstat.cowfault_time,
+				r_time() - start);
 
-			return 0;
+			return ret;
 		}
 	}
 
 	/*
 	 * There is no PTE mapping for this virtual memory address (i.e. it is
-	 * to be lazy-allocated and mapped). Allocate a page of physical memory
-	 * and zero it.
+	 * to be lazy-allocated and mapped). Map it, along with as many of the
+	 * pages after it as the process's fault-around window allows. Only
+	 * failing to map the faulting page itself is an error. A mapped file's
+	 * pages are read ahead first, by the region's own window.
+	 */
+	n = uvm_fault_window(p, vm_pg, v);
+	if (v->file)
+		mmap_readahead(v, vm_pg);
+	for (i = 0; i < n; i++) {
+		if (uvm_fault_page(p, vm_pg + i * PGSIZE, v) < 0)
+			break;
+	}
+	if (i == 0)
+		return -1;
+
+	p->fault_next = vm_pg + i * PGSIZE;
+	if (v->file)
+		v->ra_next = p->fault_next;
+
+	__sync_fetch_and_add(&vmstat.nfault, 1);
+	__sync_fetch_and_add(&vmstat.nfaultaround, i - 1);
+
+	/*
+	 * These pages may have been the last ones missing from their 2MB of
+	 * memory; a window never spans more than two such runs.
 	 */
+	uvm_promote(p, vm_pg);
+	if (PTROUNDDOWN(vm_pg + (i - 1) * PGSIZE) != PTROUNDDOWN(vm_pg))
+		uvm_promote(p, vm_pg + (i - 1) * PGSIZE);
+
+	return 0;
+}
+
+/*
+ * Return the number of pages, starting at the faulting page va, that a lazy
+ * fault should map. A process that faults where its previous fault left off is
+ * walking through memory sequentially, so its window doubles, up to
+ * FAULTAROUND_MAX pages; any other fault halves it. The window never extends
+ * past the end of the region va is in (v).
+ */
+static int
+uvm_fault_window(struct proc *p, uint64 va, struct vma *v)
+{
+	if (p->vm_policy == VM_LAZY)
+		return 1;
+
+	if (va == p->fault_next)
+		p->fault_window = min(p->fault_window * 2, FAULTAROUND_MAX);
+	else
+		p->fault_window = max(p->fault_window / 2, 1);
+
+	return max(min(p->fault_window, (v->end - va) / PGSIZE), 1);
+}
+
+/*
+ * Map a page at va of region v for a lazy fault: a fresh zero-filled page with
+ * the region's permissions, or the file's page from the page cache if v maps a
+ * file. Pages after the faulting one may already be mapped, or written out to
+ * swap, in which case the window stops there. Returns 0 on success, -1 if va is
+ * already mapped or if out of memory.
+ */
+static int
+uvm_fault_page(struct proc *p, uint64 va, struct vma *v)
+{
+	void *phys_pg;
+	pte_t *pte;
+	int perms;
+
+	pte = walk(p->pagetable, va, 0);
+	if (pte != 0 && (*pte & (PTE_V | PTE_SWAP)))
+		return -1;
+
+	if (v->file)
+		return mmap_pagefault_handle(p, v, va);
+
 	phys_pg = kalloc();
 	if (phys_pg == 0)
 		return -1;
-	memset(phys_pg, 0, PGSIZE);
-
-	info = mmap_info_get(p, vm_pg);
-	if (info)
-		return mmap_pagefault_handle(info, vm_pg, phys_pg);
 
 	/*
 	 * Set the permissions for the newly-allocated virtual page.
 	 */
-	perms = PTE_W | PTE_X | PTE_R | PTE_U;
+	perms = vma_perms(v);
 
 	/*
 	 * Map the allocated physical page to the faulting virtual page.
 	 */
-	ret = mappages(p->pagetable, vm_pg, PGSIZE, (uint64) phys_pg, perms);
-	if (ret != 0) {
+	if (mappages(p->pagetable, va, PGSIZE, (uint64) phys_pg, perms) != 0) {
 		kalloc_refcnt_dec(phys_pg);
 		return -1;
 	}
 
 	return 0;
 }
+
+/*
+ * Turn the 2MB of a process's memory around va into a megapage, if one
+ * anonymous region covers all of it and every one of
+ * its pages is now mapped privately with the same permissions, so that a single
+ * TLB entry can cover all of them. The pages are used as they are if they
+ * happen to be contiguous and suitably aligned; otherwise they are copied into
+ * a fresh 2MB block, if one is available. Either way the leaf page-table page
+ * is freed.
+ */
+static void
+uvm_promote(struct proc *p, uint64 va)
+{
+	pagetable_t table;
+	pte_t *pde, flags;
+	struct vma *v;
+	uint64 base, pa;
+	char *mem;
+	int i;
+
+	/*
+	 * Mapped files are paged in and out page by page.
+	 */
+	base = PTROUNDDOWN(va);
+	v = vma_find(p, base);
+	if (v == 0 || v->file || v->end < base + PTSPAN)
+		return;
+
+	pde = walkpde(p->pagetable, base, 0);
+	if (pde == 0 || (*pde & PTE_V) == 0 || PTE_LEAF(*pde) ||
+	    (*pde & PTE_S))
+		return;
+
+	/*
+	 * Most faults leave a hole at one end or the other; check for that
+	 * before looking at the whole table.
+	 */
+	table = (pagetable_t) PTE2PA(*pde);
+	if ((table[0] & PTE_V) == 0 || (table[NUM_PTE - 1] & PTE_V) == 0)
+		return;
+
+	flags = PTE_FLAGS(table[0]) & ~(PTE_A | PTE_D);
+	if ((flags & (PTE_W | PTE_U)) != (PTE_W | PTE_U) || (flags & PTE_C))
+		return;
+
+	pa = PTE2PA(table[0]);
+	mem = (pa % PTSPAN == 0) ? (char *) pa : 0;
+	for (i = 0; i < NUM_PTE; i++) {
+		if ((PTE_FLAGS(table[i]) & ~(PTE_A | PTE_D)) != flags ||
+		    kalloc_refcnt_get((void *) PTE2PA(table[i])) != 1)
+			return;
+		if (PTE2PA(table[i]) != pa + i * PGSIZE)
+			mem = 0;
+	}
+
+	if (mem == 0) {
+		/*
+		 * Every page is copied over, so there's no point zeroing it.
+		 */
+		mem = kalloc_pages_flags(MEGA_ORDER, 0);
+		if (mem == 0)
+			return;
+		kalloc_pages_split(mem, MEGA_ORDER);
+		for (i = 0; i < NUM_PTE; i++)
+			memcpy_page(mem + i * PGSIZE, (void *) PTE2PA(table[i]));
+	}
+
+	*pde = PA2PTE(mem) | flags;
+	tlb_flush_all(p);
+
+	/*
+	 * The megapage holds its own references on the pages; drop the ones the
+	 * leaf page-table page held, unless they are the same pages.
+	 */
+	if ((uint64) mem != pa)
+		for (i = 0; i < NUM_PTE; i++)
+			kalloc_refcnt_dec((void *) PTE2PA(table[i]));
+	kalloc_refcnt_dec(table);
+
+	__sync_fetch_and_add(&vmstat.nmegapromote, 1);
+}
+
+/*
+ * Count the unmapped pages from va up to end, stopping at the first mapped (or
+ * swapped-out) one and at NUM_PTE pages.
+ */
+static int
+uvm_unmapped(pagetable_t pagetable, uint64 va, uint64 end)
+{
+	pte_t *pte;
+	int n;
+
+	for (n = 0; n < NUM_PTE && va < end; n++, va += PGSIZE) {
+		pte = walk(pagetable, va, 0);
+		if (pte != 0 && (*pte & (PTE_V | PTE_SWAP)))
+			break;
+	}
+
+	return n;
+}
+
+/*
+ * Map every page of [va, va+len) that isn't mapped yet, ahead of any page
+ * fault: zero-filled, or the file's pages from the page cache if va lies in a
+ * mapped file region. Anonymous memory comes from kalloc_pages() in the largest
+ * naturally aligned blocks that fit, up to 2MB, which mappages() maps as a
+ * megapage. Returns 0 on success, -1 if out of memory; the pages mapped so far
+ * stay mapped.
+ */
+int
+uvm_populate(struct proc *p, uint64 va, uint64 len)
+{
+	struct vma *v;
+	uint64 a, end;
+	char *mem;
+	int order, n, i;
+
+	v = vma_find(p, va);
+	if (v == 0)
+		return -1;
+
+	end = min(PGROUNDUP(va + len), v->end);
+	for (a = PGROUNDDOWN(va); a < end; a += (uint64) n * PGSIZE) {
+		n = uvm_unmapped(p->pagetable, a, end);
+		if (n == 0) {
+			n = 1;
+			continue;
+		}
+
+		if (v->file) {
+			for (i = 0; i < n; i++)
+				if (mmap_pagefault_handle(p, v,
+				    a + i * PGSIZE) < 0)
+					return -1;
+			continue;
+		}
+
+		order = MEGA_ORDER;
+		while ((1 << order) > n || a % ((uint64) PGSIZE << order) != 0)
+			order--;
+		while ((mem = kalloc_pages(order)) == 0) {
+			if (order-- == 0)
+				return -1;
+		}
+		kalloc_pages_split(mem, order);
+		n = 1 << order;
+
+		/*
+		 * The block lies within one leaf page-table page's span, so
+		 * mappages() either maps all of it or none of it.
+		 */
+		if (mappages(p->pagetable, a, (uint64) n * PGSIZE, (uint64) mem,
+		    vma_perms(v)) != 0) {
+			for (i = 0; i < n; i++)
+				kalloc_refcnt_dec(mem + i * PGSIZE);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Read the page that the swapped-out PTE pte stands for back into a fresh page,
+ * and map it there with its old permissions. The leaf page table pte is in
+ * must not be shared. Returns 0 on success, -1 if out of memory or if the
+ * caller can't wait for the disk.
+ */
+static int
+uvm_swap_in(pte_t *pte)
+{
+	void *mem;
+
+	mem = kalloc_flags(0);
+	if (mem == 0)
+		return -1;
+
+	if (swap_read(PTE2SLOT(*pte), mem) < 0) {
+		kfree(mem);
+		return -1;
+	}
+	swap_free(PTE2SLOT(*pte));
+	*pte = PA2PTE(mem) | (PTE_FLAGS(*pte) & ~PTE_SWAP) | PTE_V;
+
+	__sync_fetch_and_add(&vmstat.nswapin, 1);
+
+	return 0;
+}
+
+/*
+ * Write up to n of p's pages out to swap, and return how many were. p must be
+ * the calling process, at a point where it holds on to none of its pages.
+ *
+ * Pages are picked with the clock algorithm: p->swap_hand sweeps through p's
+ * memory, giving each page it passes whose accessed bit is set a second chance
+ * (the bit is cleared), and writing out the first one whose bit is clear. Like
+ * the working-set scan, which clears accessed bits too (see wss.c), it notes
+ * the pages it finds in use for kalloc_page_idle(). An unused megapage is split
+ * so that its pages can be written out one by one.
+ *
+ * Only pages that p alone maps are written out: not those shared copy-on-write
+ * or in a shared leaf page-table page, nor pages of mapped files, which the
+ * file itself backs.
+ */
+static int
+uvm_swap_out(struct proc *p, int n)
+{
+	uint64 va, next, left, pa;
+	pagetable_t table;
+	pte_t *pde, *pte;
+	int nout, cleared, slot;
+
+	nout = 0;
+	cleared = 0;
+	left = 2 * PGROUNDUP(p->sz) / PGSIZE;	// two laps at most
+	va = p->swap_hand < p->sz ? p->swap_hand : 0;
+	while (nout < n && left > 0) {
+		if (va >= p->sz)
+			va = 0;
+		next = min(PTROUNDDOWN(va) + PTSPAN, PGROUNDUP(p->sz));
+		left -= min(left, (next - va) / PGSIZE);
+
+		pde = walkpde(p->pagetable, va, 0);
+		if (pde == 0 || (*pde & PTE_V) == 0) {
+			va = next;
+			continue;
+		}
+
+		if (PTE_LEAF(*pde)) {
+			if (*pde & PTE_A) {
+				*pde &= ~PTE_A;
+				pa = PTE2PA(*pde);
+				for (int i = 0; i < NUM_PTE; i++)
+					kalloc_page_used((void *) (pa + i * PGSIZE));
+				cleared = 1;
+				va = next;
+				continue;
+			}
+			if (uvm_demote(p->pagetable, pde) < 0) {
+				va = next;
+				continue;
+			}
+		}
+
+		table = (pagetable_t) PTE2PA(*pde);
+		if ((*pde & PTE_S) && (kalloc_refcnt_get(table) != 1 ||
+		    uvm_unshare(p->pagetable, pde) < 0)) {
+			va = next;
+			continue;
+		}
+
+		for (; va < next && nout < n; va += PGSIZE) {
+			pte = &table[PX(0, va)];
+			if ((*pte & (PTE_V | PTE_U)) != (PTE_V | PTE_U))
+				continue;
+			pa = PTE2PA(*pte);
+			if (*pte & PTE_A) {
+				*pte &= ~PTE_A;
+				kalloc_page_used((void *) pa);
+				cleared = 1;
+				continue;
+			}
+			if (kalloc_refcnt_get((void *) pa) != 1 ||
+			    uvm_mapped_file(p, va))
+				continue;
+
+			slot = swap_write((void *) pa);
+			if (slot < 0)
+				goto out;
+			*pte = SLOT2PTE(slot) | (PTE_FLAGS(*pte) & ~PTE_V) | PTE_SWAP;
+			tlb_flush_page(p, va);
+			kalloc_refcnt_dec((void *) pa);
+			nout++;
+		}
+	}
+
+out:
+	p->swap_hand = va;
+
+	/*
+	 * A page whose translation is still cached wouldn't have its accessed
+	 * bit set again.
+	 */
+	if (cleared)
+		tlb_flush_all(p);
+
+	__sync_fetch_and_add(&vmstat.nswapout, nout);
+
+	return nout;
+}
+
+/*
+ * Read in any pages of [va, va+len) in pagetable that a copy to or from them
+ * couldn't: pages out in swap, and pages of mapped files not read in yet. The
+ * caller is about to copy with a lock held (a spinlock, or an inode's lock)
+ * that reading them then would forbid or need. The process must not swap out
+ * its pages meanwhile, which it only does in page faults that could sleep.
+ */
+void
+uvm_fault_in(pagetable_t pagetable, uint64 va, uint64 len)
+{
+	struct proc *p;
+	struct vma *v;
+	uint64 a, end;
+	pte_t *pte;
+
+	p = uvm_owner(pagetable);
+	if (p == 0 || len == 0 || va + len < va)
+		return;
+
+	/*
+	 * Only pages in the process's regions can be read in, so holes in a
+	 * wild range are skipped whole.
+	 */
+	end = va + len;
+	a = PGROUNDDOWN(va);
+	while (a < end && (v = vma_next(p, a)) != 0 && v->start < end) {
+		if (a < v->start)
+			a = v->start;
+		for (; a < v->end && a < end; a += PGSIZE) {
+			pte = walk(pagetable, a, 0);
+			if (pte != 0 && PTE_SWAPPED(*pte))
+				uvm_handle_page_fault(p, a, 0);
+			else if (v->file && (pte == 0 || (*pte & PTE_V) == 0))
+				uvm_handle_page_fault(p, a, 0);
+		}
+	}
+}
+
+/*
+ * Return the PTE mapping p's page at va if ksmd may merge the page (see ksm.c),
+ * or 0: if it isn't mapped, is part of a megapage or of a mapped file, or is in
+ * a leaf page-table page shared with another page table, in which ksmd can't
+ * change it for p alone.
+ */
+pte_t *
+uvm_merge_pte(struct proc *p, uint64 va)
+{
+	pte_t *pde, *pte;
+
+	pde = walkpde(p->pagetable, va, 0);
+	if (pde == 0 || (*pde & PTE_V) == 0 || PTE_LEAF(*pde) ||
+	    (*pde & PTE_S))
+		return 0;
+
+	pte = &((pagetable_t) PTE2PA(*pde))[PX(0, va)];
+	if ((*pte & (PTE_V | PTE_U)) != (PTE_V | PTE_U) ||
+	    uvm_mapped_file(p, va))
+		return 0;
+
+	return pte;
+}
+
+/*
+ * Copy the fork and copy-on-write statistics out to the user-supplied struct
+ * vmstat.
+ */
+uint64
+sys_vmstat(void)
+{
+	uint64 addr;
+	struct vmstat st;
+
+	if (argaddr(0, &addr) < 0)
+		return -1;
+
+	st.nuvmcopy = __atomic_load_n(&vmstat.nuvmcopy, __ATOMIC_RELAXED);
+	st.uvmcopy_time = __atomic_load_n(&vmstat.uvmcopy_time,
+		__ATOMIC_RELAXED);
+	st.ncowfault = __atomic_load_n(&vmstat.ncowfault, __ATOMIC_RELAXED);
+	st.cowfault_time = __atomic_load_n(&vmstat.cowfault_time,
+		__ATOMIC_RELAXED);
+	st.ncowreuse = __atomic_load_n(&vmstat.ncowreuse, __ATOMIC_RELAXED);
+	st.nptshare = __atomic_load_n(&vmstat.nptshare, __ATOMIC_RELAXED);
+	st.nptcopy = __atomic_load_n(&vmstat.nptcopy, __ATOMIC_RELAXED);
+	st.nmegapromote = __atomic_load_n(&vmstat.nmegapromote,
+		__ATOMIC_RELAXED);
+	st.nmegademote = __atomic_load_n(&vmstat.nmegademote,
+		__ATOMIC_RELAXED);
+	st.nfault = __atomic_load_n(&vmstat.nfault, __ATOMIC_RELAXED);
+	st.nfaultaround = __atomic_load_n(&vmstat.nfaultaround,
+		__ATOMIC_RELAXED);
+	st.nswapout = __atomic_load_n(&vmstat.nswapout, __ATOMIC_RELAXED);
+	st.nswapin = __atomic_load_n(&vmstat.nswapin, __ATOMIC_RELAXED);
+	ksm_stat(&st);
+	mmap_stat(&st);
+
+	return copyout(myproc()->pagetable, addr, (char *) &st, sizeof(st));
+}
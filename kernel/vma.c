@@ -0,0 +1,573 @@
+/*
+ * vma.c: Address-space regions
+ *
+ * A process's address space is described by its regions (struct vma): the
+ * program text and data, the guard page and stack below the heap, the heap,
+ * and each mapped file. Addresses in no region are holes, and a page fault
+ * there is an error, as is one that the region's protection doesn't allow
+ * (see uvm_handle_page_fault()).
+ *
+ * The regions are kept in an AVL tree sorted by address, so that finding the
+ * region an address is in takes O(log n) steps however many files are mapped.
+ * Unmapping or changing the protection of part of a region splits it, and
+ * neighbouring regions that end up alike are merged again. p->sz is kept at
+ * the end of the highest region, so that code that walks the whole address
+ * space (fork(), the swap clock) covers all of it.
+ *
+ * The heap starts right above the stack and grows up. Mapped files are placed
+ * in the first hole big enough for them at or above MMAP_BASE, leaving the
+ * heap room to grow.
+ *
+ * A process's regions change only in its own system calls, and are read by
+ * others only while it is stopped (see ksm.c), so they need no lock.
+ */
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "proc.h"
+#include "mman.h"
+#include "defs.h"
+
+static struct kmem_cache *vma_cache;
+
+void
+vmainit(void)
+{
+	if (!kmem_cache_create(&vma_cache, "vma", sizeof(struct vma)))
+		panic("vmainit");
+}
+
+static int
+vma_height(struct vma *v)
+{
+	return v ? v->height : 0;
+}
+
+static void
+vma_fix_height(struct vma *v)
+{
+	v->height = max(vma_height(v->left), vma_height(v->right)) + 1;
+}
+
+static struct vma *
+vma_rotate_right(struct vma *v)
+{
+	struct vma *l;
+
+	l = v->left;
+	v->left = l->right;
+	l->right = v;
+	vma_fix_height(v);
+	vma_fix_height(l);
+
+	return l;
+}
+
+static struct vma *
+vma_rotate_left(struct vma *v)
+{
+	struct vma *r;
+
+	r = v->right;
+	v->right = r->left;
+	r->left = v;
+	vma_fix_height(v);
+	vma_fix_height(r);
+
+	return r;
+}
+
+/*
+ * Restore the AVL property at v, whose subtrees differ in height by at most 2,
+ * and return the new root of the subtree.
+ */
+static struct vma *
+vma_balance(struct vma *v)
+{
+	int bal;
+
+	vma_fix_height(v);
+	bal = vma_height(v->left) - vma_height(v->right);
+	if (bal > 1) {
+		if (vma_height(v->left->left) < vma_height(v->left->right))
+			v->left = vma_rotate_left(v->left);
+		return vma_rotate_right(v);
+	}
+	if (bal < -1) {
+		if (vma_height(v->right->right) < vma_height(v->right->left))
+			v->right = vma_rotate_right(v->right);
+		return vma_rotate_left(v);
+	}
+
+	return v;
+}
+
+static struct vma *
+vma_tree_insert(struct vma *root, struct vma *v)
+{
+	if (root == 0) {
+		v->left = 0;
+		v->right = 0;
+		v->height = 1;
+		return v;
+	}
+
+	if (v->start < root->start)
+		root->left = vma_tree_insert(root->left, v);
+	else
+		root->right = vma_tree_insert(root->right, v);
+
+	return vma_balance(root);
+}
+
+/*
+ * Unlink the lowest region of a subtree, return it in *min, and return the new
+ * root of the subtree.
+ */
+static struct vma *
+vma_tree_remove_min(struct vma *root, struct vma **min)
+{
+	if (root->left == 0) {
+		*min = root;
+		return root->right;
+	}
+
+	root->left = vma_tree_remove_min(root->left, min);
+
+	return vma_balance(root);
+}
+
+static struct vma *
+vma_tree_remove(struct vma *root, struct vma *v)
+{
+	struct vma *min;
+
+	if (root == 0)
+		panic("vma_tree_remove");
+
+	if (v->start < root->start) {
+		root->left = vma_tree_remove(root->left, v);
+	} else if (v->start > root->start) {
+		root->right = vma_tree_remove(root->right, v);
+	} else {
+		if (root->right == 0)
+			return root->left;
+		root->right = vma_tree_remove_min(root->right, &min);
+		min->left = root->left;
+		min->right = root->right;
+		root = min;
+	}
+
+	return vma_balance(root);
+}
+
+/*
+ * Return the region va is in, or else the lowest one above va, or 0 if there
+ * is none.
+ */
+struct vma *
+vma_next(struct proc *p, uint64 va)
+{
+	struct vma *v, *next;
+
+	next = 0;
+	for (v = p->vmas; v != 0; ) {
+		if (va < v->end) {
+			next = v;
+			v = v->left;
+		} else {
+			v = v->right;
+		}
+	}
+
+	return next;
+}
+
+/*
+ * Return the region va is in, or 0 if it is in a hole.
+ */
+struct vma *
+vma_find(struct proc *p, uint64 va)
+{
+	struct vma *v;
+
+	v = vma_next(p, va);
+	if (v == 0 || v->start > va)
+		return 0;
+
+	return v;
+}
+
+/*
+ * The end of the highest region of a tree, or 0 if it is empty.
+ */
+static uint64
+vma_top(struct vma *root)
+{
+	if (root == 0)
+		return 0;
+	while (root->right)
+		root = root->right;
+
+	return root->end;
+}
+
+/*
+ * The PTE permission bits for a page of a region.
+ */
+int
+vma_perms(struct vma *v)
+{
+	int perms;
+
+	perms = PTE_U;
+	if (v->prot & (PROT_READ | PROT_WRITE))
+		perms |= PTE_R;
+	if (v->prot & PROT_WRITE)
+		perms |= PTE_W;
+	if (v->prot & PROT_EXEC)
+		perms |= PTE_X;
+
+	return perms;
+}
+
+/*
+ * Add a region of a file-less type to a tree of regions, for a process being
+ * built. Returns 0 on success, -1 if out of memory.
+ */
+int
+vma_add(struct vma **root, uint64 start, uint64 end, int type, int prot)
+{
+	struct vma *v;
+
+	v = kmem_cache_alloc(vma_cache, KALLOC_ZERO);
+	if (v == 0)
+		return -1;
+
+	v->start = start;
+	v->end = end;
+	v->type = type;
+	v->prot = prot;
+	*root = vma_tree_insert(*root, v);
+
+	return 0;
+}
+
+/*
+ * Free a tree of regions. Their files must have been let go of already (see
+ * mmap_exit()), as that may sleep, and this is called with p->lock held.
+ */
+void
+vma_free(struct vma *root)
+{
+	if (root == 0)
+		return;
+
+	vma_free(root->left);
+	vma_free(root->right);
+	kmem_cache_free(vma_cache, root);
+}
+
+/*
+ * Copy a tree of regions, shape and all. Returns 0 if out of memory, and an
+ * empty tree as 0 too, so *err tells the two apart.
+ */
+static struct vma *
+vma_tree_copy(struct vma *v, int *err)
+{
+	struct vma *n;
+
+	if (v == 0 || *err)
+		return 0;
+
+	n = kmem_cache_alloc(vma_cache, 0);
+	if (n == 0) {
+		*err = 1;
+		return 0;
+	}
+	*n = *v;
+	n->left = vma_tree_copy(v->left, err);
+	n->right = vma_tree_copy(v->right, err);
+	if (*err) {
+		vma_free(n->left);
+		vma_free(n->right);
+		kmem_cache_free(vma_cache, n);
+		return 0;
+	}
+
+	return n;
+}
+
+static void
+vma_tree_filedup(struct vma *v)
+{
+	if (v == 0)
+		return;
+
+	if (v->file)
+		filedup(v->file);
+	vma_tree_filedup(v->left);
+	vma_tree_filedup(v->right);
+}
+
+/*
+ * Give fork()'s child np a copy of p's regions. Returns 0 on success, -1 if out
+ * of memory.
+ */
+int
+vma_copy(struct proc *np, struct proc *p)
+{
+	int err;
+
+	err = 0;
+	np->vmas = vma_tree_copy(p->vmas, &err);
+	if (err)
+		return -1;
+
+	vma_tree_filedup(np->vmas);
+	np->heap_start = p->heap_start;
+	np->brk = p->brk;
+
+	return 0;
+}
+
+/*
+ * Remove a region from p's tree and free it, letting go of its file.
+ */
+static void
+vma_remove(struct proc *p, struct vma *v)
+{
+	p->vmas = vma_tree_remove(p->vmas, v);
+	if (v->file)
+		fileclose(v->file);
+	kmem_cache_free(vma_cache, v);
+}
+
+/*
+ * Split region v at addr, which must be inside it, and return the upper part,
+ * or 0 if out of memory.
+ */
+static struct vma *
+vma_split(struct proc *p, struct vma *v, uint64 addr)
+{
+	struct vma *n;
+
+	n = kmem_cache_alloc(vma_cache, 0);
+	if (n == 0)
+		return 0;
+
+	*n = *v;
+	n->start = addr;
+	n->off = v->off + (addr - v->start);
+	if (n->file)
+		filedup(n->file);
+	v->end = addr;
+	p->vmas = vma_tree_insert(p->vmas, n);
+
+	return n;
+}
+
+/*
+ * Can region b, which starts where a ends, be merged into a?
+ */
+static int
+vma_mergeable(struct vma *a, struct vma *b)
+{
+	return a->end == b->start && a->type == b->type &&
+	    a->prot == b->prot && a->flags == b->flags &&
+	    a->file == b->file &&
+	    (a->file == 0 || a->off + (a->end - a->start) == b->off);
+}
+
+/*
+ * Merge the alike neighbouring regions from the one below start up to the one
+ * above end.
+ */
+static void
+vma_merge(struct proc *p, uint64 start, uint64 end)
+{
+	struct vma *v, *next;
+
+	v = vma_next(p, start > 0 ? start - 1 : 0);
+	while (v != 0 && v->start <= end) {
+		next = vma_next(p, v->end);
+		if (next == 0)
+			break;
+		if (vma_mergeable(v, next)) {
+			v->end = next->end;
+			vma_remove(p, next);
+		} else {
+			v = next;
+		}
+	}
+}
+
+/*
+ * Map a new region [start, end) into p, which must be a hole. A file's region
+ * takes over the caller's reference to it. Returns 0 on success, -1 if the
+ * range isn't free or if out of memory.
+ */
+int
+vma_map(struct proc *p, uint64 start, uint64 end, int type, int prot,
+	int flags, struct file *file, uint64 off)
+{
+	struct vma *v;
+
+	if (start >= end || end > TRAPFRAME)
+		return -1;
+
+	v = vma_next(p, start);
+	if (v != 0 && v->start < end)
+		return -1;
+
+	v = kmem_cache_alloc(vma_cache, 0);
+	if (v == 0)
+		return -1;
+
+	v->start = start;
+	v->end = end;
+	v->type = type;
+	v->prot = prot;
+	v->flags = flags;
+	v->file = file;
+	v->off = off;
+	v->ra_next = start;
+	v->ra_window = 1;
+	p->vmas = vma_tree_insert(p->vmas, v);
+
+	vma_merge(p, start, end);
+	p->sz = vma_top(p->vmas);
+
+	return 0;
+}
+
+/*
+ * Remove [start, end) from p's regions, splitting the ones it cuts through.
+ * The pages must be unmapped by the caller. Returns 0 on success, -1 if out of
+ * memory, in which case some of the range may have been removed.
+ */
+int
+vma_unmap(struct proc *p, uint64 start, uint64 end)
+{
+	struct vma *v;
+	int ret;
+
+	ret = 0;
+	while ((v = vma_next(p, start)) != 0 && v->start < end) {
+		if (v->start < start) {
+			if (vma_split(p, v, start) == 0) {
+				ret = -1;
+				break;
+			}
+			continue;
+		}
+		if (v->end > end && vma_split(p, v, end) == 0) {
+			ret = -1;
+			break;
+		}
+		vma_remove(p, v);
+	}
+
+	p->sz = vma_top(p->vmas);
+
+	return ret;
+}
+
+/*
+ * Change the protection of [start, end) in p's regions to prot, splitting the
+ * ones it cuts through. The whole range must be mapped, but not by the guard
+ * page, and a file shared writable must have been opened for writing. The
+ * caller changes the PTEs. Returns 0 on success, -1 on error.
+ */
+int
+vma_protect(struct proc *p, uint64 start, uint64 end, int prot)
+{
+	struct vma *v;
+	uint64 a;
+
+	for (a = start; a < end; a = v->end) {
+		v = vma_next(p, a);
+		if (v == 0 || v->start > a || v->type == VMA_GUARD)
+			return -1;
+		if (v->file && (v->flags & MAP_SHARED) &&
+		    (prot & PROT_WRITE) && !v->file->writable)
+			return -1;
+	}
+
+	for (a = start; a < end; a = v->end) {
+		v = vma_find(p, a);
+		if (v->start < a && (v = vma_split(p, v, a)) == 0)
+			return -1;
+		if (v->end > end && vma_split(p, v, end) == 0)
+			return -1;
+		v->prot = prot;
+	}
+
+	vma_merge(p, start, end);
+
+	return 0;
+}
+
+/*
+ * Move p's program break to brk, adding the new part of the heap to its
+ * regions or removing the part given back. The heap can't shrink below where
+ * it started nor grow into another region. The caller maps or unmaps the
+ * pages. Returns 0 on success, -1 on error.
+ */
+int
+vma_brk(struct proc *p, uint64 brk)
+{
+	uint64 old, new;
+	struct vma *v;
+
+	if (brk < p->heap_start || brk > TRAPFRAME)
+		return -1;
+
+	old = PGROUNDUP(p->brk);
+	new = PGROUNDUP(brk);
+	if (new > old) {
+		if (vma_map(p, old, new, VMA_HEAP,
+		    PROT_READ | PROT_WRITE | PROT_EXEC, 0, 0, 0) < 0)
+			return -1;
+	} else if (new < old) {
+		for (v = vma_next(p, new); v != 0 && v->start < old;
+		    v = vma_next(p, v->end)) {
+			if (v->type != VMA_HEAP)
+				return -1;
+		}
+		if (vma_unmap(p, new, old) < 0)
+			return -1;
+	}
+	p->brk = brk;
+
+	return 0;
+}
+
+/*
+ * Find the lowest hole of at least len bytes at or above MMAP_BASE, for a file
+ * mapping. Returns its address, or 0 if there is none.
+ */
+uint64
+vma_gap(struct proc *p, uint64 len)
+{
+	struct vma *v;
+	uint64 a;
+
+	a = MMAP_BASE;
+	for (v = vma_next(p, a); v != 0; v = vma_next(p, v->end)) {
+		if (v->start >= a && v->start - a >= len)
+			break;
+		a = max(a, v->end);
+	}
+
+	if (a >= TRAPFRAME || TRAPFRAME - a < len)
+		return 0;
+
+	return a;
+}
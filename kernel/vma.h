@@ -0,0 +1,34 @@
+#ifndef _VMA_H
+#define _VMA_H
+
+/*
+ * Kinds of address-space region.
+ */
+#define VMA_TEXT	0	// Program text and data, loaded by exec().
+#define VMA_GUARD	1	// Guard page below the stack; never mapped.
+#define VMA_STACK	2	// The user stack.
+#define VMA_HEAP	3	// Grown and shrunk by sbrk().
+#define VMA_MMAP	4	// A mapped file (mmap.c).
+
+/*
+ * A region of a process's address space: a virtual memory area. A process's
+ * regions don't overlap, and are kept in an AVL tree sorted by address (see
+ * vma.c). Each region of a mapped file holds a reference to the file.
+ */
+struct vma {
+	uint64 start;		// First address, page-aligned.
+	uint64 end;		// One past the last, page-aligned.
+	int type;		// VMA_*.
+	int prot;		// PROT_* (mman.h).
+	int flags;		// MAP_* flags of a mapped file.
+	struct file *file;	// The mapped file, or 0.
+	uint64 off;		// Offset in the file that start maps.
+	uint64 ra_next;		// Page a sequential fault would hit next.
+	int ra_window;		// Pages of the file the next fault reads.
+
+	struct vma *left;	// Regions below this one.
+	struct vma *right;	// Regions above it.
+	int height;		// Of the subtree rooted here.
+};
+
+#endif // _VMA_H
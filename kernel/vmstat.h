@@ -0,0 +1,26 @@
+/*
+ * Virtual memory statistics, filled in by the vmstat() system call. Times are
+ * in ticks of the RISC-V time CSR (mtime), summed over all harts.
+ */
+struct vmstat {
+  uint64 nuvmcopy;      // Calls to uvmcopy() (one per fork)
+  uint64 uvmcopy_time;  // Time spent in uvmcopy()
+  uint64 ncowfault;     // Copy-on-write page faults handled
+  uint64 cowfault_time; // Time spent handling copy-on-write page faults
+  uint64 ncowreuse;     // Copy-on-write faults that reused the page in place
+  uint64 nptshare;      // Leaf page-table pages shared by uvmcopy()
+  uint64 nptcopy;       // Shared leaf page-table pages copied on write
+  uint64 nmegapromote;  // 2MB runs of user pages turned into megapages
+  uint64 nmegademote;   // User megapages split back into pages
+  uint64 nfault;        // Lazy-allocation page faults
+  uint64 nfaultaround;  // Pages mapped ahead of a lazy page fault
+  uint64 nswapout;      // Pages written out to swap
+  uint64 nswapin;       // Pages read back in from swap
+  uint64 nksmscan;      // Pages looked at by ksmd
+  uint64 nksmmerge;     // Pages merged into one with the same contents
+  uint64 nksmshared;    // Merged pages now in memory
+  uint64 nksmsharing;   // Page-table references to them
+  uint64 nwbpage;       // Dirty pages of shared mappings written back
+  uint64 nwbop;         // Log transactions writing them
+  uint64 nreadahead;    // File pages read in by page faults' read-ahead
+};
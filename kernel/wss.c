@@ -0,0 +1,237 @@
+/*
+ * wss.c: Working-set sampling
+ *
+ * Every WSS_INTERVAL ticks of CPU time, a process scans its own page table
+ * (see wss_tick()). Each user page whose accessed bit (PTE_A) the hardware has
+ * set since the last scan is noted as in use now, in the page allocator's
+ * record of when each physical page was last used, and the bit is cleared. A
+ * page's idle time is then how long ago it was last noted; because that is
+ * kept per physical page, a page shared by several processes is as idle as
+ * the least idle of them sees it.
+ *
+ * The scan also counts the process's resident and dirty (PTE_D) pages and
+ * sorts its pages by idle time, and the result is kept in the process for the
+ * wss() system call and /dev/wss. The idle times can tell reclaim which pages
+ * are cold, and PTE_D which pages need writing back; the scan leaves PTE_D
+ * alone for that reason.
+ */
+
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+#define NPTE	512	// PTEs per page-table page, and pages per megapage
+
+extern struct proc *proc_list;
+
+/*
+ * Return the age[] slot for a page idle for idle ticks.
+ */
+static int
+wss_age(uint idle)
+{
+	uint limit;
+	int i;
+
+	limit = WSS_INTERVAL;
+	for (i = 0; i < WSS_NAGE - 1 && idle >= limit; i++)
+		limit *= 2;
+
+	return i;
+}
+
+/*
+ * Sample one leaf PTE mapping npages pages. Returns 1 if it had been accessed.
+ */
+static int
+wss_sample(struct wss *w, pte_t *pte, int npages)
+{
+	pte_t old;
+	char *pa;
+	uint idle;
+	int i;
+
+	old = *pte;
+	pa = (char *) PTE2PA(old);
+
+	/*
+	 * Clear PTE_A atomically: the page-table page may be shared copy-on-write
+	 * with a process running on another hart, whose hardware may be setting
+	 * PTE_D in it, and that must not be lost.
+	 */
+	if (old & PTE_A) {
+		__sync_fetch_and_and(pte, ~PTE_A);
+		w->accessed += npages;
+	}
+	if (old & PTE_D)
+		w->dirty += npages;
+	w->resident += npages;
+
+	for (i = 0; i < npages; i++) {
+		if (old & PTE_A)
+			kalloc_page_used(pa + i * PGSIZE);
+		idle = kalloc_page_idle(pa + i * PGSIZE);
+		if (idle < WSS_WINDOW)
+			w->estimate++;
+		w->age[wss_age(idle)]++;
+	}
+
+	return (old & PTE_A) != 0;
+}
+
+/*
+ * Sample the working set of p, which must be the current process, and record
+ * it in p->wss.
+ */
+void
+wss_scan(struct proc *p)
+{
+	struct wss w;
+	pagetable_t l1, l0;
+	pte_t *pte;
+	int i, j, k, accessed;
+
+	memset(&w, 0, sizeof(w));
+	accessed = 0;
+
+	for (i = 0; i < NPTE; i++) {
+		if ((p->pagetable[i] & PTE_V) == 0)
+			continue;
+		l1 = (pagetable_t) PTE2PA(p->pagetable[i]);
+
+		for (j = 0; j < NPTE; j++) {
+			pte = &l1[j];
+			if ((*pte & PTE_V) == 0)
+				continue;
+			if (*pte & (PTE_R | PTE_W | PTE_X)) {
+				if (*pte & PTE_U)
+					accessed |= wss_sample(&w, pte, NPTE);
+				continue;
+			}
+			l0 = (pagetable_t) PTE2PA(*pte);
+
+			for (k = 0; k < NPTE; k++) {
+				pte = &l0[k];
+				if ((*pte & (PTE_V | PTE_U)) == (PTE_V | PTE_U))
+					accessed |= wss_sample(&w, pte, 1);
+			}
+		}
+	}
+
+	/*
+	 * A page whose translation is still cached wouldn't have PTE_A set again
+	 * the next time it is accessed.
+	 */
+	if (accessed)
+		tlb_flush_all(p);
+
+	acquire(&p->lock);
+	w.pid = p->pid;
+	w.nscan = p->wss.nscan + 1;
+	w.scantime = ticks;
+	p->wss = w;
+	release(&p->lock);
+}
+
+/*
+ * Called by usertrap() on each timer interrupt that finds p in user space.
+ */
+void
+wss_tick(struct proc *p)
+{
+	if (++p->wss_ticks < WSS_INTERVAL)
+		return;
+
+	p->wss_ticks = 0;
+	wss_scan(p);
+}
+
+/*
+ * int wss(int pid, struct wss *w)
+ *
+ * Fetch the last sample of the working set of the process with the given pid.
+ * A pid of 0 means the calling process, which is sampled first, so that the
+ * result covers its accesses since the last sample. Returns 0, or -1 if there
+ * is no such process.
+ */
+uint64
+sys_wss(void)
+{
+	struct proc *p;
+	struct wss w;
+	uint64 addr;
+	int pid;
+
+	if (argint(0, &pid) < 0 || argaddr(1, &addr) < 0)
+		return -1;
+
+	if (pid == 0) {
+		p = myproc();
+		wss_scan(p);
+		acquire(&p->lock);
+		w = p->wss;
+		release(&p->lock);
+	} else {
+		proc_walk_begin();
+		for (p = proc_list; p; p = p->next) {
+			acquire(&p->lock);
+			if (p->pid == pid && p->state != UNUSED) {
+				w = p->wss;
+				release(&p->lock);
+				break;
+			}
+			release(&p->lock);
+		}
+		proc_walk_end();
+		if (p == 0)
+			return -1;
+	}
+
+	if (copyout(myproc()->pagetable, addr, (char *) &w, sizeof(w)) < 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Describe the working set of every process, one line each, in buf (see
+ * /dev/wss). Returns the length of the text, which is truncated to size bytes.
+ */
+int
+wss_report(char *buf, int size)
+{
+	struct proc *p;
+	int i, off;
+
+	off = 0;
+	off = kmem_put_str(buf, off, size, "pid   name", 16);
+	off = kmem_put_str(buf, off, size,
+	    "resident dirty   accessed wss     age\n", 0);
+
+	proc_walk_begin();
+	for (p = proc_list; p; p = p->next) {
+		acquire(&p->lock);
+		if (p->state == UNUSED) {
+			release(&p->lock);
+			continue;
+		}
+		off = kmem_put_num(buf, off, size, p->pid, 6);
+		off = kmem_put_str(buf, off, size, p->name, 10);
+		off = kmem_put_num(buf, off, size, p->wss.resident, 9);
+		off = kmem_put_num(buf, off, size, p->wss.dirty, 8);
+		off = kmem_put_num(buf, off, size, p->wss.accessed, 9);
+		off = kmem_put_num(buf, off, size, p->wss.estimate, 8);
+		for (i = 0; i < WSS_NAGE; i++) {
+			off = kmem_put_num(buf, off, size, p->wss.age[i],
+			    i < WSS_NAGE - 1 ? 6 : 0);
+		}
+		off = kmem_put_str(buf, off, size, "\n", 0);
+		release(&p->lock);
+	}
+	proc_walk_end();
+
+	return off < size ? off : size;
+}
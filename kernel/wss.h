@@ -0,0 +1,28 @@
+#ifndef _WSS_H
+#define _WSS_H
+
+/*
+ * A process's working set, as last sampled by wss_scan(). Filled in by the
+ * wss() system call and shown by /dev/wss. Counts are of 4096-byte pages; a
+ * megapage counts as 512 of them.
+ *
+ * A page's idle time is how long ago, in clock ticks, any process using it
+ * was last seen to have accessed it. age[0] counts the pages accessed within
+ * the last WSS_INTERVAL ticks (see param.h), and each age[i] after it pages
+ * idle for up to twice as long as the one before, with the last one catching
+ * the rest.
+ */
+#define WSS_NAGE	6
+
+struct wss {
+  int pid;
+  uint64 nscan;         // Times the process's page table was scanned
+  uint64 scantime;      // Value of ticks at the last scan
+  uint64 resident;      // Pages mapped
+  uint64 dirty;         // Pages mapped writable and written to (PTE_D)
+  uint64 accessed;      // Pages accessed since the scan before (PTE_A)
+  uint64 estimate;      // Pages accessed within the last WSS_WINDOW ticks
+  uint64 age[WSS_NAGE]; // Pages by idle time
+};
+
+#endif // _WSS_H
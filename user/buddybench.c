@@ -0,0 +1,86 @@
+//
+// Page allocator scalability benchmark.
+//
+// For 1, 2, 4 and 8 concurrent processes (one per hart, given enough
+// harts), each process asks the kernel to allocate and free blocks of
+// a given order in a tight loop (see sys_kallocbench() in
+// kernel/kalloc.c). Reports the aggregate alloc/free pairs per second,
+// both through kalloc_pages() with its per-CPU caches and straight
+// from the buddy allocator.
+//
+// usage: buddybench [order [pairs-per-process]]
+//
+
+#include "kernel/types.h"
+#include "user/user.h"
+
+#define TIMEBASE 10000000  // time CSR frequency on qemu's virt machine (Hz)
+#define NPAIRS   20000
+
+static int nprocs[] = { 1, 2, 4, 8 };
+
+// Run n pairs in each of np processes, and return the aggregate
+// number of pairs per second.
+uint64
+run(int np, int order, int n, int raw)
+{
+  int fds[2], i, pid;
+  uint64 t, rate;
+
+  if(pipe(fds) < 0){
+    printf("buddybench: pipe failed\n");
+    exit(1);
+  }
+
+  for(i = 0; i < np; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("buddybench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      close(fds[0]);
+      t = kallocbench(order, n, raw);
+      write(fds[1], &t, sizeof(t));
+      exit(0);
+    }
+  }
+  close(fds[1]);
+
+  rate = 0;
+  for(i = 0; i < np; i++){
+    if(read(fds[0], &t, sizeof(t)) != sizeof(t) || t == (uint64)-1){
+      printf("buddybench: allocation failed\n");
+      exit(1);
+    }
+    if(t == 0)
+      t = 1;
+    rate += (uint64)n * TIMEBASE / t;
+  }
+  close(fds[0]);
+
+  for(i = 0; i < np; i++)
+    wait(0);
+
+  return rate;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int order = 0, n = NPAIRS, i;
+
+  if(argc > 1)
+    order = atoi(argv[1]);
+  if(argc > 2)
+    n = atoi(argv[2]);
+
+  printf("buddybench: order %d, %d pairs per process\n", order, n);
+  printf("procs\tkalloc_pages\tbuddy\t(pairs/sec)\n");
+  for(i = 0; i < sizeof(nprocs)/sizeof(nprocs[0]); i++){
+    printf("%d\t%l\t%l\n", nprocs[i],
+           run(nprocs[i], order, n, 0), run(nprocs[i], order, n, 1));
+  }
+
+  exit(0);
+}
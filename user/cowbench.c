@@ -0,0 +1,116 @@
+//
+// Copy-on-write fork stress benchmark.
+//
+// The parent touches NPAGES pages and then forks NCHILD children at
+// once. Every child checks and then writes each shared page, so each
+// page's reference count is raised and dropped concurrently from all
+// harts. The kernel's own timers (see kernel/vmstat.h) report how long
+// uvmcopy() and the copy-on-write fault handler took.
+//
+// usage: cowbench [nchild [npages [rounds]]]
+//
+
+#include "kernel/types.h"
+#include "kernel/riscv.h"
+#include "kernel/vmstat.h"
+#include "user/user.h"
+
+#define NCHILD 8
+#define NPAGES 256
+#define ROUNDS 4
+
+void
+child(char *mem, int npages)
+{
+  char *p;
+
+  for(p = mem; p < mem + npages * PGSIZE; p += PGSIZE){
+    if(*(int*)p != (p - mem) / PGSIZE){
+      printf("cowbench: child %d saw wrong data\n", getpid());
+      exit(1);
+    }
+    *(int*)p = getpid();
+  }
+  exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int nchild = NCHILD, npages = NPAGES, rounds = ROUNDS;
+  int i, r, pid, status, fail = 0;
+  struct vmstat st0, st1;
+  uint64 nfork, ncow;
+  char *mem, *p;
+  uint t0, t1;
+
+  if(argc > 1)
+    nchild = atoi(argv[1]);
+  if(argc > 2)
+    npages = atoi(argv[2]);
+  if(argc > 3)
+    rounds = atoi(argv[3]);
+
+  mem = sbrk(npages * PGSIZE);
+  if(mem == (char*)-1){
+    printf("cowbench: sbrk failed\n");
+    exit(1);
+  }
+  for(p = mem; p < mem + npages * PGSIZE; p += PGSIZE)
+    *(int*)p = (p - mem) / PGSIZE;
+
+  if(vmstat(&st0) < 0){
+    printf("cowbench: vmstat failed\n");
+    exit(1);
+  }
+  t0 = uptime();
+
+  for(r = 0; r < rounds; r++){
+    for(i = 0; i < nchild; i++){
+      pid = fork();
+      if(pid < 0){
+        printf("cowbench: fork failed\n");
+        exit(1);
+      }
+      if(pid == 0)
+        child(mem, npages);
+    }
+    for(i = 0; i < nchild; i++){
+      wait(&status);
+      if(status != 0)
+        fail = 1;
+    }
+  }
+
+  t1 = uptime();
+  vmstat(&st1);
+
+  // The parent's own pages must be untouched by its children.
+  for(p = mem; p < mem + npages * PGSIZE; p += PGSIZE){
+    if(*(int*)p != (p - mem) / PGSIZE)
+      fail = 1;
+  }
+
+  nfork = st1.nuvmcopy - st0.nuvmcopy;
+  ncow = st1.ncowfault - st0.ncowfault;
+
+  printf("cowbench: %d rounds of %d children, %d pages, %d ticks\n",
+         rounds, nchild, npages, t1 - t0);
+  printf("uvmcopy: %l calls, %l time units, %l per call\n",
+         nfork, st1.uvmcopy_time - st0.uvmcopy_time,
+         nfork ? (st1.uvmcopy_time - st0.uvmcopy_time) / nfork : 0);
+  printf("cow fault: %l faults, %l time units, %l per fault\n",
+         ncow, st1.cowfault_time - st0.cowfault_time,
+         ncow ? (st1.cowfault_time - st0.cowfault_time) / ncow : 0);
+  printf("cow fault: %l reused the page without copying\n",
+         st1.ncowreuse - st0.ncowreuse);
+  printf("page tables: %l shared, %l copied on write\n",
+         st1.nptshare - st0.nptshare, st1.nptcopy - st0.nptcopy);
+
+  if(fail){
+    printf("cowbench: FAILED\n");
+    exit(1);
+  }
+  printf("cowbench: OK\n");
+  exit(0);
+}
@@ -74,5 +74,11 @@ dev_files_init(void)
 	if (mknod("/dev/uptime", 5, 0) != 0)
 		return -1;
 
+	if (mknod("/dev/slabinfo", 6, 0) != 0)
+		return -1;
+
+	if (mknod("/dev/wss", 7, 0) != 0)
+		return -1;
+
 	return 0;
 }
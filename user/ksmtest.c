@@ -0,0 +1,203 @@
+//
+// tests for merging pages with the same contents (see kernel/ksm.c).
+//
+
+#include "kernel/types.h"
+#include "kernel/riscv.h"
+#include "kernel/vmstat.h"
+#include "user/user.h"
+
+#define NPAGE   64
+#define NUNIQUE 16
+#define PTSPAN  (512 * PGSIZE)  // bytes mapped by one leaf page table
+#define TRIES   50              // sleeps of 10 ticks to wait for ksmd
+
+static void
+stats(struct vmstat *st)
+{
+  if(vmstat(st) < 0){
+    printf("vmstat failed\n");
+    exit(1);
+  }
+}
+
+// a fresh region of n pages, in leaf page tables of its own
+// so that they aren't shared with a forked process.
+static char *
+region(int n)
+{
+  char *p;
+  uint64 a;
+
+  a = (uint64)sbrk(0);
+  if(sbrk(PTSPAN - a % PTSPAN) == (char*)-1 ||
+     (p = sbrk(n * PGSIZE)) == (char*)-1){
+    printf("sbrk failed\n");
+    exit(1);
+  }
+  return p;
+}
+
+static void
+fill(char *mem, int n, int c)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    memset(mem + i * PGSIZE, c, PGSIZE);
+}
+
+static void
+check(char *s, char *mem, int n, int c)
+{
+  int i, j;
+
+  for(i = 0; i < n; i++){
+    for(j = 0; j < PGSIZE; j++){
+      if(mem[i * PGSIZE + j] != (char)c){
+        printf("%s: page %d byte %d is %d, not %d\n", s, i, j,
+               mem[i * PGSIZE + j], c);
+        exit(1);
+      }
+    }
+  }
+}
+
+// sleep until ksmd has merged at least n more pages than
+// st0 counted, and return how many it did.
+static int
+waitmerge(struct vmstat *st0, int n)
+{
+  struct vmstat st;
+  int i;
+
+  for(i = 0; i < TRIES; i++){
+    sleep(10);
+    stats(&st);
+    if(st.nksmmerge - st0->nksmmerge >= n)
+      break;
+  }
+  return st.nksmmerge - st0->nksmmerge;
+}
+
+// identical pages of one process are merged, unique ones left
+// alone, and a write to a merged page stays private to it.
+void
+mergetest()
+{
+  struct vmstat st0, st1;
+  char *mem, *uniq;
+  int i, n;
+
+  printf("merge: ");
+  mem = region(NPAGE);
+  uniq = sbrk(NUNIQUE * PGSIZE);
+  fill(mem, NPAGE, 0x5a);
+  for(i = 0; i < NUNIQUE; i++){
+    memset(uniq + i * PGSIZE, 0x5a, PGSIZE);
+    uniq[i * PGSIZE] = i;
+  }
+
+  stats(&st0);
+  n = waitmerge(&st0, NPAGE - 1);
+  if(n < NPAGE - 1){
+    printf("only %d pages merged\n", n);
+    exit(1);
+  }
+  stats(&st1);
+  if(st1.nksmshared == 0 || st1.nksmsharing < NPAGE){
+    printf("%d pages shared by %d\n", (int)st1.nksmshared,
+           (int)st1.nksmsharing);
+    exit(1);
+  }
+
+  check("merge", mem, NPAGE, 0x5a);
+  for(i = 0; i < NUNIQUE; i++){
+    if(uniq[i * PGSIZE] != i){
+      printf("unique page %d changed\n", i);
+      exit(1);
+    }
+  }
+
+  // copy-on-write breaks the merged pages apart again.
+  mem[3 * PGSIZE] = 1;
+  if(mem[2 * PGSIZE] != 0x5a || mem[4 * PGSIZE] != 0x5a){
+    printf("write leaked into other merged pages\n");
+    exit(1);
+  }
+  fill(mem, NPAGE, 0x33);
+  check("merge", mem, NPAGE, 0x33);
+  printf("ok (%d pages merged)\n", n);
+}
+
+// pages with the same contents in two processes are merged.
+void
+crosstest()
+{
+  struct vmstat st0;
+  char *mem;
+  int pid, n, xstatus;
+
+  printf("cross: ");
+  stats(&st0);
+  pid = fork();
+  if(pid < 0){
+    printf("fork failed\n");
+    exit(1);
+  }
+  mem = region(NPAGE);
+  fill(mem, NPAGE, 0x77);
+  if(pid == 0){
+    for(;;){
+      sleep(10);
+      check("cross child", mem, NPAGE, 0x77);
+    }
+  }
+
+  n = waitmerge(&st0, 2 * NPAGE - 1);
+  kill(pid);
+  wait(&xstatus);
+  if(n < 2 * NPAGE - 1){
+    printf("only %d pages merged\n", n);
+    exit(1);
+  }
+  check("cross", mem, NPAGE, 0x77);
+  printf("ok (%d pages merged)\n", n);
+}
+
+// pages of processes that haven't opted in are left alone.
+void
+optouttest()
+{
+  struct vmstat st0, st1;
+  char *mem;
+
+  printf("opt-out: ");
+  ksm(0);
+  mem = region(NPAGE);
+  fill(mem, NPAGE, 0x11);
+  stats(&st0);
+  sleep(5 * 10);
+  stats(&st1);
+  if(st1.nksmmerge != st0.nksmmerge){
+    printf("%d pages merged\n", (int)(st1.nksmmerge - st0.nksmmerge));
+    exit(1);
+  }
+  check("opt-out", mem, NPAGE, 0x11);
+  printf("ok\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  if(ksm(1) != 0){
+    printf("ksmtest: already opted in\n");
+    exit(1);
+  }
+  mergetest();
+  crosstest();
+  optouttest();
+
+  printf("ALL KSM TESTS PASSED\n");
+  exit(0);
+}
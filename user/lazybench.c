@@ -0,0 +1,148 @@
+//
+// Lazy-allocation page fault benchmark.
+//
+// Each test runs in its own process under each allocation policy
+// (see kernel/mman.h), grows the heap by a region with sbrk() and
+// touches one word per page of it in some order. Reports the page
+// faults taken per second and the megabytes touched per second, sbrk()
+// included, along with the pages the kernel's fault-around mapped
+// ahead of the faults (see uvm_fault_window() in kernel/vm.c).
+//
+// usage: lazybench [region-MB [test]]
+//
+
+#include "kernel/types.h"
+#include "kernel/riscv.h"
+#include "kernel/vmstat.h"
+#include "kernel/mman.h"
+#include "user/user.h"
+
+#define TIMEBASE 10000000  // time CSR frequency on qemu's virt machine (Hz)
+#define MB       (1024 * 1024)
+#define STRIDE   17        // pages between touches in the strided test
+
+static uint64 region = 16 * MB;
+
+static char *policies[] = {
+[VM_LAZY]        "lazy",
+[VM_FAULTAROUND] "faultaround",
+[VM_EAGER]       "eager",
+};
+
+void
+sequential(char *mem)
+{
+  char *p;
+
+  for(p = mem; p < mem + region; p += PGSIZE)
+    *(int*)p = 1;
+}
+
+void
+reverse(char *mem)
+{
+  char *p;
+
+  for(p = mem + region - PGSIZE; p >= mem; p -= PGSIZE)
+    *(int*)p = 1;
+}
+
+// Visit every page once, STRIDE pages apart (mod the region size),
+// so that no two faults in a row are adjacent.
+void
+strided(char *mem)
+{
+  uint64 npages, i;
+
+  npages = region / PGSIZE;
+  for(i = 0; i < npages; i++)
+    *(int*)(mem + (i * STRIDE % npages) * PGSIZE) = 1;
+}
+
+void
+bench(void f(char *), char *s, int policy)
+{
+  struct vmstat st0, st1;
+  uint64 t, nfault;
+  char *mem;
+
+  if(vmpolicy(policy) < 0){
+    printf("lazybench: vmpolicy failed\n");
+    exit(1);
+  }
+  if(vmstat(&st0) < 0){
+    printf("lazybench: vmstat failed\n");
+    exit(1);
+  }
+  t = r_time();
+  mem = sbrk(region);
+  if(mem == (char*)-1){
+    printf("lazybench: sbrk failed\n");
+    exit(1);
+  }
+  f(mem);
+  t = r_time() - t;
+  vmstat(&st1);
+
+  if(t == 0)
+    t = 1;
+  nfault = st1.nfault - st0.nfault;
+  printf("%s\t%s\t%l faults\t%l faults/sec\t%l MB/sec\t%l pages ahead\n",
+         s, policies[policy], nfault, nfault * TIMEBASE / t,
+         region * TIMEBASE / t / MB, st1.nfaultaround - st0.nfaultaround);
+}
+
+// run each test in its own process, so that it starts with a fresh
+// heap and fault-around window.
+int
+run(void f(char *), char *s, int policy)
+{
+  int pid;
+  int xstatus;
+
+  if((pid = fork()) < 0){
+    printf("lazybench: fork error\n");
+    exit(1);
+  }
+  if(pid == 0){
+    bench(f, s, policy);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    printf("lazybench: %s failed\n", s);
+  return xstatus == 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  char *n = 0;
+  int fail = 0, policy;
+
+  if(argc > 1)
+    region = (uint64)atoi(argv[1]) * MB;
+  if(argc > 2)
+    n = argv[2];
+
+  struct test {
+    void (*f)(char *);
+    char *s;
+  } tests[] = {
+    { sequential, "sequential"},
+    { reverse, "reverse"},
+    { strided, "strided"},
+    { 0, 0},
+  };
+
+  printf("lazybench: %d MB region\n", (int)(region / MB));
+  for(struct test *t = tests; t->s != 0; t++){
+    if(n != 0 && strcmp(t->s, n) != 0)
+      continue;
+    for(policy = VM_LAZY; policy <= VM_EAGER; policy++){
+      if(!run(t->f, t->s, policy))
+        fail = 1;
+    }
+  }
+  exit(fail);
+}
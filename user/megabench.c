@@ -0,0 +1,123 @@
+//
+// Megapage (2MB superpage) benchmark.
+//
+// Lazily allocates two heap regions of NMEGA 2MB chunks each. Every
+// page of the first is touched, so the kernel promotes each chunk to
+// a megapage once its last page faults in; in the second, the last
+// page of each chunk is left untouched, so it stays in 4096-byte
+// pages. Then times random page-stride reads over each region, which
+// miss the TLB far less often on megapages, and reports cycles per
+// read. Finally a forked child writes to the first region, which
+// splits the megapages it touches back into pages.
+//
+// usage: megabench [nmega [reads]]
+//
+
+#include "kernel/types.h"
+#include "kernel/riscv.h"
+#include "kernel/vmstat.h"
+#include "user/user.h"
+
+#define MEGA   (512 * PGSIZE)
+#define NMEGA  4
+#define NREADS 200000
+
+static uint64 seed = 1;
+
+static uint64
+rnd(void)
+{
+  seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  return seed >> 33;
+}
+
+// Touch every page of each chunk in [mem, mem + n chunks), except
+// the last page of each chunk if skiplast is set.
+void
+touch(char *mem, int n, int skiplast)
+{
+  char *p;
+  int i;
+
+  for(i = 0; i < n; i++){
+    for(p = mem + i * MEGA; p < mem + (i + 1) * MEGA; p += PGSIZE){
+      if(skiplast && p == mem + (i + 1) * MEGA - PGSIZE)
+        continue;
+      *(int*)p = (p - mem) / PGSIZE;
+    }
+  }
+}
+
+// Read a random touched page of [mem, mem + n chunks), nreads times,
+// and return the cycles taken per read.
+uint64
+readrand(char *mem, int n, int nreads)
+{
+  uint64 t0, page, sum;
+  int i;
+
+  sum = 0;
+  t0 = r_cycle();
+  for(i = 0; i < nreads; i++){
+    page = rnd() % (n * 511);  // skips the last page of each chunk
+    page += page / 511;
+    sum += *(int*)(mem + page * PGSIZE);
+  }
+  t0 = r_cycle() - t0;
+  if(sum == 0)
+    printf("megabench: no data\n");
+  return t0 / nreads;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n = NMEGA, nreads = NREADS, pid, status;
+  struct vmstat st0, st1, st2;
+  char *p, *a, *b;
+
+  if(argc > 1)
+    n = atoi(argv[1]);
+  if(argc > 2)
+    nreads = atoi(argv[2]);
+
+  // Room for two 2MB-aligned regions.
+  p = sbrk((2 * n + 1) * MEGA);
+  if(p == (char*)-1){
+    printf("megabench: sbrk failed\n");
+    exit(1);
+  }
+  a = (char*)(((uint64)p + MEGA - 1) & ~((uint64)MEGA - 1));
+  b = a + n * MEGA;
+
+  if(vmstat(&st0) < 0){
+    printf("megabench: vmstat failed\n");
+    exit(1);
+  }
+  touch(a, n, 0);
+  touch(b, n, 1);
+  vmstat(&st1);
+
+  printf("megabench: %d 2MB chunks per region, %d random reads\n",
+         n, nreads);
+  printf("promoted %l of %d chunks\n",
+         st1.nmegapromote - st0.nmegapromote, 2 * n);
+  printf("megapages\t%l cycles/read\n", readrand(a, n, nreads));
+  printf("pages\t\t%l cycles/read\n", readrand(b, n, nreads));
+
+  pid = fork();
+  if(pid < 0){
+    printf("megabench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    touch(a, n, 0);
+    exit(0);
+  }
+  wait(&status);
+  vmstat(&st2);
+  printf("demoted %l chunks after fork\n",
+         st2.nmegademote - st1.nmegademote);
+
+  exit(status);
+}
@@ -0,0 +1,139 @@
+//
+// Microbenchmark for the memset/memmove/memcmp routines in
+// kernel/mem.c, which the user library shares with the kernel.
+//
+// For each size class it reports bytes per cycle (to two decimal
+// places) for aligned and misaligned buffers, and for the page-sized
+// memzero_page/memcpy_page fast paths. Last, it reports the same for
+// read() of a file in the buffer cache, which is bound by the
+// kernel's copyout() (see kernel/vm.c).
+//
+// usage: membench [total-bytes-per-test]
+//
+
+#include "kernel/types.h"
+#include "kernel/riscv.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define TOTAL   (4*1024*1024)   // bytes processed per measurement
+#define MAXSIZE (64*1024)
+
+static int sizes[] = { 8, 64, 512, 4096, MAXSIZE };
+
+static char *src, *dst;
+
+// Print bytes/cycle as a fixed-point number.
+void
+report(char *name, int size, int misalign, uint64 bytes, uint64 cycles)
+{
+  uint64 r;
+
+  if(cycles == 0)
+    cycles = 1;
+  r = bytes * 100 / cycles;
+  printf("%s\t%d\t%s\t%d.%d%d bytes/cycle\n", name, size,
+         misalign ? "unaligned" : "aligned",
+         (int)(r / 100), (int)(r / 10 % 10), (int)(r % 10));
+}
+
+void
+bench(int size, int misalign, uint64 total)
+{
+  uint64 i, n, t0;
+  char *d, *s;
+
+  n = total / size;
+  if(n == 0)
+    n = 1;
+  d = dst + misalign;
+  s = src + 2 * misalign;
+
+  t0 = r_cycle();
+  for(i = 0; i < n; i++)
+    memset(d, i, size);
+  report("memset", size, misalign, n * size, r_cycle() - t0);
+
+  t0 = r_cycle();
+  for(i = 0; i < n; i++)
+    memmove(d, s, size);
+  report("memmove", size, misalign, n * size, r_cycle() - t0);
+
+  // Identical buffers, so memcmp has to look at every byte.
+  memmove(d, s, size);
+  t0 = r_cycle();
+  for(i = 0; i < n; i++){
+    if(memcmp(d, s, size) != 0){
+      printf("membench: memcmp mismatch\n");
+      exit(1);
+    }
+  }
+  report("memcmp", size, misalign, n * size, r_cycle() - t0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  uint64 total = TOTAL, i, n, t0;
+  char *p;
+  int j, fd;
+
+  if(argc > 1)
+    total = atoi(argv[1]);
+
+  // Page-aligned buffers with room for the misaligned tests.
+  p = sbrk(2 * MAXSIZE + 3 * PGSIZE);
+  if(p == (char*)-1){
+    printf("membench: sbrk failed\n");
+    exit(1);
+  }
+  src = (char*)PGROUNDUP((uint64)p);
+  dst = src + MAXSIZE + PGSIZE;
+  for(i = 0; i < MAXSIZE + 2; i++)
+    src[i] = i * 7;
+
+  for(j = 0; j < sizeof(sizes)/sizeof(sizes[0]); j++){
+    bench(sizes[j], 0, total);
+    bench(sizes[j], 1, total);
+  }
+
+  n = total / PGSIZE;
+  t0 = r_cycle();
+  for(i = 0; i < n; i++)
+    memzero_page(dst);
+  report("memzero_page", PGSIZE, 0, n * PGSIZE, r_cycle() - t0);
+
+  t0 = r_cycle();
+  for(i = 0; i < n; i++)
+    memcpy_page(dst, src);
+  report("memcpy_page", PGSIZE, 0, n * PGSIZE, r_cycle() - t0);
+
+  if(memcmp(dst, src, PGSIZE) != 0){
+    printf("membench: memcpy_page mismatch\n");
+    exit(1);
+  }
+
+  fd = open("membench.tmp", O_CREATE | O_RDWR);
+  if(fd < 0 || write(fd, src, MAXSIZE) != MAXSIZE){
+    printf("membench: cannot write membench.tmp\n");
+    exit(1);
+  }
+  close(fd);
+
+  n = total / MAXSIZE;
+  if(n == 0)
+    n = 1;
+  t0 = r_cycle();
+  for(i = 0; i < n; i++){
+    fd = open("membench.tmp", O_RDONLY);
+    if(fd < 0 || read(fd, dst, MAXSIZE) != MAXSIZE){
+      printf("membench: cannot read membench.tmp\n");
+      exit(1);
+    }
+    close(fd);
+  }
+  report("read", MAXSIZE, 0, n * MAXSIZE, r_cycle() - t0);
+  unlink("membench.tmp");
+
+  exit(0);
+}
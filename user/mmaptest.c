@@ -3,26 +3,54 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
 #include "kernel/riscv.h"
+#include "kernel/memlayout.h"
+#include "kernel/mman.h"
+#include "kernel/vmstat.h"
 #include "kernel/fs.h"
 #include "user/user.h"
 
 void mmap_test();
 void fork_test();
+void copy_test();
+void heap_test();
+void hole_test();
+void split_test();
+void protect_test();
+void many_test();
+void share_test();
+void rw_test();
+void private_test();
+void clean_test();
+void dirty_test();
+void batch_test();
+void msync_test();
+void offset_test();
+void sequential_test();
 char buf[BSIZE];
 
 #define MAP_FAILED ((char *) -1)
-
-#define PROT_READ 0x1
-#define PROT_WRITE 0x10
-
-#define MAP_SHARED 0x1
-#define MAP_PRIVATE 0x10
+#define NMAP 100  // mappings at once in many_test
 
 int
 main(int argc, char *argv[])
 {
   mmap_test();
   fork_test();
+  copy_test();
+  heap_test();
+  hole_test();
+  split_test();
+  protect_test();
+  many_test();
+  share_test();
+  rw_test();
+  private_test();
+  clean_test();
+  dirty_test();
+  batch_test();
+  msync_test();
+  offset_test();
+  sequential_test();
   printf("mmaptest: all tests succeeded\n");
   exit(0);
 }
@@ -82,6 +110,119 @@ makefile(const char *f)
     err("close");
 }
 
+//
+// create a file of npage pages, each filled with 'a' plus
+// its number, and then tail bytes of 'z'.
+//
+void
+makepages(const char *f, int npage, int tail)
+{
+  int i, j;
+
+  unlink(f);
+  int fd = open(f, O_WRONLY | O_CREATE);
+  if (fd == -1)
+    err("open");
+  for (i = 0; i < npage; i++) {
+    memset(buf, 'a' + i, BSIZE);
+    for (j = 0; j < PGSIZE/BSIZE; j++) {
+      if (write(fd, buf, BSIZE) != BSIZE)
+        err("write makepages");
+    }
+  }
+  memset(buf, 'z', BSIZE);
+  for (; tail > 0; tail -= j) {
+    j = tail < BSIZE ? tail : BSIZE;
+    if (write(fd, buf, j) != j)
+      err("write makepages");
+  }
+  if (close(fd) == -1)
+    err("close");
+}
+
+//
+// map npage pages of file f from offset off, without
+// keeping it open.
+//
+char *
+map(const char *f, int npage, int prot, int flags, int off)
+{
+  char *p;
+  int fd;
+
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  p = mmap(0, npage*PGSIZE, prot, flags, fd, off);
+  if (p == MAP_FAILED)
+    err("mmap");
+  if (close(fd) == -1)
+    err("close");
+  return p;
+}
+
+//
+// run f(a) in a child, and return whether it was killed.
+//
+int
+faults(void (*f)(char *), char *a)
+{
+  int pid, xstatus;
+
+  if ((pid = fork()) < 0)
+    err("fork");
+  if (pid == 0) {
+    f(a);
+    exit(0);
+  }
+  wait(&xstatus);
+  return xstatus == -1;
+}
+
+void
+stats(struct vmstat *st)
+{
+  if (vmstat(st) == -1)
+    err("vmstat");
+}
+
+//
+// check that page i of file f starts with c.
+//
+void
+checkpage(const char *f, int i, char c)
+{
+  static char page[PGSIZE];
+  int fd, j;
+
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open");
+  for (j = 0; j <= i; j++) {
+    if (read(fd, page, PGSIZE) != PGSIZE)
+      err("read checkpage");
+  }
+  if (close(fd) == -1)
+    err("close");
+  if (page[0] != c) {
+    printf("page %d is %c, not %c\n", i, page[0], c);
+    err("file mismatch");
+  }
+}
+
+void
+load(char *a)
+{
+  volatile char c;
+
+  c = *a;
+  (void)c;
+}
+
+void
+store(char *a)
+{
+  *a = 1;
+}
+
 void
 mmap_test(void)
 {
@@ -275,3 +416,586 @@ fork_test(void)
   printf("fork_test OK\n");
 }
 
+//
+// read() into and write() from mapped pages that haven't
+// been touched yet, so that the kernel has to read them in.
+//
+void
+copy_test(void)
+{
+  int fd, i;
+  char *p;
+  const char * const f = "mmap.dur";
+
+  printf("copy_test starting\n");
+  testname = "copy_test";
+
+  makefile(f);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  p = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap (6)");
+  if (close(fd) == -1)
+    err("close");
+
+  // write() the untouched mapping out to a second file.
+  if ((fd = open("mmap3", O_RDWR | O_CREATE)) == -1)
+    err("open mmap3");
+  if (write(fd, p, PGSIZE*2) != PGSIZE*2)
+    err("write from mapping");
+  if (close(fd) == -1)
+    err("close");
+  if (munmap(p, PGSIZE*2) == -1)
+    err("munmap (5)");
+
+  // read() it back into a fresh, untouched shared mapping of it.
+  if ((fd = open("mmap3", O_RDWR)) == -1)
+    err("open mmap3");
+  p = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap (7)");
+  if (read(fd, p, PGSIZE) != PGSIZE)
+    err("read into mapping");
+  for (i = 0; i < PGSIZE; i++)
+    if (p[i] != 'A')
+      err("read into mapping mismatch");
+  if (close(fd) == -1)
+    err("close");
+  _v1(p);
+  if (munmap(p, PGSIZE*2) == -1)
+    err("munmap (6)");
+  unlink("mmap3");
+  unlink(f);
+
+  printf("copy_test OK\n");
+}
+
+//
+// mapping a file leaves the heap where it was, and sbrk()
+// keeps growing it in place.
+//
+void
+heap_test(void)
+{
+  char *top, *p, *q;
+  const char * const f = "mmap.dur";
+
+  printf("heap_test starting\n");
+  testname = "heap_test";
+
+  makepages(f, 3, 0);
+  top = sbrk(0);
+  p = map(f, 3, PROT_READ | PROT_WRITE, MAP_PRIVATE, 0);
+  if ((uint64)p < MMAP_BASE)
+    err("file mapped below the mapping area");
+  q = sbrk(4*PGSIZE);
+  if (q != top || sbrk(0) != top + 4*PGSIZE)
+    err("heap moved");
+  memset(q, 0x5a, 4*PGSIZE);
+  if (p[0] != 'a' || p[2*PGSIZE] != 'c')
+    err("mapped file changed");
+  sbrk(-4*PGSIZE);
+  if (munmap(p, 3*PGSIZE) == -1)
+    err("munmap");
+  unlink(f);
+
+  printf("heap_test OK\n");
+}
+
+//
+// addresses between the heap and the mapped files, or
+// below a mapping, belong to no region.
+//
+void
+hole_test(void)
+{
+  char *p;
+  const char * const f = "mmap.dur";
+
+  printf("hole_test starting\n");
+  testname = "hole_test";
+
+  makepages(f, 1, 0);
+  p = map(f, 1, PROT_READ, MAP_PRIVATE, 0);
+  if (!faults(load, sbrk(0) + 16*PGSIZE) || !faults(load, p - PGSIZE) ||
+      !faults(load, p + PGSIZE))
+    err("access to a hole didn't fault");
+  if (munmap(p, PGSIZE) == -1)
+    err("munmap");
+  if (!faults(load, p))
+    err("access to an unmapped file didn't fault");
+  unlink(f);
+
+  printf("hole_test OK\n");
+}
+
+//
+// unmapping the middle of a mapping splits it, and the
+// hole left is the first one a new mapping fills.
+//
+void
+split_test(void)
+{
+  char *p, *q;
+  const char * const f = "mmap.dur";
+
+  printf("split_test starting\n");
+  testname = "split_test";
+
+  makepages(f, 3, 0);
+  p = map(f, 3, PROT_READ | PROT_WRITE, MAP_PRIVATE, 0);
+  if (munmap(p + PGSIZE, PGSIZE) == -1)
+    err("munmap (1)");
+  if (p[0] != 'a' || p[2*PGSIZE] != 'c')
+    err("pages around the hole lost");
+  if (!faults(load, p + PGSIZE))
+    err("unmapped page didn't fault");
+
+  q = map(f, 1, PROT_READ, MAP_PRIVATE, 0);
+  if (q != p + PGSIZE)
+    err("new mapping not in the hole");
+  if (q[0] != 'a')
+    err("new mapping mismatch");
+  if (munmap(p, 3*PGSIZE) == -1)
+    err("munmap (2)");
+  unlink(f);
+
+  printf("split_test OK\n");
+}
+
+//
+// mprotect() takes write permission away from heap pages,
+// and gives it back.
+//
+void
+protect_test(void)
+{
+  char *p;
+  int i;
+
+  printf("protect_test starting\n");
+  testname = "protect_test";
+
+  p = sbrk(4*PGSIZE);
+  memset(p, 0x11, 4*PGSIZE);
+  if (mprotect(p + PGSIZE, 2*PGSIZE, PROT_READ) == -1)
+    err("mprotect (1)");
+  if (!faults(store, p + PGSIZE) || !faults(store, p + 2*PGSIZE))
+    err("write to a read-only page didn't fault");
+  if (faults(store, p) || faults(store, p + 3*PGSIZE) ||
+      faults(load, p + PGSIZE))
+    err("allowed access faulted");
+  if (mprotect(p + PGSIZE, 2*PGSIZE, PROT_READ | PROT_WRITE) == -1)
+    err("mprotect (2)");
+  memset(p, 0x22, 4*PGSIZE);
+  for (i = 0; i < 4*PGSIZE; i++) {
+    if (p[i] != 0x22) {
+      printf("mismatch at %d, wanted 0x22, got 0x%x\n", i, p[i]);
+      err("mismatch after mprotect");
+    }
+  }
+  if (mprotect(sbrk(0) + 16*PGSIZE, PGSIZE, PROT_READ) == 0)
+    err("mprotect of a hole succeeded");
+  sbrk(-4*PGSIZE);
+
+  printf("protect_test OK\n");
+}
+
+//
+// many more mappings at once than the old fixed table held.
+//
+void
+many_test(void)
+{
+  char *p[NMAP];
+  int i;
+  const char * const f = "mmap.dur";
+
+  printf("many_test starting\n");
+  testname = "many_test";
+
+  makepages(f, 1, 0);
+  for (i = 0; i < NMAP; i++)
+    p[i] = map(f, 1, PROT_READ, MAP_PRIVATE, 0);
+  for (i = 0; i < NMAP; i++) {
+    if (p[i][0] != 'a')
+      err("mismatch");
+  }
+  for (i = 0; i < NMAP; i++) {
+    if (munmap(p[i], PGSIZE) == -1)
+      err("munmap");
+  }
+  unlink(f);
+
+  printf("many_test OK\n");
+}
+
+//
+// a child writes to its own shared mapping of a file, and to
+// the one it inherited; the parent sees both writes while the
+// child still has them mapped.
+//
+void
+share_test(void)
+{
+  char *p, *q, c;
+  int fds[2], done[2], pid, xstatus;
+  const char * const f = "mmap.dur";
+
+  printf("share_test starting\n");
+  testname = "share_test";
+
+  makepages(f, 4, 0);
+  p = map(f, 4, PROT_READ | PROT_WRITE, MAP_SHARED, 0);
+  if (p[0] != 'a')
+    err("mismatch before fork");
+  if (pipe(fds) == -1 || pipe(done) == -1)
+    err("pipe");
+  if ((pid = fork()) < 0)
+    err("fork");
+  if (pid == 0) {
+    q = map(f, 4, PROT_READ | PROT_WRITE, MAP_SHARED, 0);
+    q[PGSIZE] = 'x';
+    p[2*PGSIZE] = 'y';
+    write(fds[1], "x", 1);
+    read(done[0], &c, 1);
+    exit(0);
+  }
+  read(fds[0], &c, 1);
+  if (p[PGSIZE] != 'x')
+    err("child's mapping not shared");
+  if (p[2*PGSIZE] != 'y')
+    err("inherited mapping not shared");
+  write(done[1], "x", 1);
+  wait(&xstatus);
+  if (xstatus != 0)
+    err("child failed");
+  close(fds[0]);
+  close(fds[1]);
+  close(done[0]);
+  close(done[1]);
+  if (munmap(p, 4*PGSIZE) == -1)
+    err("munmap");
+  unlink(f);
+
+  printf("share_test OK\n");
+}
+
+//
+// read() sees writes through a shared mapping, and the
+// mapping sees write()s, before anything is unmapped.
+//
+void
+rw_test(void)
+{
+  char *p, b;
+  int fd;
+  const char * const f = "mmap.dur";
+
+  printf("rw_test starting\n");
+  testname = "rw_test";
+
+  makepages(f, 1, 0);
+  p = map(f, 1, PROT_READ | PROT_WRITE, MAP_SHARED, 0);
+  p[0] = 'x';
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  if (read(fd, &b, 1) != 1)
+    err("read");
+  if (b != 'x')
+    err("read() doesn't see write to mapping");
+  b = 'y';
+  if (write(fd, &b, 1) != 1)
+    err("write");
+  if (close(fd) == -1)
+    err("close");
+  if (p[1] != 'y')
+    err("mapping doesn't see write()");
+  if (munmap(p, PGSIZE) == -1)
+    err("munmap");
+  unlink(f);
+
+  printf("rw_test OK\n");
+}
+
+//
+// writes to a private mapping stay private to it, but it
+// sees writes to pages it hasn't written itself.
+//
+void
+private_test(void)
+{
+  char *p, *q, b;
+  int fd;
+  const char * const f = "mmap.dur";
+
+  printf("private_test starting\n");
+  testname = "private_test";
+
+  makepages(f, 2, 0);
+  p = map(f, 2, PROT_READ | PROT_WRITE, MAP_SHARED, 0);
+  q = map(f, 2, PROT_READ | PROT_WRITE, MAP_PRIVATE, 0);
+  if (q[0] != 'a')
+    err("private mapping mismatch");
+  q[0] = 'x';
+  if (p[0] != 'a')
+    err("write to private mapping shared");
+  p[PGSIZE] = 'y';
+  if (q[PGSIZE] != 'y')
+    err("private mapping doesn't see shared write");
+  if (munmap(q, 2*PGSIZE) == -1 || munmap(p, 2*PGSIZE) == -1)
+    err("munmap");
+
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open");
+  if (read(fd, &b, 1) != 1)
+    err("read");
+  if (close(fd) == -1)
+    err("close");
+  if (b != 'a')
+    err("write to private mapping reached the file");
+  unlink(f);
+
+  printf("private_test OK\n");
+}
+
+//
+// the number of pages written back to mapped files since
+// the statistics in st0 were taken.
+//
+int
+nwritten(struct vmstat *st0)
+{
+  struct vmstat st;
+
+  stats(&st);
+  return st.nwbpage - st0->nwbpage;
+}
+
+//
+// pages of a shared mapping only read, or never touched,
+// aren't written back.
+//
+void
+clean_test(void)
+{
+  struct vmstat st0;
+  volatile char *p;
+  int i;
+  const char * const f = "mmap.dur";
+
+  printf("clean_test starting\n");
+  testname = "clean_test";
+
+  makepages(f, 8, 0);
+  p = map(f, 8, PROT_READ | PROT_WRITE, MAP_SHARED, 0);
+  for (i = 0; i < 8; i += 2)
+    (void)p[i*PGSIZE];
+  stats(&st0);
+  if (munmap((char *)p, 8*PGSIZE) == -1)
+    err("munmap");
+  if (nwritten(&st0) != 0)
+    err("clean pages written");
+  unlink(f);
+
+  printf("clean_test OK\n");
+}
+
+//
+// munmap() writes back just the pages written to.
+//
+void
+dirty_test(void)
+{
+  struct vmstat st0;
+  volatile char *p;
+  int i;
+  const char * const f = "mmap.dur";
+
+  printf("dirty_test starting\n");
+  testname = "dirty_test";
+
+  makepages(f, 8, 0);
+  p = map(f, 8, PROT_READ | PROT_WRITE, MAP_SHARED, 0);
+  for (i = 0; i < 8; i++)
+    (void)p[i*PGSIZE];
+  p[2*PGSIZE] = 'x';
+  p[3*PGSIZE] = 'y';
+  p[6*PGSIZE] = 'z';
+  stats(&st0);
+  if (munmap((char *)p, 8*PGSIZE) == -1)
+    err("munmap");
+  if (nwritten(&st0) != 3) {
+    printf("%d pages written, not 3\n", nwritten(&st0));
+    err("wrong pages written");
+  }
+  checkpage(f, 2, 'x');
+  checkpage(f, 3, 'y');
+  checkpage(f, 6, 'z');
+  checkpage(f, 5, 'a' + 5);
+  unlink(f);
+
+  printf("dirty_test OK\n");
+}
+
+//
+// a run of dirty pages is written back in fewer log
+// transactions than pages.
+//
+void
+batch_test(void)
+{
+  struct vmstat st0, st1;
+  char *p;
+  int i;
+  const char * const f = "mmap.dur";
+
+  printf("batch_test starting\n");
+  testname = "batch_test";
+
+  makepages(f, 8, 0);
+  p = map(f, 8, PROT_READ | PROT_WRITE, MAP_SHARED, 0);
+  for (i = 0; i < 8; i++)
+    p[i*PGSIZE] = 'x';
+  stats(&st0);
+  if (munmap(p, 8*PGSIZE) == -1)
+    err("munmap");
+  stats(&st1);
+  if (st1.nwbpage - st0.nwbpage != 8 || st1.nwbop - st0.nwbop >= 8) {
+    printf("%d pages in %d transactions\n",
+           (int)(st1.nwbpage - st0.nwbpage), (int)(st1.nwbop - st0.nwbop));
+    err("pages not batched");
+  }
+  for (i = 0; i < 8; i++)
+    checkpage(f, i, 'x');
+  unlink(f);
+
+  printf("batch_test OK\n");
+}
+
+//
+// msync() writes dirty pages back and leaves them mapped
+// and clean.
+//
+void
+msync_test(void)
+{
+  struct vmstat st0;
+  char *p;
+  const char * const f = "mmap.dur";
+
+  printf("msync_test starting\n");
+  testname = "msync_test";
+
+  makepages(f, 8, 0);
+  p = map(f, 8, PROT_READ | PROT_WRITE, MAP_SHARED, 0);
+  p[0] = 'x';
+  stats(&st0);
+  if (msync(p, 8*PGSIZE, MS_SYNC) == -1 || nwritten(&st0) != 1)
+    err("msync didn't write the dirty page");
+  stats(&st0);
+  if (msync(p, 8*PGSIZE, MS_ASYNC) == -1 || nwritten(&st0) != 0)
+    err("second msync wrote pages");
+  p[PGSIZE] = 'y';
+  if (msync(p, 2*PGSIZE, MS_SYNC) == -1 || nwritten(&st0) != 1)
+    err("msync after a write didn't write it");
+  if (p[0] != 'x' || p[PGSIZE] != 'y')
+    err("mapping changed by msync");
+
+  if (msync(p + 8*PGSIZE, PGSIZE, MS_SYNC) == 0 ||
+      msync(p, PGSIZE, MS_SYNC | MS_ASYNC) == 0 ||
+      msync(p + 1, PGSIZE, MS_SYNC) == 0)
+    err("bad msync succeeded");
+  if (munmap(p, 8*PGSIZE) == -1)
+    err("munmap");
+  checkpage(f, 0, 'x');
+  checkpage(f, 1, 'y');
+  unlink(f);
+
+  printf("msync_test OK\n");
+}
+
+//
+// a mapping at a page-aligned offset maps the file from
+// there, and writes through it go back to the right pages;
+// an offset that isn't page-aligned is refused.
+//
+void
+offset_test(void)
+{
+  char *p, b;
+  int fd;
+  const char * const f = "mmap.dur";
+
+  printf("offset_test starting\n");
+  testname = "offset_test";
+
+  makepages(f, 6, 0);
+  p = map(f, 2, PROT_READ | PROT_WRITE, MAP_SHARED, 3*PGSIZE);
+  if (p[0] != 'd' || p[PGSIZE] != 'e' || p[2*PGSIZE - 1] != 'e')
+    err("mapping at an offset mismatch");
+  p[PGSIZE] = 'x';
+  if (munmap(p, 2*PGSIZE) == -1)
+    err("munmap (1)");
+
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  if (read(fd, &b, 1) != 1)
+    err("read");
+  if (b != 'a')
+    err("start of the file changed");
+  if (mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE, fd, 100) != MAP_FAILED ||
+      mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE, fd, PGSIZE + 1) != MAP_FAILED)
+    err("mmap at an unaligned offset succeeded");
+  if (close(fd) == -1)
+    err("close");
+  p = map(f, 1, PROT_READ, MAP_PRIVATE, 4*PGSIZE);
+  if (p[0] != 'x' || p[1] != 'e')
+    err("write through the mapping went astray");
+  if (munmap(p, PGSIZE) == -1)
+    err("munmap (2)");
+  unlink(f);
+
+  printf("offset_test OK\n");
+}
+
+//
+// reading a mapping through from start to end reads the
+// whole file ahead of the faults, and the part of the last
+// page past the end of the file is zero.
+//
+void
+sequential_test(void)
+{
+  struct vmstat st0, st1;
+  char *p;
+  int i;
+  const char * const f = "mmap.dur";
+
+  printf("sequential_test starting\n");
+  testname = "sequential_test";
+
+  makepages(f, 24, 100);
+  p = map(f, 25, PROT_READ, MAP_PRIVATE, 0);
+  stats(&st0);
+  for (i = 0; i < 24; i++) {
+    if (p[i*PGSIZE] != 'a' + i || p[i*PGSIZE + PGSIZE - 1] != 'a' + i) {
+      printf("page %d has %c\n", i, p[i*PGSIZE]);
+      err("mismatch");
+    }
+  }
+  if (p[24*PGSIZE + 99] != 'z' || p[24*PGSIZE + 100] != 0)
+    err("last page mismatch");
+  stats(&st1);
+  if (st1.nreadahead - st0.nreadahead < 25) {
+    printf("%d pages read ahead, not 25\n",
+           (int)(st1.nreadahead - st0.nreadahead));
+    err("file not read ahead");
+  }
+  if (munmap(p, 25*PGSIZE) == -1)
+    err("munmap");
+  unlink(f);
+
+  printf("sequential_test OK\n");
+}
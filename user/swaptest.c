@@ -0,0 +1,140 @@
+//
+// tests for swapping user memory out to disk (see kernel/swap.c).
+//
+
+#include "kernel/types.h"
+#include "kernel/memlayout.h"
+#include "kernel/riscv.h"
+#include "kernel/vmstat.h"
+#include "user/user.h"
+
+#define MB (1024 * 1024)
+
+// more than all of physical memory, but less than that
+// plus the swap space.
+static uint64 size = (PHYSTOP - KERNBASE) + 32 * MB;
+
+static char *heap;
+
+static void
+stats(struct vmstat *st)
+{
+  if(vmstat(st) < 0){
+    printf("vmstat failed\n");
+    exit(1);
+  }
+}
+
+// check that every page of the heap still holds its own
+// number, in pages [from, to).
+static void
+check(char *s, uint64 from, uint64 to)
+{
+  uint64 i;
+
+  for(i = from; i < to; i++){
+    if(*(uint64*)(heap + i * PGSIZE) != i){
+      printf("%s: page %d holds %d\n", s, (int)i,
+             (int)*(uint64*)(heap + i * PGSIZE));
+      exit(1);
+    }
+  }
+}
+
+// fill a heap larger than physical memory, and read it all back.
+void
+bigtest()
+{
+  struct vmstat st0, st1;
+  uint64 i, npages;
+
+  printf("big: ");
+  npages = size / PGSIZE;
+  heap = sbrk(size);
+  if(heap == (char*)-1){
+    printf("sbrk failed\n");
+    exit(1);
+  }
+  stats(&st0);
+  for(i = 0; i < npages; i++)
+    *(uint64*)(heap + i * PGSIZE) = i;
+  check("big", 0, npages);
+  stats(&st1);
+  if(st1.nswapout == st0.nswapout || st1.nswapin == st0.nswapin){
+    printf("nothing was swapped\n");
+    exit(1);
+  }
+  printf("ok (%d pages out, %d in)\n", (int)(st1.nswapout - st0.nswapout),
+         (int)(st1.nswapin - st0.nswapin));
+}
+
+// a child shares the parent's page tables, swapped-out pages
+// and all; both must see the same contents, and writes in
+// either must stay private.
+void
+forktest()
+{
+  uint64 i, npages;
+  int pid, xstatus;
+
+  printf("fork: ");
+  npages = size / PGSIZE;
+  pid = fork();
+  if(pid < 0){
+    printf("fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    check("fork child", 0, 64);
+    check("fork child", npages - 64, npages);
+    for(i = 0; i < 64; i++)
+      *(uint64*)(heap + i * PGSIZE) = 0;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+  check("fork parent", 0, npages);
+  printf("ok\n");
+}
+
+// the kernel reads swapped-out pages back in for system calls
+// too, including ones that copy with a spinlock held.
+void
+pipetest()
+{
+  int fds[2], n;
+  char *buf;
+
+  printf("pipe: ");
+  // by now, the start of the heap has been swapped out
+  // again while the rest was checked.
+  buf = heap;
+  if(pipe(fds) < 0){
+    printf("pipe failed\n");
+    exit(1);
+  }
+  if(write(fds[1], buf, 512) != 512){
+    printf("write from swapped-out memory failed\n");
+    exit(1);
+  }
+  n = read(fds[0], buf + PGSIZE + 8, 512);
+  if(n != 512 || memcmp(buf, buf + PGSIZE + 8, 512) != 0){
+    printf("read into swapped-out memory failed\n");
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  printf("ok\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  bigtest();
+  forktest();
+  pipetest();
+
+  printf("ALL SWAP TESTS PASSED\n");
+  exit(0);
+}
@@ -2,6 +2,8 @@
 
 struct stat;
 struct rtcdate;
+struct vmstat;
+struct wss;
 
 // system calls
 int fork(void);
@@ -32,22 +34,34 @@ int sigreturn(void);
 int symlink(const char *, const char *);
 void *mmap(void *, size_t, int, int, int, offset_t);
 int munmap(void *, size_t);
+int vmstat(struct vmstat *);
+uint64 kallocbench(int, int, int);
+char* sbrkflags(int, int);
+int vmpolicy(int);
+int wss(int, struct wss *);
+int ksm(int);
+int mprotect(void *, size_t, int);
+int msync(void *, size_t, int);
+
+// mem.c (shared with the kernel)
+void* memset(void*, int, uint);
+void* memmove(void*, const void*, uint);
+void* memcpy(void*, const void*, uint);
+int memcmp(const void*, const void*, uint);
+void memzero_page(void*);
+void memcpy_page(void*, const void*);
 
 // ulib.c
 int stat(const char*, struct stat*);
 char* strcpy(char*, const char*);
-void *memmove(void*, const void*, int);
 char* strchr(const char*, char c);
 int strcmp(const char*, const char*);
 void fprintf(int, const char*, ...);
 void printf(const char*, ...);
 char* gets(char*, int max);
 uint strlen(const char*);
-void* memset(void*, int, uint);
 void* malloc(uint);
 void free(void*);
 int atoi(const char*);
-int memcmp(const void *, const void *, uint);
-void *memcpy(void *, const void *, uint);
 void strcat(char *, const char *);
 char *strtok(char *, const char *);
@@ -7,6 +7,7 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/mman.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -1678,12 +1679,12 @@ iref(char *s)
 }
 
 // test that fork fails gracefully
-// the forktest binary also does this, but it runs out of proc entries first.
-// inside the bigger usertests binary, we run out of memory first.
+// the forktest binary also does this. there is no fixed limit on
+// the number of processes, so both run out of memory.
 void
 forktest(char *s)
 {
-  enum{ N = 1000 };
+  enum{ N = 10000 };
   int n, pid;
 
   for(n=0; n<N; n++){
@@ -1700,7 +1701,7 @@ forktest(char *s)
   }
 
   if(n == N){
-    printf("%s: fork claimed to work 1000 times!\n", s);
+    printf("%s: fork claimed to work %d times!\n", s, N);
     exit(1);
   }
 
@@ -1839,6 +1840,53 @@ kernmem(char *s)
 
 // if we run the system out of memory, does it clean up the last
 // failed allocation?
+// fork() with memory used up fails cleanly, wherever in copying
+// the parent it runs out, rather than panicking. The parent's
+// many regions make vma_copy() one of the places it can.
+void
+forkoom(char *s)
+{
+  enum { NREG = 400 };
+  char *a;
+  int i, n, pid;
+
+  a = sbrk(2 * NREG * PGSIZE);
+  if(a == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NREG; i++){
+    if(mprotect(a + 2 * i * PGSIZE, PGSIZE, PROT_READ) < 0){
+      printf("%s: mprotect failed\n", s);
+      exit(1);
+    }
+  }
+
+  // use up all of memory.
+  for(n = 64; n > 0; n /= 2)
+    while(sbrkflags(n * PGSIZE, SBRK_POPULATE) != (char*)-1)
+      ;
+
+  // give it back a page at a time until fork() works.
+  for(i = 0; ; i++){
+    pid = fork();
+    if(pid == 0)
+      exit(0);
+    if(pid > 0){
+      wait(0);
+      break;
+    }
+    if(sbrk(-PGSIZE) == (char*)-1){
+      printf("%s: fork never worked\n", s);
+      exit(1);
+    }
+  }
+  if(i == 0){
+    printf("%s: fork worked with memory used up\n", s);
+    exit(1);
+  }
+}
+
 void
 sbrkfail(char *s)
 {
@@ -2097,6 +2145,44 @@ stacktest(char *s)
     exit(xstatus);
 }
 
+// system calls must not copy to or from the stack guard page
+// either, even though the kernel could reach it.
+void
+stackcopytest(char *s)
+{
+  char *guard = (char *) (PGROUNDDOWN(r_sp()) - PGSIZE);
+  int fd, n;
+
+  fd = open("stackcopy", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  if(write(fd, "x", 1) != 1){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  n = write(fd, guard, 1);
+  if(n != -1){
+    printf("%s: write from the stack guard page returned %d\n", s, n);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("stackcopy", O_RDONLY);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  n = read(fd, guard, 1);
+  if(n != -1){
+    printf("%s: read into the stack guard page returned %d\n", s, n);
+    exit(1);
+  }
+  close(fd);
+  unlink("stackcopy");
+}
+
 // regression test. copyin(), copyout(), and copyinstr() used to cast
 // the virtual page address to uint, which (with certain wild system
 // call arguments) resulted in a kernel page faults.
@@ -2291,6 +2377,7 @@ main(int argc, char *argv[])
     {sbrkarg, "sbrkarg"},
     {validatetest, "validatetest"},
     {stacktest, "stacktest"},
+    {stackcopytest, "stackcopytest"},
     {opentest, "opentest"},
     {writetest, "writetest"},
     {writebig, "writebig"},
@@ -2308,6 +2395,7 @@ main(int argc, char *argv[])
     {dirfile, "dirfile"},
     {iref, "iref"},
     {forktest, "forktest"},
+    {forkoom, "forkoom"},
     {bigdir, "bigdir"}, // slow
     { 0, 0},
   };
@@ -43,3 +43,11 @@ entry("sigreturn");
 entry("symlink");
 entry("mmap");
 entry("munmap");
+entry("vmstat");
+entry("kallocbench");
+entry("sbrkflags");
+entry("vmpolicy");
+entry("wss");
+entry("ksm");
+entry("mprotect");
+entry("msync");
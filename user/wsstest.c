@@ -0,0 +1,189 @@
+//
+// tests for working-set sampling (see kernel/wss.c).
+//
+// Regions are kept under 2MB, so that the kernel doesn't map them
+// with megapages, which are sampled 512 pages at a time.
+//
+
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/riscv.h"
+#include "kernel/fcntl.h"
+#include "kernel/wss.h"
+#include "user/user.h"
+
+#define NPAGES 256    // pages in each test's region
+#define NHOT   64     // pages of it kept in use
+#define SLACK  32     // pages of stack, code &c touched besides
+
+static char *
+grow(int npages)
+{
+  char *p = sbrk(npages * PGSIZE);
+  if(p == (char*)-1){
+    printf("sbrk failed\n");
+    exit(1);
+  }
+  return p;
+}
+
+static void
+sample(struct wss *w)
+{
+  if(wss(0, w) < 0){
+    printf("wss failed\n");
+    exit(1);
+  }
+}
+
+// pages written since the last sample count as accessed,
+// and the others don't.
+void
+accessedtest()
+{
+  struct wss w;
+  char *p;
+  int i;
+
+  printf("accessed: ");
+  p = grow(NPAGES);
+  for(i = 0; i < NPAGES; i++)
+    p[i * PGSIZE] = 1;
+  sample(&w);
+  if(w.resident < NPAGES || w.accessed < NPAGES){
+    printf("%d resident %d accessed, expected %d\n",
+           (int)w.resident, (int)w.accessed, NPAGES);
+    exit(1);
+  }
+
+  for(i = 0; i < NHOT; i++)
+    p[i * PGSIZE] = 2;
+  sample(&w);
+  if(w.accessed < NHOT || w.accessed > NHOT + SLACK){
+    printf("%d accessed, expected %d\n", (int)w.accessed, NHOT);
+    exit(1);
+  }
+  sbrk(-NPAGES * PGSIZE);
+  printf("ok\n");
+}
+
+// pages that are only read don't count as dirty.
+void
+dirtytest()
+{
+  struct wss w0, w1, w2;
+  char *p;
+  int i, sum;
+
+  printf("dirty: ");
+  sample(&w0);
+  p = grow(NPAGES);
+  sum = 0;
+  for(i = 0; i < NPAGES; i++)
+    sum += p[i * PGSIZE];
+  sample(&w1);
+  if(sum != 0 || w1.dirty > w0.dirty + SLACK){
+    printf("%d dirty pages after reads\n", (int)(w1.dirty - w0.dirty));
+    exit(1);
+  }
+
+  for(i = 0; i < NHOT; i++)
+    p[i * PGSIZE] = 1;
+  sample(&w2);
+  if(w2.dirty < w1.dirty + NHOT || w2.dirty > w1.dirty + NHOT + SLACK){
+    printf("%d pages dirtied, expected %d\n",
+           (int)(w2.dirty - w1.dirty), NHOT);
+    exit(1);
+  }
+  sbrk(-NPAGES * PGSIZE);
+  printf("ok\n");
+}
+
+// pages left alone for longer than WSS_WINDOW ticks drop out of
+// the working-set estimate.
+void
+idletest()
+{
+  struct wss w;
+  uint64 idle;
+  char *p;
+  int i;
+
+  printf("idle: ");
+  p = grow(NPAGES);
+  for(i = 0; i < NPAGES; i++)
+    p[i * PGSIZE] = 1;
+  sample(&w);
+  if(w.estimate < NPAGES){
+    printf("estimate %d, expected at least %d\n", (int)w.estimate, NPAGES);
+    exit(1);
+  }
+
+  sleep(WSS_WINDOW + WSS_INTERVAL);
+  for(i = 0; i < NHOT; i++)
+    p[i * PGSIZE] = 2;
+  sample(&w);
+  if(w.estimate < NHOT || w.estimate > NHOT + SLACK){
+    printf("estimate %d, expected %d\n", (int)w.estimate, NHOT);
+    exit(1);
+  }
+  for(i = 1, idle = 0; i < WSS_NAGE; i++)
+    idle += w.age[i];
+  if(w.age[0] < NHOT || idle < NPAGES - NHOT){
+    printf("%d pages idle, expected %d\n", (int)idle, NPAGES - NHOT);
+    exit(1);
+  }
+  sbrk(-NPAGES * PGSIZE);
+  printf("ok\n");
+}
+
+// other processes can be looked up by pid, and show up
+// in /dev/wss.
+void
+reporttest()
+{
+  struct wss w;
+  char buf[512];
+  int fd, n, pid;
+
+  printf("report: ");
+  if(wss(-1, &w) != -1){
+    printf("wss of a bad pid succeeded\n");
+    exit(1);
+  }
+  pid = getpid();
+  if(wss(pid, &w) < 0 || w.pid != pid){
+    printf("wss(%d) failed\n", pid);
+    exit(1);
+  }
+
+  fd = open("/dev/wss", O_RDONLY);
+  if(fd < 0){
+    printf("open /dev/wss failed\n");
+    exit(1);
+  }
+  n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if(n <= 0){
+    printf("read /dev/wss failed\n");
+    exit(1);
+  }
+  buf[n] = 0;
+  if(strchr(buf, '\n') == 0){
+    printf("no lines in /dev/wss\n");
+    exit(1);
+  }
+  printf("ok\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  accessedtest();
+  dirtytest();
+  idletest();
+  reporttest();
+
+  printf("ALL WSS TESTS PASSED\n");
+  exit(0);
+}